@@ -0,0 +1,1088 @@
+// Copyright Splash Damage, Ltd. All Rights Reserved.
+
+#include "SDCollisionVisBVH.h"
+
+#include <Algo/Partition.h>
+#include <Algo/Unique.h>
+#include <Components/InstancedStaticMeshComponent.h>
+#include <Components/PrimitiveComponent.h>
+#include <Components/SkeletalMeshComponent.h>
+#include <EngineUtils.h>
+#include <HAL/ConsoleManager.h>
+#include <Math/VectorRegister.h>
+#include <PhysicalMaterials/PhysicalMaterial.h>
+#include <PhysicsEngine/BodyInstance.h>
+#include <PhysicsEngine/BodySetup.h>
+#include <Chaos/Convex.h>
+
+
+namespace SDCollisionVis
+{
+
+static TAutoConsoleVariable<int32> CVarSnapshotRebuildFrames(
+	TEXT("r.SDCollisionVis.Snapshot.RebuildFrames"),
+	0,
+	TEXT("Rebuild the BVH snapshot every N frames to pick up newly spawned bodies (0 = only when invalidated)."),
+	ECVF_Default);
+
+static TAutoConsoleVariable<float> CVarSnapshotRefitRebuildRatio(
+	TEXT("r.SDCollisionVis.Snapshot.RefitRebuildRatio"),
+	1.5f,
+	TEXT("Rebuild the BVH snapshot in the background once refitting around moving bodies has grown the total\n")
+	TEXT("surface area of its nodes by this factor since it was built (0 = never)."),
+	ECVF_Default);
+
+static FAutoConsoleCommand CVarSnapshotRebuild(
+	TEXT("r.SDCollisionVis.Snapshot.Rebuild()"),
+	TEXT("Throw away the current BVH snapshot and rebuild it in the background."),
+	FConsoleCommandDelegate::CreateLambda([]()
+	{
+		FModuleManager::LoadModuleChecked<FSDCollisionVisModule>("SDCollisionVis").GetCollisionSnapshotCache().Invalidate();
+	}));
+
+namespace
+{
+
+constexpr int32 GMaxLeafTriangles = 4;
+constexpr int32 GNumSAHBins = 16;
+constexpr int32 GMaxSAHDepth = 48;
+constexpr int32 GMaxTraversalDepth = 128;
+
+// Bodies we pull geometry from, for components with more than one body this is the body index.
+template<typename F>
+void ForEachBodyInstance(const UPrimitiveComponent* Component, F&& Func)
+{
+	if (const UInstancedStaticMeshComponent* ISMComponent = Cast<UInstancedStaticMeshComponent>(Component))
+	{
+		for (int32 BodyIndex = 0; BodyIndex < ISMComponent->InstanceBodies.Num(); ++BodyIndex)
+		{
+			if (FBodyInstance* BodyInstance = ISMComponent->InstanceBodies[BodyIndex])
+			{
+				Func(*BodyInstance, BodyIndex);
+			}
+		}
+	}
+	else if (const USkeletalMeshComponent* SkeletalMeshComponent = Cast<USkeletalMeshComponent>(Component))
+	{
+		for (int32 BodyIndex = 0; BodyIndex < SkeletalMeshComponent->Bodies.Num(); ++BodyIndex)
+		{
+			if (FBodyInstance* BodyInstance = SkeletalMeshComponent->Bodies[BodyIndex])
+			{
+				Func(*BodyInstance, BodyIndex);
+			}
+		}
+	}
+	else if (FBodyInstance* BodyInstance = Component->GetBodyInstance())
+	{
+		Func(*BodyInstance, INDEX_NONE);
+	}
+}
+
+FBodyInstance* FindBodyInstance(const UPrimitiveComponent* Component, int32 BodyIndex)
+{
+	if (const UInstancedStaticMeshComponent* ISMComponent = Cast<UInstancedStaticMeshComponent>(Component))
+	{
+		return ISMComponent->InstanceBodies.IsValidIndex(BodyIndex) ? ISMComponent->InstanceBodies[BodyIndex] : nullptr;
+	}
+	else if (const USkeletalMeshComponent* SkeletalMeshComponent = Cast<USkeletalMeshComponent>(Component))
+	{
+		return SkeletalMeshComponent->Bodies.IsValidIndex(BodyIndex) ? SkeletalMeshComponent->Bodies[BodyIndex] : nullptr;
+	}
+	return Component->GetBodyInstance();
+}
+
+FTransform GetBodyTransform(const FBodyInstance& BodyInstance)
+{
+	FTransform Transform = BodyInstance.GetUnrealWorldTransform();
+	Transform.SetScale3D(BodyInstance.Scale3D);
+	return Transform;
+}
+
+struct FTriangleSink
+{
+	TArray<FVector3f>& Vertices;
+	TArray<int32>& ElementIndices;
+	TArray<int32>& FaceIndices;
+	TArray<uint32>& MaterialIds;
+
+	void Add(const FVector& A, const FVector& B, const FVector& C, int32 ElementIndex, int32 FaceIndex, uint32 MaterialId)
+	{
+		Vertices.Add((FVector3f)A);
+		Vertices.Add((FVector3f)B);
+		Vertices.Add((FVector3f)C);
+		ElementIndices.Add(ElementIndex);
+		FaceIndices.Add(FaceIndex);
+		MaterialIds.Add(MaterialId);
+	}
+};
+
+void AddBox(FTriangleSink& Sink, const FTransform& Transform, const FVector& HalfExtent, int32 ElementIndex, uint32 MaterialId)
+{
+	FVector Corners[8];
+	for (int32 i = 0; i < 8; ++i)
+	{
+		Corners[i] = Transform.TransformPosition(FVector(	(i & 1) ? HalfExtent.X : -HalfExtent.X,
+															(i & 2) ? HalfExtent.Y : -HalfExtent.Y,
+															(i & 4) ? HalfExtent.Z : -HalfExtent.Z));
+	}
+
+	constexpr int32 Faces[6][4] =
+	{
+		{ 0, 2, 6, 4 }, { 1, 5, 7, 3 },	// -X, +X
+		{ 0, 4, 5, 1 }, { 2, 3, 7, 6 },	// -Y, +Y
+		{ 0, 1, 3, 2 }, { 4, 6, 7, 5 },	// -Z, +Z
+	};
+
+	for (int32 Face = 0; Face < 6; ++Face)
+	{
+		const int32* F = Faces[Face];
+		Sink.Add(Corners[F[0]], Corners[F[1]], Corners[F[2]], ElementIndex, Face * 2 + 0, MaterialId);
+		Sink.Add(Corners[F[0]], Corners[F[2]], Corners[F[3]], ElementIndex, Face * 2 + 1, MaterialId);
+	}
+}
+
+// Coarse lat-long sphere, HalfLength stretches the two hemispheres apart along Z to make a capsule.
+// The equator ring is emitted twice (once per hemisphere), so the band of triangles between them is the cylinder wall.
+void AddCapsule(FTriangleSink& Sink, const FTransform& Transform, float Radius, float HalfLength, int32 ElementIndex, uint32 MaterialId)
+{
+	constexpr int32 NumRings = 8;	// Must be even, so the hemispheres split cleanly
+	constexpr int32 NumSegments = 12;
+	constexpr int32 Equator = NumRings / 2;
+
+	// Ring is in [0, NumRings + 1], with Equator and Equator + 1 both on the equator.
+	auto Vertex = [&](int32 Ring, int32 Segment)
+	{
+		const bool bUpper = Ring <= Equator;
+		const double Theta = UE_DOUBLE_PI * (double)(bUpper ? Ring : Ring - 1) / (double)NumRings;
+		const double Phi = UE_DOUBLE_TWO_PI * (double)Segment / (double)NumSegments;
+		const double Offset = bUpper ? HalfLength : -HalfLength;
+		return Transform.TransformPosition(FVector(	Radius * FMath::Sin(Theta) * FMath::Cos(Phi),
+													Radius * FMath::Sin(Theta) * FMath::Sin(Phi),
+													Radius * FMath::Cos(Theta) + Offset));
+	};
+
+	// Spheres don't need the (zero height) cylinder band.
+	const int32 NumBands = (HalfLength > 0.0f) ? NumRings + 1 : NumRings;
+
+	int32 FaceIndex = 0;
+	for (int32 Band = 0; Band < NumBands; ++Band)
+	{
+		const int32 Ring = (HalfLength > 0.0f || Band < Equator) ? Band : Band + 1;
+		for (int32 Segment = 0; Segment < NumSegments; ++Segment)
+		{
+			const FVector A = Vertex(Ring, Segment);
+			const FVector B = Vertex(Ring + 1, Segment);
+			const FVector C = Vertex(Ring + 1, Segment + 1);
+			const FVector D = Vertex(Ring, Segment + 1);
+			Sink.Add(A, B, C, ElementIndex, FaceIndex++, MaterialId);
+			Sink.Add(A, C, D, ElementIndex, FaceIndex++, MaterialId);
+		}
+	}
+}
+
+void AddConvex(FTriangleSink& Sink, const FTransform& Transform, const FKConvexElem& Elem, int32 ElementIndex, uint32 MaterialId)
+{
+	// Prefer the cooked chaos convex, since that is what actually gets queried.
+	if (const Chaos::FConvex* Convex = Elem.GetChaosConvexMesh().GetReference())
+	{
+		for (int32 PlaneIndex = 0; PlaneIndex < Convex->NumPlanes(); ++PlaneIndex)
+		{
+			const int32 NumPlaneVertices = Convex->NumPlaneVertices(PlaneIndex);
+			if (NumPlaneVertices < 3)
+			{
+				continue;
+			}
+
+			const FVector A = Transform.TransformPosition((FVector)Convex->GetVertex(Convex->GetPlaneVertex(PlaneIndex, 0)));
+			for (int32 PlaneVertexIndex = 1; PlaneVertexIndex < NumPlaneVertices - 1; ++PlaneVertexIndex)
+			{
+				const FVector B = Transform.TransformPosition((FVector)Convex->GetVertex(Convex->GetPlaneVertex(PlaneIndex, PlaneVertexIndex)));
+				const FVector C = Transform.TransformPosition((FVector)Convex->GetVertex(Convex->GetPlaneVertex(PlaneIndex, PlaneVertexIndex + 1)));
+				Sink.Add(A, B, C, ElementIndex, PlaneIndex, MaterialId);
+			}
+		}
+		return;
+	}
+
+	for (int32 Index = 0; Index + 2 < Elem.IndexData.Num(); Index += 3)
+	{
+		Sink.Add(	Transform.TransformPosition(Elem.VertexData[Elem.IndexData[Index + 0]]),
+					Transform.TransformPosition(Elem.VertexData[Elem.IndexData[Index + 1]]),
+					Transform.TransformPosition(Elem.VertexData[Elem.IndexData[Index + 2]]),
+					ElementIndex, Index / 3, MaterialId);
+	}
+}
+
+uint32 GetMaterialId(const UPhysicalMaterial* Material)
+{
+	return Material ? Material->GetUniqueID() : 0u;
+}
+
+float GetSurfaceArea(const FBox3f& Box)
+{
+	if (!Box.IsValid)
+	{
+		return 0.0f;
+	}
+	const FVector3f Size = Box.GetSize();
+	return 2.0f * (Size.X * Size.Y + Size.Y * Size.Z + Size.Z * Size.X);
+}
+
+} // unnamed namespace
+
+
+uint32 FCollisionSnapshot::GetFilterHash(const FSDCollisionSettings& Settings)
+{
+	uint32 Hash = GetTypeHash(Settings.CollisionObjectQueryParams.ObjectTypesToQuery);
+	Hash = HashCombine(Hash, GetTypeHash((int32)Settings.CollisionQueryParams.MobilityType));
+	Hash = HashCombine(Hash, GetTypeHash((uint32)Settings.CollisionQueryParams.bTraceComplex));
+	return Hash;
+}
+
+TSharedPtr<FCollisionSnapshot> FCollisionSnapshot::Gather(UWorld* World, const FSDCollisionSettings& Settings)
+{
+	check(IsInGameThread());
+
+	TSharedPtr<FCollisionSnapshot> Snapshot = MakeShared<FCollisionSnapshot>();
+	if (!World)
+	{
+		return Snapshot;
+	}
+
+	const int32 ObjectTypesToQuery = Settings.CollisionObjectQueryParams.ObjectTypesToQuery;
+	const EQueryMobilityType MobilityType = Settings.CollisionQueryParams.MobilityType;
+	const bool bTraceComplex = Settings.CollisionQueryParams.bTraceComplex;
+
+	for (TActorIterator<AActor> ActorIt(World); ActorIt; ++ActorIt)
+	{
+		ActorIt->ForEachComponent<UPrimitiveComponent>(false, [&](const UPrimitiveComponent* Component)
+		{
+			if (!Component->IsRegistered() || !Component->IsQueryCollisionEnabled())
+			{
+				return;
+			}
+
+			if ((ObjectTypesToQuery & ECC_TO_BITFIELD(Component->GetCollisionObjectType())) == 0)
+			{
+				return;
+			}
+
+			const bool bDynamic = Component->Mobility == EComponentMobility::Movable;
+			if ((MobilityType == EQueryMobilityType::Static && bDynamic)
+				|| (MobilityType == EQueryMobilityType::Dynamic && !bDynamic))
+			{
+				return;
+			}
+
+			ForEachBodyInstance(Component, [&](FBodyInstance& BodyInstance, int32 BodyIndex)
+			{
+				UBodySetup* BodySetup = BodyInstance.GetBodySetup();
+				if (!BodySetup || !BodyInstance.IsValidBodyInstance())
+				{
+					return;
+				}
+
+				FBody& Body = Snapshot->Bodies.AddDefaulted_GetRef();
+				Body.Component = Component;
+				Body.BodyIndex = BodyIndex;
+				Body.bDynamic = bDynamic;
+				Body.Transform = GetBodyTransform(BodyInstance);
+				Body.PendingTransform = Body.Transform;
+
+				// Mirror which shapes chaos would pick for the query
+				const ECollisionTraceFlag TraceFlag = BodySetup->GetCollisionTraceFlag();
+				bool bUseComplex = bTraceComplex ? (TraceFlag != CTF_UseSimpleAsComplex) : (TraceFlag == CTF_UseComplexAsSimple);
+				if (BodySetup->TriMeshGeometries.IsEmpty())
+				{
+					bUseComplex = false;
+				}
+
+				if (bUseComplex)
+				{
+					TArray<UPhysicalMaterial*> ComplexMaterials;
+					BodyInstance.GetComplexPhysicalMaterials(ComplexMaterials);
+
+					TArray<uint32> MaterialIds;
+					for (const UPhysicalMaterial* Material : ComplexMaterials)
+					{
+						MaterialIds.Add(GetMaterialId(Material));
+					}
+
+					for (int32 MeshIndex = 0; MeshIndex < BodySetup->TriMeshGeometries.Num(); ++MeshIndex)
+					{
+						if (BodySetup->TriMeshGeometries[MeshIndex])
+						{
+							FMeshSource& Source = Body.Meshes.AddDefaulted_GetRef();
+							Source.Mesh = BodySetup->TriMeshGeometries[MeshIndex];
+							Source.ElementIndex = MeshIndex;
+							Source.MaterialIds = MaterialIds;
+						}
+					}
+				}
+				else
+				{
+					const uint32 MaterialId = GetMaterialId(BodyInstance.GetSimplePhysicalMaterial());
+					const FKAggregateGeom& AggGeom = BodySetup->AggGeom;
+					FTriangleSink Sink{ Body.Vertices, Body.ElementIndices, Body.FaceIndices, Body.MaterialIds };
+
+					// Element indices follow the FKAggregateGeom::GetElement ordering
+					int32 ElementIndex = 0;
+					for (const FKSphereElem& Elem : AggGeom.SphereElems)
+					{
+						AddCapsule(Sink, Elem.GetTransform(), Elem.Radius, 0.0f, ElementIndex++, MaterialId);
+					}
+					for (const FKBoxElem& Elem : AggGeom.BoxElems)
+					{
+						AddBox(Sink, Elem.GetTransform(), FVector(Elem.X, Elem.Y, Elem.Z) * 0.5, ElementIndex++, MaterialId);
+					}
+					for (const FKSphylElem& Elem : AggGeom.SphylElems)
+					{
+						AddCapsule(Sink, Elem.GetTransform(), Elem.Radius, Elem.Length * 0.5f, ElementIndex++, MaterialId);
+					}
+					for (const FKConvexElem& Elem : AggGeom.ConvexElems)
+					{
+						AddConvex(Sink, Elem.GetTransform(), Elem, ElementIndex++, MaterialId);
+					}
+				}
+
+				if (Body.Vertices.IsEmpty() && Body.Meshes.IsEmpty())
+				{
+					Snapshot->Bodies.Pop(EAllowShrinking::No);
+				}
+				else if (bDynamic)
+				{
+					Snapshot->DynamicBodies.Add(Snapshot->Bodies.Num() - 1);
+				}
+			});
+		});
+	}
+
+	return Snapshot;
+}
+
+void FCollisionSnapshot::AddTriangleMesh(FBody& Body, const FMeshSource& Source) const
+{
+	const Chaos::FTriangleMeshImplicitObject& Mesh = *Source.Mesh;
+	const Chaos::FTrimeshIndexBuffer& Elements = Mesh.Elements();
+	const int32 NumTriangles = Elements.GetNumTriangles();
+
+	Body.Vertices.Reserve(Body.Vertices.Num() + NumTriangles * 3);
+
+	for (int32 Triangle = 0; Triangle < NumTriangles; ++Triangle)
+	{
+		int32 I0, I1, I2;
+		if (Elements.RequiresLargeIndices())
+		{
+			const auto& I = Elements.GetLargeIndexBuffer()[Triangle];
+			I0 = I[0]; I1 = I[1]; I2 = I[2];
+		}
+		else
+		{
+			const auto& I = Elements.GetSmallIndexBuffer()[Triangle];
+			I0 = I[0]; I1 = I[1]; I2 = I[2];
+		}
+
+		Body.Vertices.Add(FVector3f(Mesh.Particles().GetX(I0)));
+		Body.Vertices.Add(FVector3f(Mesh.Particles().GetX(I1)));
+		Body.Vertices.Add(FVector3f(Mesh.Particles().GetX(I2)));
+
+		// Match what the scene query would have reported as the face index
+		const int32 ExternalFaceIndex = Mesh.GetExternalFaceIndexFromInternal(Triangle);
+		Body.FaceIndices.Add(ExternalFaceIndex != INDEX_NONE ? ExternalFaceIndex : Triangle);
+		Body.ElementIndices.Add(Source.ElementIndex);
+
+		const int32 MaterialIndex = Mesh.GetMaterialIndex(Triangle);
+		Body.MaterialIds.Add(Source.MaterialIds.IsValidIndex(MaterialIndex) ? Source.MaterialIds[MaterialIndex] : 0u);
+	}
+}
+
+void FCollisionSnapshot::Build()
+{
+	FBox WorldBounds(ForceInit);
+	int32 NumTriangles = 0;
+	for (FBody& Body : Bodies)
+	{
+		for (const FMeshSource& Source : Body.Meshes)
+		{
+			AddTriangleMesh(Body, Source);
+		}
+		Body.Meshes.Empty();
+
+		WorldBounds += Body.Transform.GetLocation();
+		NumTriangles += Body.Vertices.Num() / 3;
+	}
+
+	RebaseOrigin = WorldBounds.IsValid ? WorldBounds.GetCenter() : FVector::ZeroVector;
+
+	// Flatten into rebased world space
+	TArray<FVector3f> Positions;
+	TArray<FVector3f> Centroids;
+	TArray<FBox3f> Bounds;
+	TArray<int32> TriangleBody;
+	TArray<int32> TriangleLocal;
+	Positions.Reserve(NumTriangles * 3);
+	Centroids.Reserve(NumTriangles);
+	Bounds.Reserve(NumTriangles);
+	TriangleBody.Reserve(NumTriangles);
+	TriangleLocal.Reserve(NumTriangles);
+
+	for (int32 BodyIndex = 0; BodyIndex < Bodies.Num(); ++BodyIndex)
+	{
+		const FBody& Body = Bodies[BodyIndex];
+		FTransform Rebased = Body.Transform;
+		Rebased.AddToTranslation(-RebaseOrigin);
+
+		for (int32 Local = 0; Local < Body.Vertices.Num() / 3; ++Local)
+		{
+			const FVector3f A = (FVector3f)Rebased.TransformPosition((FVector)Body.Vertices[Local * 3 + 0]);
+			const FVector3f B = (FVector3f)Rebased.TransformPosition((FVector)Body.Vertices[Local * 3 + 1]);
+			const FVector3f C = (FVector3f)Rebased.TransformPosition((FVector)Body.Vertices[Local * 3 + 2]);
+			Positions.Add(A);
+			Positions.Add(B);
+			Positions.Add(C);
+
+			FBox3f TriangleBounds(ForceInit);
+			TriangleBounds += A;
+			TriangleBounds += B;
+			TriangleBounds += C;
+			Bounds.Add(TriangleBounds);
+			Centroids.Add(TriangleBounds.GetCenter());
+			TriangleBody.Add(BodyIndex);
+			TriangleLocal.Add(Local);
+		}
+	}
+
+	TArray<int32> Order;
+	Order.SetNumUninitialized(NumTriangles);
+	for (int32 i = 0; i < NumTriangles; ++i)
+	{
+		Order[i] = i;
+	}
+
+	Nodes.Reset();
+	if (NumTriangles > 0)
+	{
+		Nodes.Reserve(FMath::Max(1, 2 * NumTriangles / GMaxLeafTriangles));
+		BuildNodes(Order, 0, NumTriangles, 0, Centroids, Bounds);
+	}
+
+	for (TArray<float>* Array : { &V0X, &V0Y, &V0Z, &E1X, &E1Y, &E1Z, &E2X, &E2Y, &E2Z, &Area2 })
+	{
+		Array->SetNumUninitialized(NumTriangles);
+	}
+	TriangleElementIndex.SetNumUninitialized(NumTriangles);
+	TriangleFaceIndex.SetNumUninitialized(NumTriangles);
+	TriangleMaterialId.SetNumUninitialized(NumTriangles);
+
+	// Parents and leaves, so refits only need to touch the part of the tree the dynamic bodies are in
+	TArray<int32> SlotLeaf;
+	SlotLeaf.SetNumUninitialized(NumTriangles);
+	NodeParents.SetNumUninitialized(Nodes.Num());
+	if (!Nodes.IsEmpty())
+	{
+		NodeParents[0] = INDEX_NONE;
+	}
+	for (int32 NodeIndex = 0; NodeIndex < Nodes.Num(); ++NodeIndex)
+	{
+		const FNode& Node = Nodes[NodeIndex];
+		if (Node.NumTriangles > 0)
+		{
+			for (int32 Slot = Node.Offset; Slot < (int32)(Node.Offset + Node.NumTriangles); ++Slot)
+			{
+				SlotLeaf[Slot] = NodeIndex;
+			}
+		}
+		else
+		{
+			NodeParents[NodeIndex + 1] = NodeIndex;
+			NodeParents[Node.Offset] = NodeIndex;
+		}
+	}
+	NodeQueued.Init(false, Nodes.Num());
+
+	for (FBody& Body : Bodies)
+	{
+		if (Body.bDynamic)
+		{
+			Body.TriangleSlots.SetNumUninitialized(Body.Vertices.Num() / 3);
+		}
+	}
+
+	for (int32 Slot = 0; Slot < NumTriangles; ++Slot)
+	{
+		const int32 Triangle = Order[Slot];
+		FBody& Body = Bodies[TriangleBody[Triangle]];
+		const int32 Local = TriangleLocal[Triangle];
+
+		WriteTriangle(Slot, Positions[Triangle * 3 + 0], Positions[Triangle * 3 + 1], Positions[Triangle * 3 + 2]);
+		TriangleElementIndex[Slot] = Body.ElementIndices[Local];
+		TriangleFaceIndex[Slot] = Body.FaceIndices[Local];
+		TriangleMaterialId[Slot] = Body.MaterialIds[Local];
+
+		if (Body.bDynamic)
+		{
+			Body.TriangleSlots[Local] = Slot;
+			Body.Leaves.Add(SlotLeaf[Slot]);
+		}
+	}
+
+	// Only dynamic bodies need to hang onto their source triangles for refitting
+	for (FBody& Body : Bodies)
+	{
+		Body.ElementIndices.Empty();
+		Body.FaceIndices.Empty();
+		Body.MaterialIds.Empty();
+		if (!Body.bDynamic)
+		{
+			Body.Vertices.Empty();
+		}
+		else
+		{
+			Body.Leaves.Sort();
+			Body.Leaves.SetNum(Algo::Unique(Body.Leaves));
+		}
+	}
+	RefitBodies.Reserve(DynamicBodies.Num());
+	RefitTransforms.Reserve(DynamicBodies.Num());
+
+	NodeArea = 0.0;
+	for (int32 NodeIndex = Nodes.Num() - 1; NodeIndex >= 0; --NodeIndex)
+	{
+		RefitNode(NodeIndex);
+	}
+	BuildNodeArea = NodeArea;
+}
+
+int32 FCollisionSnapshot::BuildNodes(TArray<int32>& Order, int32 Begin, int32 End, int32 Depth, TArrayView<const FVector3f> Centroids, TArrayView<const FBox3f> Bounds)
+{
+	const int32 NodeIndex = Nodes.AddDefaulted();
+	const int32 Count = End - Begin;
+
+	FBox3f CentroidBounds(ForceInit);
+	for (int32 i = Begin; i < End; ++i)
+	{
+		CentroidBounds += Centroids[Order[i]];
+	}
+
+	const FVector3f Extent = CentroidBounds.GetSize();
+	const int32 Axis = (Extent.X > Extent.Y) ? ((Extent.X > Extent.Z) ? 0 : 2) : ((Extent.Y > Extent.Z) ? 1 : 2);
+
+	if (Count <= GMaxLeafTriangles)
+	{
+		Nodes[NodeIndex].Offset = (uint32)Begin;
+		Nodes[NodeIndex].NumTriangles = (uint16)Count;
+		return NodeIndex;
+	}
+
+	// Binned SAH along the widest centroid axis, past a certain depth just split in half to keep the traversal stack bounded.
+	int32 Mid = Begin;
+	if (Extent[Axis] > UE_KINDA_SMALL_NUMBER && Depth < GMaxSAHDepth)
+	{
+		struct FBin
+		{
+			FBox3f Bounds = FBox3f(ForceInit);
+			int32 Count = 0;
+		};
+		FBin Bins[GNumSAHBins];
+
+		const float BinScale = (float)GNumSAHBins / Extent[Axis];
+		auto GetBin = [&](int32 Triangle)
+		{
+			return FMath::Clamp((int32)((Centroids[Triangle][Axis] - CentroidBounds.Min[Axis]) * BinScale), 0, GNumSAHBins - 1);
+		};
+
+		for (int32 i = Begin; i < End; ++i)
+		{
+			FBin& Bin = Bins[GetBin(Order[i])];
+			Bin.Bounds += Bounds[Order[i]];
+			Bin.Count++;
+		}
+
+		// Sweep from the right to get the cost of everything past each split
+		float RightArea[GNumSAHBins];
+		int32 RightCount[GNumSAHBins];
+		FBox3f Accum(ForceInit);
+		int32 AccumCount = 0;
+		for (int32 Bin = GNumSAHBins - 1; Bin > 0; --Bin)
+		{
+			Accum += Bins[Bin].Bounds;
+			AccumCount += Bins[Bin].Count;
+			RightArea[Bin] = GetSurfaceArea(Accum);
+			RightCount[Bin] = AccumCount;
+		}
+
+		float BestCost = TNumericLimits<float>::Max();
+		int32 BestSplit = INDEX_NONE;
+		Accum = FBox3f(ForceInit);
+		AccumCount = 0;
+		for (int32 Split = 1; Split < GNumSAHBins; ++Split)
+		{
+			Accum += Bins[Split - 1].Bounds;
+			AccumCount += Bins[Split - 1].Count;
+			if (AccumCount == 0 || RightCount[Split] == 0)
+			{
+				continue;
+			}
+
+			const float Cost = GetSurfaceArea(Accum) * AccumCount + RightArea[Split] * RightCount[Split];
+			if (Cost < BestCost)
+			{
+				BestCost = Cost;
+				BestSplit = Split;
+			}
+		}
+
+		if (BestSplit != INDEX_NONE)
+		{
+			Mid = Begin + Algo::Partition(Order.GetData() + Begin, Count, [&](int32 Triangle)
+			{
+				return GetBin(Triangle) < BestSplit;
+			});
+		}
+	}
+
+	// Degenerate split (all centroids in one spot), just cut it in half
+	if (Mid == Begin || Mid == End)
+	{
+		Mid = Begin + Count / 2;
+	}
+
+	BuildNodes(Order, Begin, Mid, Depth + 1, Centroids, Bounds);
+	const int32 SecondChild = BuildNodes(Order, Mid, End, Depth + 1, Centroids, Bounds);
+
+	Nodes[NodeIndex].Offset = (uint32)SecondChild;
+	Nodes[NodeIndex].SplitAxis = (uint16)Axis;
+	return NodeIndex;
+}
+
+void FCollisionSnapshot::WriteTriangle(int32 Slot, const FVector3f& A, const FVector3f& B, const FVector3f& C)
+{
+	const FVector3f E1 = B - A;
+	const FVector3f E2 = C - A;
+
+	V0X[Slot] = A.X; V0Y[Slot] = A.Y; V0Z[Slot] = A.Z;
+	E1X[Slot] = E1.X; E1Y[Slot] = E1.Y; E1Z[Slot] = E1.Z;
+	E2X[Slot] = E2.X; E2Y[Slot] = E2.Y; E2Z[Slot] = E2.Z;
+	Area2[Slot] = FVector3f::CrossProduct(E1, E2).Length();
+}
+
+void FCollisionSnapshot::RefitNode(int32 NodeIndex)
+{
+	FNode& Node = Nodes[NodeIndex];
+	FBox3f NodeBounds(ForceInit);
+
+	if (Node.NumTriangles > 0)
+	{
+		for (int32 Slot = Node.Offset; Slot < (int32)(Node.Offset + Node.NumTriangles); ++Slot)
+		{
+			const FVector3f V0(V0X[Slot], V0Y[Slot], V0Z[Slot]);
+			NodeBounds += V0;
+			NodeBounds += V0 + FVector3f(E1X[Slot], E1Y[Slot], E1Z[Slot]);
+			NodeBounds += V0 + FVector3f(E2X[Slot], E2Y[Slot], E2Z[Slot]);
+		}
+	}
+	else
+	{
+		const FNode& Left = Nodes[NodeIndex + 1];
+		const FNode& Right = Nodes[Node.Offset];
+		NodeBounds += FBox3f(Left.BoundsMin, Left.BoundsMax);
+		NodeBounds += FBox3f(Right.BoundsMin, Right.BoundsMax);
+	}
+
+	// Nodes start out zeroed, so this is a no-op the first time round.
+	NodeArea -= GetSurfaceArea(FBox3f(Node.BoundsMin, Node.BoundsMax));
+	NodeArea += GetSurfaceArea(NodeBounds);
+
+	Node.BoundsMin = NodeBounds.Min;
+	Node.BoundsMax = NodeBounds.Max;
+}
+
+bool FCollisionSnapshot::UpdateDynamicBodies()
+{
+	check(IsInGameThread());
+
+	FScopeLock ScopeLock(&PendingCS);
+	for (int32 BodyIndex : DynamicBodies)
+	{
+		FBody& Body = Bodies[BodyIndex];
+		const UPrimitiveComponent* Component = Body.Component.Get();
+		const FBodyInstance* BodyInstance = Component ? FindBodyInstance(Component, Body.BodyIndex) : nullptr;
+		if (!BodyInstance || !BodyInstance->IsValidBodyInstance())
+		{
+			return false;
+		}
+
+		const FTransform Transform = GetBodyTransform(*BodyInstance);
+		if (!Transform.Equals(Body.PendingTransform, 0.01))
+		{
+			Body.PendingTransform = Transform;
+			Body.bTransformDirty = true;
+			bPendingRefit = true;
+		}
+	}
+	return true;
+}
+
+bool FCollisionSnapshot::HasPendingRefit()
+{
+	FScopeLock ScopeLock(&PendingCS);
+	return bPendingRefit;
+}
+
+void FCollisionSnapshot::ApplyPendingRefit()
+{
+	// One refit at a time, so an older set of transforms can never land after a newer one.
+	FScopeLock RefitLock(&RefitCS);
+
+	// Take a copy of the pending transforms and let go of PendingCS before waiting on the write lock,
+	// since that means waiting out other views' traces and the game thread needs PendingCS every frame.
+	{
+		FScopeLock ScopeLock(&PendingCS);
+		if (!bPendingRefit)
+		{
+			return;
+		}
+
+		RefitBodies.Reset();
+		RefitTransforms.Reset();
+		for (int32 BodyIndex : DynamicBodies)
+		{
+			FBody& Body = Bodies[BodyIndex];
+			if (Body.bTransformDirty)
+			{
+				RefitBodies.Add(BodyIndex);
+				RefitTransforms.Add(Body.PendingTransform);
+				Body.bTransformDirty = false;
+			}
+		}
+		bPendingRefit = false;
+	}
+
+	FWriteScopeLock WriteLock(Lock);
+
+	RefitNodeList.Reset();
+	for (int32 Index = 0; Index < RefitBodies.Num(); ++Index)
+	{
+		FBody& Body = Bodies[RefitBodies[Index]];
+		Body.Transform = RefitTransforms[Index];
+
+		FTransform Rebased = Body.Transform;
+		Rebased.AddToTranslation(-RebaseOrigin);
+		for (int32 Local = 0; Local < Body.TriangleSlots.Num(); ++Local)
+		{
+			WriteTriangle(	Body.TriangleSlots[Local],
+							(FVector3f)Rebased.TransformPosition((FVector)Body.Vertices[Local * 3 + 0]),
+							(FVector3f)Rebased.TransformPosition((FVector)Body.Vertices[Local * 3 + 1]),
+							(FVector3f)Rebased.TransformPosition((FVector)Body.Vertices[Local * 3 + 2]));
+		}
+
+		// Queue up the leaves and their ancestors, stopping at the first one another leaf already queued.
+		for (int32 Leaf : Body.Leaves)
+		{
+			for (int32 NodeIndex = Leaf; NodeIndex != INDEX_NONE && !NodeQueued[NodeIndex]; NodeIndex = NodeParents[NodeIndex])
+			{
+				NodeQueued[NodeIndex] = true;
+				RefitNodeList.Add(NodeIndex);
+			}
+		}
+	}
+
+	// Children always come after their parent, so going from the highest index down visits them first.
+	RefitNodeList.Sort(TGreater<int32>());
+	for (int32 NodeIndex : RefitNodeList)
+	{
+		RefitNode(NodeIndex);
+		NodeQueued[NodeIndex] = false;
+	}
+	NumRefits++;
+
+	// Static triangles share leaves with the dynamic ones, so the tree only gets looser as bodies move around.
+	// Past a point it's cheaper to trace against a fresh one.
+	const float RebuildRatio = CVarSnapshotRefitRebuildRatio.GetValueOnAnyThread();
+	if (RebuildRatio > 0.0f && NodeArea > BuildNodeArea * RebuildRatio)
+	{
+		bNeedsRebuild = true;
+	}
+}
+
+void FCollisionSnapshot::TracePacket(TArrayView<const FTraceRay> Rays, FSnapshotPacketResult& OutResult) const
+{
+	check(Rays.Num() > 0 && Rays.Num() <= GSnapshotPacketSize);
+
+	// Transpose the rays into SoA, unused lanes copy the first ray but with a negative TMax so they never hit.
+	alignas(16) float OX[GSnapshotPacketSize], OY[GSnapshotPacketSize], OZ[GSnapshotPacketSize];
+	alignas(16) float DX[GSnapshotPacketSize], DY[GSnapshotPacketSize], DZ[GSnapshotPacketSize];
+	alignas(16) float IX[GSnapshotPacketSize], IY[GSnapshotPacketSize], IZ[GSnapshotPacketSize];
+	alignas(16) float TMax[GSnapshotPacketSize];
+
+	auto SafeInv = [](float V)
+	{
+		return 1.0f / (FMath::Abs(V) > 1e-20f ? V : (V < 0.0f ? -1e-20f : 1e-20f));
+	};
+
+	for (int32 Lane = 0; Lane < GSnapshotPacketSize; ++Lane)
+	{
+		const bool bActive = Lane < Rays.Num();
+		const FTraceRay& Ray = Rays[bActive ? Lane : 0];
+		const FVector3f Origin = (FVector3f)(Ray.Start - RebaseOrigin);
+		const FVector3f Direction = (FVector3f)Ray.Direction;
+
+		OX[Lane] = Origin.X;    OY[Lane] = Origin.Y;    OZ[Lane] = Origin.Z;
+		DX[Lane] = Direction.X; DY[Lane] = Direction.Y; DZ[Lane] = Direction.Z;
+		IX[Lane] = SafeInv(Direction.X);
+		IY[Lane] = SafeInv(Direction.Y);
+		IZ[Lane] = SafeInv(Direction.Z);
+		TMax[Lane] = bActive ? (float)HALF_WORLD_MAX : -1.0f;
+
+		OutResult.Distance[Lane] = -1.0f;
+		OutResult.Triangle[Lane] = INDEX_NONE;
+	}
+
+	if (Nodes.IsEmpty())
+	{
+		return;
+	}
+
+	const VectorRegister4Float RayOX = VectorLoadAligned(OX);
+	const VectorRegister4Float RayOY = VectorLoadAligned(OY);
+	const VectorRegister4Float RayOZ = VectorLoadAligned(OZ);
+	const VectorRegister4Float RayDX = VectorLoadAligned(DX);
+	const VectorRegister4Float RayDY = VectorLoadAligned(DY);
+	const VectorRegister4Float RayDZ = VectorLoadAligned(DZ);
+	const VectorRegister4Float RayIX = VectorLoadAligned(IX);
+	const VectorRegister4Float RayIY = VectorLoadAligned(IY);
+	const VectorRegister4Float RayIZ = VectorLoadAligned(IZ);
+	VectorRegister4Float RayTMax = VectorLoadAligned(TMax);
+
+	const VectorRegister4Float Zero = VectorZeroFloat();
+	const VectorRegister4Float One = VectorOneFloat();
+	const VectorRegister4Float DetEpsilon = VectorSetFloat1(1e-12f);
+
+	// Near child ordering is picked from the first ray, the packet is expected to be coherent.
+	const bool bNegativeDirection[3] = { DX[0] < 0.0f, DY[0] < 0.0f, DZ[0] < 0.0f };
+
+	int32 Stack[GMaxTraversalDepth];
+	int32 StackSize = 0;
+	Stack[StackSize++] = 0;
+
+	while (StackSize > 0)
+	{
+		const int32 NodeIndex = Stack[--StackSize];
+		const FNode& Node = Nodes[NodeIndex];
+
+		// Slab test all rays against the node at once
+		const VectorRegister4Float T0X = VectorMultiply(VectorSubtract(VectorSetFloat1(Node.BoundsMin.X), RayOX), RayIX);
+		const VectorRegister4Float T1X = VectorMultiply(VectorSubtract(VectorSetFloat1(Node.BoundsMax.X), RayOX), RayIX);
+		const VectorRegister4Float T0Y = VectorMultiply(VectorSubtract(VectorSetFloat1(Node.BoundsMin.Y), RayOY), RayIY);
+		const VectorRegister4Float T1Y = VectorMultiply(VectorSubtract(VectorSetFloat1(Node.BoundsMax.Y), RayOY), RayIY);
+		const VectorRegister4Float T0Z = VectorMultiply(VectorSubtract(VectorSetFloat1(Node.BoundsMin.Z), RayOZ), RayIZ);
+		const VectorRegister4Float T1Z = VectorMultiply(VectorSubtract(VectorSetFloat1(Node.BoundsMax.Z), RayOZ), RayIZ);
+
+		const VectorRegister4Float TNear = VectorMax(	VectorMax(VectorMin(T0X, T1X), VectorMin(T0Y, T1Y)),
+														VectorMax(VectorMin(T0Z, T1Z), Zero));
+		const VectorRegister4Float TFar = VectorMin(	VectorMin(VectorMax(T0X, T1X), VectorMax(T0Y, T1Y)),
+														VectorMin(VectorMax(T0Z, T1Z), RayTMax));
+
+		if (VectorMaskBits(VectorCompareLE(TNear, TFar)) == 0)
+		{
+			continue;
+		}
+
+		if (Node.NumTriangles == 0)
+		{
+			int32 Near = NodeIndex + 1;
+			int32 Far = (int32)Node.Offset;
+			if (bNegativeDirection[Node.SplitAxis])
+			{
+				Swap(Near, Far);
+			}
+
+			check(StackSize + 2 <= GMaxTraversalDepth);
+			Stack[StackSize++] = Far;
+			Stack[StackSize++] = Near;
+			continue;
+		}
+
+		for (int32 Slot = Node.Offset; Slot < (int32)(Node.Offset + Node.NumTriangles); ++Slot)
+		{
+			// Moller-Trumbore, one triangle against all rays
+			const VectorRegister4Float E1x = VectorSetFloat1(E1X[Slot]);
+			const VectorRegister4Float E1y = VectorSetFloat1(E1Y[Slot]);
+			const VectorRegister4Float E1z = VectorSetFloat1(E1Z[Slot]);
+			const VectorRegister4Float E2x = VectorSetFloat1(E2X[Slot]);
+			const VectorRegister4Float E2y = VectorSetFloat1(E2Y[Slot]);
+			const VectorRegister4Float E2z = VectorSetFloat1(E2Z[Slot]);
+
+			// P = D x E2
+			const VectorRegister4Float Px = VectorSubtract(VectorMultiply(RayDY, E2z), VectorMultiply(RayDZ, E2y));
+			const VectorRegister4Float Py = VectorSubtract(VectorMultiply(RayDZ, E2x), VectorMultiply(RayDX, E2z));
+			const VectorRegister4Float Pz = VectorSubtract(VectorMultiply(RayDX, E2y), VectorMultiply(RayDY, E2x));
+
+			const VectorRegister4Float Det = VectorMultiplyAdd(E1x, Px, VectorMultiplyAdd(E1y, Py, VectorMultiply(E1z, Pz)));
+			const VectorRegister4Float InvDet = VectorDivide(One, Det);
+
+			// T = O - V0
+			const VectorRegister4Float Tx = VectorSubtract(RayOX, VectorSetFloat1(V0X[Slot]));
+			const VectorRegister4Float Ty = VectorSubtract(RayOY, VectorSetFloat1(V0Y[Slot]));
+			const VectorRegister4Float Tz = VectorSubtract(RayOZ, VectorSetFloat1(V0Z[Slot]));
+
+			const VectorRegister4Float U = VectorMultiply(VectorMultiplyAdd(Tx, Px, VectorMultiplyAdd(Ty, Py, VectorMultiply(Tz, Pz))), InvDet);
+
+			// Q = T x E1
+			const VectorRegister4Float Qx = VectorSubtract(VectorMultiply(Ty, E1z), VectorMultiply(Tz, E1y));
+			const VectorRegister4Float Qy = VectorSubtract(VectorMultiply(Tz, E1x), VectorMultiply(Tx, E1z));
+			const VectorRegister4Float Qz = VectorSubtract(VectorMultiply(Tx, E1y), VectorMultiply(Ty, E1x));
+
+			const VectorRegister4Float V = VectorMultiply(VectorMultiplyAdd(RayDX, Qx, VectorMultiplyAdd(RayDY, Qy, VectorMultiply(RayDZ, Qz))), InvDet);
+			const VectorRegister4Float T = VectorMultiply(VectorMultiplyAdd(E2x, Qx, VectorMultiplyAdd(E2y, Qy, VectorMultiply(E2z, Qz))), InvDet);
+
+			VectorRegister4Float Mask = VectorCompareGT(VectorAbs(Det), DetEpsilon);
+			Mask = VectorBitwiseAnd(Mask, VectorCompareGE(U, Zero));
+			Mask = VectorBitwiseAnd(Mask, VectorCompareGE(V, Zero));
+			Mask = VectorBitwiseAnd(Mask, VectorCompareLE(VectorAdd(U, V), One));
+			Mask = VectorBitwiseAnd(Mask, VectorCompareGT(T, Zero));
+			Mask = VectorBitwiseAnd(Mask, VectorCompareLT(T, RayTMax));
+
+			if (int32 HitBits = VectorMaskBits(Mask))
+			{
+				RayTMax = VectorSelect(Mask, T, RayTMax);
+				for (int32 Lane = 0; Lane < GSnapshotPacketSize; ++Lane)
+				{
+					if (HitBits & (1 << Lane))
+					{
+						OutResult.Triangle[Lane] = Slot;
+					}
+				}
+			}
+		}
+	}
+
+	VectorStoreAligned(RayTMax, TMax);
+	for (int32 Lane = 0; Lane < Rays.Num(); ++Lane)
+	{
+		if (OutResult.Triangle[Lane] != INDEX_NONE)
+		{
+			OutResult.Distance[Lane] = TMax[Lane];
+		}
+	}
+}
+
+void FCollisionSnapshot::WriteHitRecord(int32 Triangle, float Distance, const FVector& RayDirection, FHitRecord& OutHit) const
+{
+	const FVector3f E1(E1X[Triangle], E1Y[Triangle], E1Z[Triangle]);
+	const FVector3f E2(E2X[Triangle], E2Y[Triangle], E2Z[Triangle]);
+
+	// Triangles are double sided, so always report the normal facing back along the ray.
+	FVector3f Normal = FVector3f::CrossProduct(E1, E2).GetSafeNormal();
+	if (FVector3f::DotProduct(Normal, (FVector3f)RayDirection) > 0.0f)
+	{
+		Normal = -Normal;
+	}
+
+	OutHit.Distance = Distance;
+	OutHit.Normal = Normal;
+	OutHit.ElementIndex = TriangleElementIndex[Triangle];
+	OutHit.FaceIndex = TriangleFaceIndex[Triangle];
+	OutHit.MaterialId = TriangleMaterialId[Triangle];
+	OutHit.TriangleArea2 = Area2[Triangle];
+}
+
+
+TSharedPtr<FCollisionSnapshot> FCollisionSnapshotCache::Get(UWorld* InWorld, const FSDCollisionSettings& Settings)
+{
+	check(IsInGameThread());
+
+	if (!InWorld)
+	{
+		return nullptr;
+	}
+
+	RemoveStaleEntries();
+	FEntry& Entry = Entries.FindOrAdd(InWorld);
+
+	const uint32 NewFilterHash = FCollisionSnapshot::GetFilterHash(Settings);
+	if (Entry.FilterHash != NewFilterHash)
+	{
+		Entry.FilterHash = NewFilterHash;
+		Entry.Current.Reset();
+		Entry.bInvalidated = true;
+	}
+
+	if (Entry.BuildTask && Entry.BuildTask->IsComplete())
+	{
+		if (Entry.BuildingFilterHash == Entry.FilterHash)
+		{
+			Entry.Current = MoveTemp(Entry.Building);
+		}
+		Entry.Building.Reset();
+		Entry.BuildTask = nullptr;
+	}
+
+	const int32 RebuildFrames = CVarSnapshotRebuildFrames.GetValueOnGameThread();
+	if (RebuildFrames > 0 && (GFrameCounter - Entry.LastBuildFrame) > (uint64)RebuildFrames)
+	{
+		Entry.bInvalidated = true;
+	}
+
+	if (Entry.Current && Entry.LastUpdateFrame != GFrameCounter)
+	{
+		Entry.LastUpdateFrame = GFrameCounter;
+		if (!Entry.Current->UpdateDynamicBodies())
+		{
+			Entry.bInvalidated = true;
+		}
+	}
+
+	if (Entry.Current && Entry.Current->NeedsRebuild() && !Entry.BuildTask)
+	{
+		Entry.bInvalidated = true;
+	}
+
+	if (Entry.bInvalidated && !Entry.BuildTask)
+	{
+		Entry.bInvalidated = false;
+		Entry.LastBuildFrame = GFrameCounter;
+
+		Entry.BuildingFilterHash = Entry.FilterHash;
+		Entry.Building = FCollisionSnapshot::Gather(InWorld, Settings);
+		Entry.BuildTask = FFunctionGraphTask::CreateAndDispatchWhenReady([Snapshot = Entry.Building]()
+		{
+			Snapshot->Build();
+		}, TStatId(), nullptr);
+	}
+
+	return Entry.Current;
+}
+
+void FCollisionSnapshotCache::RemoveStaleEntries()
+{
+	for (auto It = Entries.CreateIterator(); It; ++It)
+	{
+		if (!It->Key.IsValid() && (!It->Value.BuildTask || It->Value.BuildTask->IsComplete()))
+		{
+			It.RemoveCurrent();
+		}
+	}
+}
+
+void FCollisionSnapshotCache::Invalidate()
+{
+	for (TPair<TWeakObjectPtr<UWorld>, FEntry>& Pair : Entries)
+	{
+		Pair.Value.bInvalidated = true;
+	}
+}
+
+void FCollisionSnapshotCache::Reset()
+{
+	for (TPair<TWeakObjectPtr<UWorld>, FEntry>& Pair : Entries)
+	{
+		if (Pair.Value.BuildTask)
+		{
+			FTaskGraphInterface::Get().WaitUntilTaskCompletes(Pair.Value.BuildTask);
+		}
+	}
+	Entries.Reset();
+}
+
+} // namespace SDCollisionVis
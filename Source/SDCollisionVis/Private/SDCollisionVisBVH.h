@@ -0,0 +1,241 @@
+// Copyright Splash Damage, Ltd. All Rights Reserved.
+
+#pragma once
+
+
+#include <CoreMinimal.h>
+#include <Async/TaskGraphInterfaces.h>
+#include <Chaos/TriangleMeshImplicitObject.h>
+#include <Misc/ScopeRWLock.h>
+#include <UObject/WeakObjectPtrTemplates.h>
+
+#include "SDCollisionVisSettings.h"
+#include "SDCollisionVisTrace.h"
+
+#include <atomic>
+
+
+class UWorld;
+class UPrimitiveComponent;
+
+namespace SDCollisionVis
+{
+
+// Number of rays traced together through the BVH, matches the width of VectorRegister4Float.
+constexpr int32 GSnapshotPacketSize = 4;
+
+
+struct FSnapshotPacketResult
+{
+	float Distance[GSnapshotPacketSize];
+	int32 Triangle[GSnapshotPacketSize];    //< Index into the snapshot triangles, INDEX_NONE on a miss
+};
+
+
+// Plugin owned copy of the queried bodies in the scene, flattened into world space triangles with a BVH over them.
+// Tracing against this doesn't touch the physics scene at all, so it's free from whatever gameplay is doing to it mid-frame.
+//
+// Lifetime is:
+//   Gather (GameThread) -> Build (Any thread) -> [UpdateDynamicBodies (GameThread) -> ApplyPendingRefit -> Trace]...
+class FCollisionSnapshot
+{
+public:
+	// Collects every body which passes the query filters in Settings.
+	// Only cheap geometry is triangulated here, triangle meshes are referenced and expanded in Build().
+	static TSharedPtr<FCollisionSnapshot> Gather(UWorld* World, const FSDCollisionSettings& Settings);
+
+	// Hash of everything in the settings which affects which bodies (and shapes) end up in the snapshot.
+	static uint32 GetFilterHash(const FSDCollisionSettings& Settings);
+
+	// Triangulates the gathered bodies and builds the BVH.
+	void Build();
+
+	// Reads the current transform of all the dynamic bodies, picked up by the next ApplyPendingRefit.
+	// Returns false if any of the bodies have gone away, in which case the snapshot should be rebuilt.
+	bool UpdateDynamicBodies();
+
+	// Moves any dynamic bodies which changed since the last refit, and refits the BVH bounds around them.
+	// Should be called once before dispatching a batch of traces.
+	void ApplyPendingRefit();
+
+	// Whether UpdateDynamicBodies has seen anything move which ApplyPendingRefit hasn't picked up yet.
+	bool HasPendingRefit();
+
+	// Whether refitting has loosened the tree enough that it should be replaced (see r.SDCollisionVis.Snapshot.RefitRebuildRatio).
+	bool NeedsRebuild() const { return bNeedsRebuild; }
+
+	template<EVisualisationType VisType>
+	void TraceRayBatch(	const FSDCollisionSettings& Settings,
+						TArrayView<const FTraceRay> Rays,
+						TArrayView<FHitRecord> OutHits) const
+	{
+		check(Rays.Num() == OutHits.Num());
+
+		const bool bUseTimer = (VisType == EVisualisationType::RayTime)
+								|| (VisType == EVisualisationType::RayTimeEvenMiss)
+								|| Settings.bGatherAllAttributes
+								;
+
+		FReadScopeLock ReadLock(Lock);
+
+		for (int32 PacketStart = 0; PacketStart < Rays.Num(); PacketStart += GSnapshotPacketSize)
+		{
+			const int32 NumRays = FMath::Min(GSnapshotPacketSize, Rays.Num() - PacketStart);
+
+			FTimer Timer;
+			if (bUseTimer)
+			{
+				Timer.Start();
+			}
+
+			FSnapshotPacketResult Result;
+			TracePacket(Rays.Slice(PacketStart, NumRays), Result);
+
+			if (bUseTimer)
+			{
+				// Only have timings at packet granularity, so share it out.
+				Timer.End((uint32)NumRays);
+			}
+
+			for (int32 Lane = 0; Lane < NumRays; ++Lane)
+			{
+				FHitRecord& Hit = OutHits[PacketStart + Lane];
+				Hit = FHitRecord();
+				if (bUseTimer)
+				{
+					Hit.TraceTime = Timer.Get();
+				}
+
+				const int32 Triangle = Result.Triangle[Lane];
+				if (Triangle != INDEX_NONE)
+				{
+					WriteHitRecord(Triangle, Result.Distance[Lane], Rays[PacketStart + Lane].Direction, Hit);
+				}
+			}
+		}
+	}
+
+	int32 GetNumTriangles() const { return V0X.Num(); }
+	int32 GetNumNodes() const { return Nodes.Num(); }
+	int32 GetNumRefits() const { return NumRefits; }
+
+private:
+	struct FMeshSource
+	{
+		Chaos::FTriangleMeshImplicitObjectPtr Mesh;
+		int32 ElementIndex = INDEX_NONE;
+		TArray<uint32> MaterialIds;             //< Per mesh material index
+	};
+
+	struct FBody
+	{
+		TWeakObjectPtr<const UPrimitiveComponent> Component;
+		int32 BodyIndex = INDEX_NONE;           //< Which of the components bodies this came from
+		bool bDynamic = false;
+		bool bTransformDirty = false;
+		FTransform Transform;
+		FTransform PendingTransform;            //< Written by UpdateDynamicBodies, guarded by PendingCS
+
+		// Simple shapes, already triangulated in body space (3 vertices per triangle)
+		TArray<FVector3f> Vertices;
+		TArray<int32> ElementIndices;
+		TArray<int32> FaceIndices;
+		TArray<uint32> MaterialIds;
+
+		// Triangle meshes, expanded into the above during Build()
+		TArray<FMeshSource> Meshes;
+
+		// Where this bodies triangles ended up after the build, and the leaves holding them (only kept for dynamic bodies)
+		TArray<int32> TriangleSlots;
+		TArray<int32> Leaves;
+	};
+
+	struct alignas(32) FNode
+	{
+		FVector3f BoundsMin = FVector3f::ZeroVector;
+		uint32    Offset = 0;                   //< Leaf: first triangle. Interior: index of second child (the first is always the next node)
+		FVector3f BoundsMax = FVector3f::ZeroVector;
+		uint16    NumTriangles = 0;             //< 0 for interior nodes
+		uint16    SplitAxis = 0;
+	};
+	static_assert(sizeof(FNode) == 32, "Keep nodes at two to a cache line");
+
+	void AddTriangleMesh(FBody& Body, const FMeshSource& Source) const;
+	int32 BuildNodes(TArray<int32>& Order, int32 Begin, int32 End, int32 Depth, TArrayView<const FVector3f> Centroids, TArrayView<const FBox3f> Bounds);
+	void WriteTriangle(int32 Slot, const FVector3f& A, const FVector3f& B, const FVector3f& C);
+	void RefitNode(int32 NodeIndex);
+
+	void TracePacket(TArrayView<const FTraceRay> Rays, FSnapshotPacketResult& OutResult) const;
+	void WriteHitRecord(int32 Triangle, float Distance, const FVector& RayDirection, FHitRecord& OutHit) const;
+
+	// Everything is stored relative to this, to keep float precision sane in large worlds.
+	FVector RebaseOrigin = FVector::ZeroVector;
+
+	TArray<FBody> Bodies;
+	TArray<int32> DynamicBodies;
+
+	// Flattened BVH in depth first order
+	TArray<FNode> Nodes;
+	TArray<int32> NodeParents;                  //< INDEX_NONE for the root
+
+	// Triangles, in leaf order, as structure-of-arrays. Edges are pre-computed for the intersection test.
+	TArray<float> V0X, V0Y, V0Z;
+	TArray<float> E1X, E1Y, E1Z;
+	TArray<float> E2X, E2Y, E2Z;
+	TArray<float> Area2;
+	TArray<int32> TriangleElementIndex;
+	TArray<int32> TriangleFaceIndex;
+	TArray<uint32> TriangleMaterialId;
+
+	FCriticalSection PendingCS;
+	bool bPendingRefit = false;
+	mutable FRWLock Lock;
+	int32 NumRefits = 0;
+
+	// Refit scratch, guarded by RefitCS (and Lock for the nodes)
+	FCriticalSection RefitCS;
+	TArray<int32> RefitBodies;
+	TArray<FTransform> RefitTransforms;
+	TArray<int32> RefitNodeList;
+	TBitArray<> NodeQueued;
+
+	// Sum of the surface area of every node, when built and now
+	double BuildNodeArea = 0.0;
+	double NodeArea = 0.0;
+	std::atomic<bool> bNeedsRebuild = false;
+};
+
+
+// Keeps hold of a snapshot for each world being visualised, rebuilding it in the background
+// whenever the filters change. Views can be on different worlds (e.g. an editor viewport next to PIE),
+// so each world gets its own, rather than them taking turns throwing each other's away.
+class FCollisionSnapshotCache
+{
+public:
+	// Returns the latest fully built snapshot for World (if any), game thread only.
+	TSharedPtr<FCollisionSnapshot> Get(UWorld* World, const FSDCollisionSettings& Settings);
+	void Invalidate();
+	void Reset();
+
+private:
+	struct FEntry
+	{
+		uint32 FilterHash = 0;
+		uint64 LastBuildFrame = 0;
+		uint64 LastUpdateFrame = 0;             //< Several views can share a world, only look for moving bodies once a frame
+		TSharedPtr<FCollisionSnapshot> Current;
+		bool bInvalidated = true;
+
+		// In flight build, only picked up if it still matches FilterHash when it completes.
+		uint32 BuildingFilterHash = 0;
+		TSharedPtr<FCollisionSnapshot> Building;
+		FGraphEventRef BuildTask;
+	};
+
+	// Drops the entries for worlds which have gone away, once their builds have finished.
+	void RemoveStaleEntries();
+
+	TMap<TWeakObjectPtr<UWorld>, FEntry> Entries;
+};
+
+} // namespace SDCollisionVis
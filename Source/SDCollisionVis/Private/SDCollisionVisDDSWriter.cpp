@@ -0,0 +1,402 @@
+// Copyright Splash Damage, Ltd. All Rights Reserved.
+
+#include "SDCollisionVisDDSWriter.h"
+#include "SDCollisionVisModule.h"
+
+#include <Async/ParallelFor.h>
+#include <HAL/FileManager.h>
+#include <Misc/Paths.h>
+
+
+namespace SDCollisionVis
+{
+
+// See the DDS_HEADER and DDS_HEADER_DXT10 docs
+namespace DDS
+{
+	constexpr uint32 Magic = 0x20534444;	//< "DDS "
+	constexpr uint32 FourCCDX10 = 0x30315844;	//< "DX10"
+
+	constexpr uint32 FlagCaps = 0x1;
+	constexpr uint32 FlagHeight = 0x2;
+	constexpr uint32 FlagWidth = 0x4;
+	constexpr uint32 FlagPitch = 0x8;
+	constexpr uint32 FlagPixelFormat = 0x1000;
+	constexpr uint32 FlagMipMapCount = 0x20000;
+	constexpr uint32 FlagLinearSize = 0x80000;
+
+	constexpr uint32 PixelFormatFourCC = 0x4;
+
+	constexpr uint32 CapsComplex = 0x8;
+	constexpr uint32 CapsTexture = 0x1000;
+	constexpr uint32 Caps2CubemapAllFaces = 0x200 | 0xFC00;
+
+	constexpr uint32 DXGIFormatB8G8R8A8UnormSRGB = 91;
+	constexpr uint32 DXGIFormatBC7UnormSRGB = 99;
+	constexpr uint32 ResourceDimensionTexture2D = 3;
+	constexpr uint32 MiscFlagTextureCube = 0x4;
+}
+
+
+// Simplest of the BC7 modes, mode 6: one pair of RGBA 7.7.7.7 endpoints (plus a shared low bit each), and a 4 bit index per pixel.
+namespace BC7
+{
+	constexpr int32 Weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+	struct FMode6Fit
+	{
+		int32 Endpoints[2][4];
+		int32 PBits[2];
+		int32 Indices[16];
+		int64 Error = MAX_int64;
+	};
+
+	// Picks whichever low bit reconstructs the endpoint closest to what was asked for.
+	static void QuantiseEndpoint(const float (&Endpoint)[4], int32 (&OutQuantised)[4], int32& OutPBit)
+	{
+		float BestError = TNumericLimits<float>::Max();
+		for (int32 PBit = 0; PBit < 2; ++PBit)
+		{
+			int32 Quantised[4];
+			float Error = 0.0f;
+			for (int32 c = 0; c < 4; ++c)
+			{
+				Quantised[c] = FMath::Clamp(FMath::RoundToInt32((Endpoint[c] - (float)PBit) * 0.5f), 0, 127);
+				Error += FMath::Square((float)((Quantised[c] << 1) | PBit) - Endpoint[c]);
+			}
+			if (Error < BestError)
+			{
+				BestError = Error;
+				OutPBit = PBit;
+				FMemory::Memcpy(OutQuantised, Quantised, sizeof(Quantised));
+			}
+		}
+	}
+
+	// Quantises a pair of endpoints, and picks the nearest palette entry for each pixel.
+	static void Fit(const int32 (&Block)[16][4], const float (&A)[4], const float (&B)[4], FMode6Fit& OutFit)
+	{
+		QuantiseEndpoint(A, OutFit.Endpoints[0], OutFit.PBits[0]);
+		QuantiseEndpoint(B, OutFit.Endpoints[1], OutFit.PBits[1]);
+
+		int32 Palette[16][4];
+		for (int32 i = 0; i < 16; ++i)
+		{
+			for (int32 c = 0; c < 4; ++c)
+			{
+				const int32 E0 = (OutFit.Endpoints[0][c] << 1) | OutFit.PBits[0];
+				const int32 E1 = (OutFit.Endpoints[1][c] << 1) | OutFit.PBits[1];
+				Palette[i][c] = ((64 - Weights[i]) * E0 + Weights[i] * E1 + 32) >> 6;
+			}
+		}
+
+		OutFit.Error = 0;
+		for (int32 i = 0; i < 16; ++i)
+		{
+			int32 BestError = MAX_int32;
+			for (int32 p = 0; p < 16; ++p)
+			{
+				int32 Error = 0;
+				for (int32 c = 0; c < 4; ++c)
+				{
+					Error += FMath::Square(Palette[p][c] - Block[i][c]);
+				}
+				if (Error < BestError)
+				{
+					BestError = Error;
+					OutFit.Indices[i] = p;
+				}
+			}
+			OutFit.Error += BestError;
+		}
+	}
+
+	// Least squares endpoints for the indices a fit settled on, which can do better than any pair of actual colours.
+	static bool Refine(const int32 (&Block)[16][4], const FMode6Fit& Fit, float (&OutA)[4], float (&OutB)[4])
+	{
+		float AA = 0.0f, AB = 0.0f, BB = 0.0f;
+		float RhsA[4] = {}, RhsB[4] = {};
+		for (int32 i = 0; i < 16; ++i)
+		{
+			const float W = (float)Weights[Fit.Indices[i]] / 64.0f;
+			AA += FMath::Square(1.0f - W);
+			AB += (1.0f - W) * W;
+			BB += FMath::Square(W);
+			for (int32 c = 0; c < 4; ++c)
+			{
+				RhsA[c] += (1.0f - W) * (float)Block[i][c];
+				RhsB[c] += W * (float)Block[i][c];
+			}
+		}
+
+		const float Det = AA * BB - AB * AB;
+		if (FMath::Abs(Det) < UE_KINDA_SMALL_NUMBER)
+		{
+			return false;
+		}
+
+		for (int32 c = 0; c < 4; ++c)
+		{
+			OutA[c] = FMath::Clamp((BB * RhsA[c] - AB * RhsB[c]) / Det, 0.0f, 255.0f);
+			OutB[c] = FMath::Clamp((AA * RhsB[c] - AB * RhsA[c]) / Det, 0.0f, 255.0f);
+		}
+		return true;
+	}
+}
+
+// A single line through colour space has to cover the whole block, so the endpoints are picked along the block's
+// principal axis (which, for the common case of a block straddling two flat colours, lands on exactly those two),
+// tried against the two most distant colours in the block, and the better of those refined.
+static void CompressBlockBC7(const FColor* Pixels, int32 Stride, uint8* OutBlock)
+{
+	int32 Block[16][4];
+	float Mean[4] = {};
+	for (int32 i = 0; i < 16; ++i)
+	{
+		const FColor& Pixel = Pixels[(i / 4) * Stride + (i % 4)];
+		const int32 Channels[4] = { Pixel.R, Pixel.G, Pixel.B, Pixel.A };
+		for (int32 c = 0; c < 4; ++c)
+		{
+			Block[i][c] = Channels[c];
+			Mean[c] += (float)Channels[c] / 16.0f;
+		}
+	}
+
+	// Principal axis, by power iteration on the covariance, starting from the most distant pair of colours.
+	float Covariance[4][4] = {};
+	int32 FarthestA = 0, FarthestB = 0;
+	int32 FarthestDistance = -1;
+	for (int32 i = 0; i < 16; ++i)
+	{
+		for (int32 r = 0; r < 4; ++r)
+		{
+			for (int32 c = 0; c < 4; ++c)
+			{
+				Covariance[r][c] += ((float)Block[i][r] - Mean[r]) * ((float)Block[i][c] - Mean[c]);
+			}
+		}
+		for (int32 j = i + 1; j < 16; ++j)
+		{
+			int32 Distance = 0;
+			for (int32 c = 0; c < 4; ++c)
+			{
+				Distance += FMath::Square(Block[i][c] - Block[j][c]);
+			}
+			if (Distance > FarthestDistance)
+			{
+				FarthestDistance = Distance;
+				FarthestA = i;
+				FarthestB = j;
+			}
+		}
+	}
+
+	float Axis[4];
+	for (int32 c = 0; c < 4; ++c)
+	{
+		Axis[c] = (float)(Block[FarthestB][c] - Block[FarthestA][c]);
+	}
+	for (int32 Iteration = 0; Iteration < 8; ++Iteration)
+	{
+		float Next[4] = {};
+		float Length = 0.0f;
+		for (int32 r = 0; r < 4; ++r)
+		{
+			for (int32 c = 0; c < 4; ++c)
+			{
+				Next[r] += Covariance[r][c] * Axis[c];
+			}
+			Length = FMath::Max(Length, FMath::Abs(Next[r]));
+		}
+		if (Length <= UE_SMALL_NUMBER)
+		{
+			break;
+		}
+		for (int32 c = 0; c < 4; ++c)
+		{
+			Axis[c] = Next[c] / Length;
+		}
+	}
+
+	float AxisLength2 = 0.0f;
+	for (int32 c = 0; c < 4; ++c)
+	{
+		AxisLength2 += FMath::Square(Axis[c]);
+	}
+
+	// Endpoints where the colours furthest along the axis project onto it (just the mean, for a flat block).
+	float AxisA[4], AxisB[4];
+	{
+		float MinT = 0.0f, MaxT = 0.0f;
+		if (AxisLength2 > UE_SMALL_NUMBER)
+		{
+			MinT = TNumericLimits<float>::Max();
+			MaxT = TNumericLimits<float>::Lowest();
+			for (int32 i = 0; i < 16; ++i)
+			{
+				float T = 0.0f;
+				for (int32 c = 0; c < 4; ++c)
+				{
+					T += ((float)Block[i][c] - Mean[c]) * Axis[c];
+				}
+				T /= AxisLength2;
+				MinT = FMath::Min(MinT, T);
+				MaxT = FMath::Max(MaxT, T);
+			}
+		}
+		for (int32 c = 0; c < 4; ++c)
+		{
+			AxisA[c] = FMath::Clamp(Mean[c] + MinT * Axis[c], 0.0f, 255.0f);
+			AxisB[c] = FMath::Clamp(Mean[c] + MaxT * Axis[c], 0.0f, 255.0f);
+		}
+	}
+
+	float FarA[4], FarB[4];
+	for (int32 c = 0; c < 4; ++c)
+	{
+		FarA[c] = (float)Block[FarthestA][c];
+		FarB[c] = (float)Block[FarthestB][c];
+	}
+
+	BC7::FMode6Fit Best;
+	BC7::Fit(Block, AxisA, AxisB, Best);
+
+	BC7::FMode6Fit Candidate;
+	BC7::Fit(Block, FarA, FarB, Candidate);
+	if (Candidate.Error < Best.Error)
+	{
+		Best = Candidate;
+	}
+
+	float RefinedA[4], RefinedB[4];
+	if (Best.Error > 0 && BC7::Refine(Block, Best, RefinedA, RefinedB))
+	{
+		BC7::Fit(Block, RefinedA, RefinedB, Candidate);
+		if (Candidate.Error < Best.Error)
+		{
+			Best = Candidate;
+		}
+	}
+
+	int32 (&Endpoints)[2][4] = Best.Endpoints;
+	int32 (&PBits)[2] = Best.PBits;
+	int32 (&Indices)[16] = Best.Indices;
+
+	// The first index only gets 3 bits, its top bit being implied to be 0, so flip the endpoints if it needs it.
+	if (Indices[0] >= 8)
+	{
+		for (int32 c = 0; c < 4; ++c)
+		{
+			Swap(Endpoints[0][c], Endpoints[1][c]);
+		}
+		Swap(PBits[0], PBits[1]);
+		for (int32& Index : Indices)
+		{
+			Index = 15 - Index;
+		}
+	}
+
+	uint64 Bits[2] = { 0, 0 };
+	int32 BitOffset = 0;
+	auto Put = [&](uint64 Value, int32 NumBits)
+	{
+		for (int32 Bit = 0; Bit < NumBits; ++Bit, ++BitOffset)
+		{
+			Bits[BitOffset / 64] |= ((Value >> Bit) & 1) << (BitOffset % 64);
+		}
+	};
+
+	Put(1 << 6, 7);	//< Mode 6
+	for (int32 c = 0; c < 4; ++c)
+	{
+		Put(Endpoints[0][c], 7);
+		Put(Endpoints[1][c], 7);
+	}
+	Put(PBits[0], 1);
+	Put(PBits[1], 1);
+	Put(Indices[0], 3);
+	for (int32 i = 1; i < 16; ++i)
+	{
+		Put(Indices[i], 4);
+	}
+	check(BitOffset == 128);
+
+	FMemory::Memcpy(OutBlock, Bits, 16);
+}
+
+bool WriteCubemapDDS(const FString& Filename, int32 Resolution, TConstArrayView<TConstArrayView<FColor>> Faces, bool bCompressBC7)
+{
+	check(Faces.Num() == 6);
+
+	// BC7 works in 4x4 blocks, so odd sizes would need padding, which our resolutions never do (they're at least 32)
+	bCompressBC7 = bCompressBC7 && (Resolution % 4) == 0;
+
+	const int32 NumBlocks = Resolution / 4;
+	const int64 FaceSize = bCompressBC7 ? (int64)NumBlocks * NumBlocks * 16 : (int64)Resolution * Resolution * sizeof(FColor);
+
+	uint32 Header[31] = {};
+	Header[0] = 124;	//< Size
+	Header[1] = DDS::FlagCaps | DDS::FlagHeight | DDS::FlagWidth | DDS::FlagPixelFormat | DDS::FlagMipMapCount | (bCompressBC7 ? DDS::FlagLinearSize : DDS::FlagPitch);
+	Header[2] = (uint32)Resolution;
+	Header[3] = (uint32)Resolution;
+	Header[4] = bCompressBC7 ? (uint32)FaceSize : (uint32)(Resolution * sizeof(FColor));
+	Header[6] = 1;		//< Mip count
+	Header[18] = 32;	//< Pixel format size
+	Header[19] = DDS::PixelFormatFourCC;
+	Header[20] = DDS::FourCCDX10;
+	Header[26] = DDS::CapsComplex | DDS::CapsTexture;
+	Header[27] = DDS::Caps2CubemapAllFaces;
+
+	uint32 HeaderDX10[5] =
+	{
+		bCompressBC7 ? DDS::DXGIFormatBC7UnormSRGB : DDS::DXGIFormatB8G8R8A8UnormSRGB,
+		DDS::ResourceDimensionTexture2D,
+		DDS::MiscFlagTextureCube,
+		1,	//< Array size, in cubes
+		0,
+	};
+
+	// Only the compressed faces need a home of their own, the rest get written straight out of the faces given.
+	TArray64<uint8> Compressed;
+	if (bCompressBC7)
+	{
+		Compressed.SetNumUninitialized(FaceSize * Faces.Num());
+		ParallelFor(Faces.Num() * NumBlocks, [&](int32 Row)
+		{
+			const int32 Face = Row / NumBlocks;
+			const int32 BlockY = Row % NumBlocks;
+			uint8* OutRow = &Compressed[Face * FaceSize + (int64)BlockY * NumBlocks * 16];
+			for (int32 BlockX = 0; BlockX < NumBlocks; ++BlockX)
+			{
+				CompressBlockBC7(&Faces[Face][(BlockY * 4) * Resolution + BlockX * 4], Resolution, OutRow + BlockX * 16);
+			}
+		});
+	}
+
+	IFileManager::Get().MakeDirectory(*FPaths::GetPath(Filename), true);
+	TUniquePtr<FArchive> File(IFileManager::Get().CreateFileWriter(*Filename));
+	if (!File)
+	{
+		return false;
+	}
+
+	uint32 Magic = DDS::Magic;
+	*File << Magic;
+	File->Serialize(Header, sizeof(Header));
+	File->Serialize(HeaderDX10, sizeof(HeaderDX10));
+	if (bCompressBC7)
+	{
+		File->Serialize(Compressed.GetData(), Compressed.Num());
+	}
+	else
+	{
+		for (TConstArrayView<FColor> Face : Faces)
+		{
+			File->Serialize(const_cast<FColor*>(Face.GetData()), FaceSize);
+		}
+	}
+
+	return File->Close();
+}
+
+} // namespace SDCollisionVis
@@ -0,0 +1,17 @@
+// Copyright Splash Damage, Ltd. All Rights Reserved.
+
+#pragma once
+
+
+#include <CoreMinimal.h>
+
+
+namespace SDCollisionVis
+{
+
+// Writes a cubemap straight out of the faces it's given, rather than going through FDDSFile, which keeps a copy of every
+// face, and then another of the whole file. Faces are Resolution x Resolution, in +X, -X, +Y, -Y, +Z, -Z order.
+// When bCompressBC7 is set, the faces are compressed (in parallel) to BC7 first, which only needs a quarter of the space.
+bool WriteCubemapDDS(const FString& Filename, int32 Resolution, TConstArrayView<TConstArrayView<FColor>> Faces, bool bCompressBC7);
+
+} // namespace SDCollisionVis
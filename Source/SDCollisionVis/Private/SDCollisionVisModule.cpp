@@ -3,10 +3,15 @@
 
 #include "SDCollisionVisModule.h"
 #include "SDCollisionVisRenderer.h"
+#include "SDCollisionVisBVH.h"
+#include "SDCollisionVisTriangleAreaCache.h"
+#include "SDCollisionVisWorkerPool.h"
 
 #include <Interfaces/IPluginManager.h>
 #include <Modules/ModuleManager.h>
 #include <ShaderCore.h>
+#include <Engine/World.h>
+#include <Components/ActorComponent.h>
 
 
 #define LOCTEXT_NAMESPACE "SDCollisionVis"
@@ -23,13 +28,20 @@ void FSDCollisionVisModule::StartupModule()
 
 	FCoreDelegates::OnPostEngineInit.AddRaw(this, &FSDCollisionVisModule::OnPostEngineInit);
 	FCoreDelegates::OnEnginePreExit.AddRaw(this, &FSDCollisionVisModule::OnEnginePreExit);
-
+	FWorldDelegates::OnPostWorldInitialization.AddRaw(this, &FSDCollisionVisModule::OnPostWorldInitialization);
+	FWorldDelegates::OnWorldCleanup.AddRaw(this, &FSDCollisionVisModule::OnWorldCleanup);
+	UActorComponent::GlobalCreatePhysicsDelegate.AddRaw(this, &FSDCollisionVisModule::OnComponentPhysicsStateChanged);
+	UActorComponent::GlobalDestroyPhysicsDelegate.AddRaw(this, &FSDCollisionVisModule::OnComponentPhysicsStateChanged);
 }
 
 void FSDCollisionVisModule::ShutdownModule()
 {
 	FCoreDelegates::OnPostEngineInit.RemoveAll(this);
 	FCoreDelegates::OnEnginePreExit.RemoveAll(this);
+	FWorldDelegates::OnPostWorldInitialization.RemoveAll(this);
+	FWorldDelegates::OnWorldCleanup.RemoveAll(this);
+	UActorComponent::GlobalCreatePhysicsDelegate.RemoveAll(this);
+	UActorComponent::GlobalDestroyPhysicsDelegate.RemoveAll(this);
 }
 
 void FSDCollisionVisModule::OnPostEngineInit()
@@ -40,54 +52,198 @@ void FSDCollisionVisModule::OnPostEngineInit()
 	// memory backing it.
 	if (FApp::CanEverRender())
 	{
-		PruneUnusedViewFamilies = FTSTicker::GetCoreTicker().AddTicker(FTickerDelegate::CreateLambda([this](float)
+		PruneUnusedViews = FTSTicker::GetCoreTicker().AddTicker(FTickerDelegate::CreateLambda([this](float)
 		{
 			constexpr uint64 KeepAliveFrames = 30;
-			for (auto It = ViewFamilyData.CreateIterator(); It; ++It)
+			for (auto It = RealtimeViewData.CreateIterator(); It; ++It)
 			{
 				if ((GFrameCounter - It->Value->LastAccessed) > KeepAliveFrames)
 				{
+					ViewExtension->UnregisterViewData(It->Key);
 					It.RemoveCurrent();
 				}
 			}
+			if (RenderBufferPool)
+			{
+				RenderBufferPool->Prune(KeepAliveFrames);
+			}
+			if (RayScheduler)
+			{
+				RayScheduler->Prune();
+			}
 			return true;
 		}));
 	}
+
+	SDCollisionVis::StartHeadlessOfflineRender();
+
+	// Cached triangle areas hold a reference to their mesh, drop them once chaos has let go of it.
+	PruneTriangleAreaCache = FTSTicker::GetCoreTicker().AddTicker(FTickerDelegate::CreateLambda([](float)
+	{
+		SDCollisionVis::FTriangleAreaCache::Get().PruneReleased();
+		return true;
+	}), 1.0f);
 }
 
 void FSDCollisionVisModule::OnEnginePreExit()
 {
-	FTSTicker::GetCoreTicker().RemoveTicker(PruneUnusedViewFamilies);
-	PruneUnusedViewFamilies.Reset();
-	ViewFamilyData.Empty();
+	FTSTicker::GetCoreTicker().RemoveTicker(PruneUnusedViews);
+	PruneUnusedViews.Reset();
+	FTSTicker::GetCoreTicker().RemoveTicker(PruneTriangleAreaCache);
+	PruneTriangleAreaCache.Reset();
+	SDCollisionVis::FTriangleAreaCache::Get().Empty();
+	for (auto& Pair : RealtimeViewData)
+	{
+		Pair.Value->WaitForTraces();
+	}
+	RealtimeViewData.Empty();
+	if (ViewExtension)
+	{
+		ViewExtension->UnregisterAllViewData();
+	}
+	if (RenderBufferPool)
+	{
+		RenderBufferPool->Empty();
+		RenderBufferPool.Reset();
+	}
+	RayScheduler.Reset();
+	GameWorlds.Empty();
+	ServerWorld.Reset();
+	ServerWorldForPhysics = nullptr;
+	SDCollisionVis::FTraceWorkerPool::Get().Shutdown();
 	ViewExtension.Reset();
+	if (SnapshotCache)
+	{
+		SnapshotCache->Reset();
+		SnapshotCache.Reset();
+	}
+}
+
+void FSDCollisionVisModule::OnPostWorldInitialization(UWorld* World, const UWorld::InitializationValues IVS)
+{
+	// The net mode may not be known yet, so just remember the world and work out which is the server when asked.
+	if (World && World->IsGameWorld())
+	{
+		GameWorlds.AddUnique(World);
+	}
+}
+
+void FSDCollisionVisModule::OnWorldCleanup(UWorld* World, bool bSessionEnded, bool bCleanupResources)
+{
+	GameWorlds.Remove(World);
+	if (ServerWorld.Get() == World)
+	{
+		ServerWorld.Reset();
+		ServerWorldForPhysics = nullptr;
+	}
+
+	// Realtime traces can outlive the frame they were dispatched on, make sure none are still using the world.
+	for (auto& Pair : RealtimeViewData)
+	{
+		Pair.Value->WaitForTraces();
+	}
+}
+
+void FSDCollisionVisModule::OnComponentPhysicsStateChanged(UActorComponent* Component)
+{
+	const UWorld* ServerWorldPtr = ServerWorldForPhysics.load();
+	if (ServerWorldPtr && Component->GetWorld() == ServerWorldPtr)
+	{
+		++ServerPhysicsSceneGeneration;
+	}
+	else
+	{
+		++PhysicsSceneGeneration;
+	}
 }
 
+uint32 FSDCollisionVisModule::GetPhysicsSceneGeneration(const UWorld* World) const
+{
+	const UWorld* ServerWorldPtr = ServerWorldForPhysics.load();
+	return (ServerWorldPtr && World == ServerWorldPtr) ? ServerPhysicsSceneGeneration.load() : PhysicsSceneGeneration.load();
+}
 
-TSharedPtr<SDCollisionVis::FSDCollisionVisRealtimeViewData> FSDCollisionVisModule::GetRealtimeViewFamilyData(FSceneViewFamily& ViewFamily)
+UWorld* FSDCollisionVisModule::GetServerWorld()
 {
 	check(IsInGameThread());
 
-	if (ViewFamily.Views.IsEmpty())
+	if (UWorld* World = ServerWorld.Get())
 	{
-		return {};
+		return World;
+	}
+
+	// Only a handful of game worlds are ever around at once, so looking again each frame until a server turns up is cheap.
+	for (auto It = GameWorlds.CreateIterator(); It; ++It)
+	{
+		UWorld* World = It->Get();
+		if (!World)
+		{
+			It.RemoveCurrentSwap();
+		}
+		else if (World->GetNetMode() == NM_DedicatedServer)
+		{
+			ServerWorld = World;
+			ServerWorldForPhysics = World;
+			return World;
+		}
 	}
+	return nullptr;
+}
+
+
+TSharedPtr<SDCollisionVis::FSDCollisionVisRealtimeViewData> FSDCollisionVisModule::GetRealtimeViewData(const FSceneView& View)
+{
+	check(IsInGameThread());
 
-	uint32 ViewKey = ViewFamily.Views[0]->GetViewKey();
+	uint32 ViewKey = View.GetViewKey();
 	TSharedPtr<SDCollisionVis::FSDCollisionVisRealtimeViewData> Data;
-	if (TSharedPtr<SDCollisionVis::FSDCollisionVisRealtimeViewData>* Found = ViewFamilyData.Find(ViewKey))
+	if (TSharedPtr<SDCollisionVis::FSDCollisionVisRealtimeViewData>* Found = RealtimeViewData.Find(ViewKey))
 	{
 		Data = *Found;
 	}
 	else
 	{
 		Data = MakeShared<SDCollisionVis::FSDCollisionVisRealtimeViewData>();
-		ViewFamilyData.Add(ViewKey, Data);
+		RealtimeViewData.Add(ViewKey, Data);
+		ViewExtension->RegisterViewData(ViewKey, Data);
 	}
 
 	Data->LastAccessed = GFrameCounter;
 	return Data;
 }
 
+SDCollisionVis::FCollisionSnapshotCache& FSDCollisionVisModule::GetCollisionSnapshotCache()
+{
+	check(IsInGameThread());
+
+	if (!SnapshotCache)
+	{
+		SnapshotCache = MakeShared<SDCollisionVis::FCollisionSnapshotCache>();
+	}
+	return *SnapshotCache;
+}
+
+SDCollisionVis::FRenderBufferPool& FSDCollisionVisModule::GetRenderBufferPool()
+{
+	check(IsInGameThread());
+
+	if (!RenderBufferPool)
+	{
+		RenderBufferPool = MakeShared<SDCollisionVis::FRenderBufferPool>();
+	}
+	return *RenderBufferPool;
+}
+
+SDCollisionVis::FRealtimeRayScheduler& FSDCollisionVisModule::GetRayScheduler()
+{
+	check(IsInGameThread());
+
+	if (!RayScheduler)
+	{
+		RayScheduler = MakeShared<SDCollisionVis::FRealtimeRayScheduler>();
+	}
+	return *RayScheduler;
+}
+
 
 #undef LOCTEXT_NAMESPACE
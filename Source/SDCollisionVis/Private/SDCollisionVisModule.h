@@ -8,15 +8,23 @@
 #include <Modules/ModuleInterface.h>
 #include <Interfaces/IPluginManager.h>
 #include <Containers/Ticker.h>
+#include <Stats/Stats.h>
+#include <Engine/World.h>
 
+#include <atomic>
 
-class FSceneViewFamily;
+
+class FSceneView;
+class UActorComponent;
 
 namespace SDCollisionVis
 {
 
 class FSDCollisionVisRealtimeViewExtension;
 struct FSDCollisionVisRealtimeViewData;
+class FCollisionSnapshotCache;
+class FRenderBufferPool;
+class FRealtimeRayScheduler;
 
 } // SDCollisionVis
 
@@ -27,17 +35,43 @@ public:
 	virtual void StartupModule() override final;
 	virtual void ShutdownModule() override final;
 
-	TSharedPtr<SDCollisionVis::FSDCollisionVisRealtimeViewData> GetRealtimeViewFamilyData(FSceneViewFamily& ViewFamily);
+	TSharedPtr<SDCollisionVis::FSDCollisionVisRealtimeViewData> GetRealtimeViewData(const FSceneView& View);
+	SDCollisionVis::FCollisionSnapshotCache& GetCollisionSnapshotCache();
+	SDCollisionVis::FRenderBufferPool& GetRenderBufferPool();
+	SDCollisionVis::FRealtimeRayScheduler& GetRayScheduler();
+
+	// Bumped whenever a component creates or destroys its physics state, so converged views know to trace again.
+	// Counted separately for the dedicated server world, so the client's physics don't wake up views tracing the server.
+	uint32 GetPhysicsSceneGeneration(const UWorld* World) const;
+
+	// Dedicated server world running in this process (e.g. PIE with a dedicated server), if there is one.
+	// Resolved from the game worlds seen through world init/cleanup and cached until it's cleaned up.
+	UWorld* GetServerWorld();
 
 private:
 	void OnPostEngineInit();
 	void OnEnginePreExit();
+	void OnPostWorldInitialization(UWorld* World, const UWorld::InitializationValues IVS);
+	void OnWorldCleanup(UWorld* World, bool bSessionEnded, bool bCleanupResources);
+	void OnComponentPhysicsStateChanged(UActorComponent* Component);
 
 	// Stuff for realtime renderer
-	FTSTicker::FDelegateHandle																PruneUnusedViewFamilies;
+	FTSTicker::FDelegateHandle																PruneUnusedViews;
+	FTSTicker::FDelegateHandle																PruneTriangleAreaCache;
 	TSharedPtr<SDCollisionVis::FSDCollisionVisRealtimeViewExtension, ESPMode::ThreadSafe>	ViewExtension;
-	TMap<uint32, TSharedPtr<SDCollisionVis::FSDCollisionVisRealtimeViewData>>				ViewFamilyData;
+	TMap<uint32, TSharedPtr<SDCollisionVis::FSDCollisionVisRealtimeViewData>>				RealtimeViewData;	//< By FSceneView::GetViewKey
+	TSharedPtr<SDCollisionVis::FCollisionSnapshotCache>										SnapshotCache;
+	TSharedPtr<SDCollisionVis::FRenderBufferPool>											RenderBufferPool;
+	TSharedPtr<SDCollisionVis::FRealtimeRayScheduler>										RayScheduler;
+	std::atomic<uint32>																		PhysicsSceneGeneration = 0;	//< Physics state may be created off the GameThread
+	std::atomic<uint32>																		ServerPhysicsSceneGeneration = 0;
+
+	// Server world lookup for r.SDCollisionVis.Settings.UseServerWorld
+	TArray<TWeakObjectPtr<UWorld>>															GameWorlds;
+	TWeakObjectPtr<UWorld>																	ServerWorld;
+	std::atomic<const UWorld*>																ServerWorldForPhysics = nullptr;	//< Only ever compared against, never dereferenced
 };
 
 
 DECLARE_LOG_CATEGORY_EXTERN(LogSDCollisionVis, Log, All);
+DECLARE_STATS_GROUP(TEXT("SDCollisionVis"), STATGROUP_SDCollisionVis, STATCAT_Advanced);
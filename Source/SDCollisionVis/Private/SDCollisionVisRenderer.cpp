@@ -2,22 +2,30 @@
 
 #include "SDCollisionVisRenderer.h"
 #include "SDCollisionVisSettings.h"
+#include "SDCollisionVisWorkerPool.h"
+#include "SDCollisionVisTiledImageWriter.h"
+#include "SDCollisionVisDDSWriter.h"
 
 #include <GlobalShader.h>
 #include <RenderGraphResources.h>
+#include <RenderGraphUtils.h>
+#include <ComputeShaderUtils.h>
 #include <RHICommandList.h>
 #include <Shader.h>
 #include <ScreenPass.h>
 #include <ShaderParameterStruct.h>
-#include <Async/ParallelFor.h>
 #include <HAL/ConsoleManager.h>
+#include <HAL/LowLevelMemTracker.h>
 #include <Misc/FileHelper.h>
 #include <ImageUtils.h>
-#include <DDSFile.h>
 #include <GameFramework/Pawn.h>
+#include <Engine/Engine.h>
+#include <Engine/GameViewportClient.h>
+#include <UnrealClient.h>
 #include <Engine/Level.h>
-#include <Containers/ResourceArray.h>
-#include <Misc/EngineVersionComparison.h>
+#include <Async/ParallelFor.h>
+#include <Misc/CommandLine.h>
+#include <UObject/UObjectGlobals.h>
 
 
 #if WITH_EDITOR
@@ -27,6 +35,10 @@
 
 #define LOCTEXT_NAMESPACE "SDCollisionVis"
 
+// Everything the realtime renderer allocates, which should be nothing once a view has settled.
+// Scoped on the game thread, render thread and trace task, and handed on to the trace workers by the pool.
+LLM_DEFINE_TAG(SDCollisionVisRealtime);
+
 namespace SDCollisionVis
 {
 
@@ -34,12 +46,366 @@ namespace SDCollisionVis
 //////          Realtime          //
 ////////////////////////////////////
 
+void FMortonOrder::Init(FIntPoint InGridSize)
+{
+	GridSize = InGridSize;
+	const FIntPoint NumBlocks((GridSize.X + BlockSize - 1) / BlockSize, (GridSize.Y + BlockSize - 1) / BlockSize);
+
+	// Walk the curve over the smallest square power of two holding every block, skipping what falls outside
+	const uint32 Side = FMath::RoundUpToPowerOfTwo((uint32)FMath::Max(NumBlocks.X, NumBlocks.Y));
+	Blocks.Reset(NumBlocks.X * NumBlocks.Y);
+	for (uint32 Code = 0; Code < Side * Side; ++Code)
+	{
+		const FIntPoint Block = MortonDecode2D(Code);
+		if (Block.X < NumBlocks.X && Block.Y < NumBlocks.Y)
+		{
+			Blocks.Add(Block * BlockSize);
+		}
+	}
+}
+
+bool FRenderBuffer::Reproject(const FVector& NewOrigin, const FViewMatrices& NewViewMatrices, double NewMinDistance)
+{
+	const FMatrix NewViewProjectionMatrix = NewViewMatrices.GetViewProjectionMatrix();
+	if (bHasView
+		&& ViewOrigin == NewOrigin
+		&& MinDistance == NewMinDistance
+		&& ViewProjectionMatrix.Equals(NewViewProjectionMatrix, UE_DOUBLE_SMALL_NUMBER))
+	{
+		return false;
+	}
+
+	const bool bHadView = bHasView;
+	const FVector OldOrigin = ViewOrigin;
+	const double OldMinDistance = MinDistance;
+	ViewOrigin = NewOrigin;
+	ViewProjectionMatrix = NewViewProjectionMatrix;
+	MinDistance = NewMinDistance;
+	bHasView = true;
+
+	if (!bHadView)
+	{
+		// Nothing's been traced yet, so nothing to move
+		return false;
+	}
+
+	if (!IsLayered())
+	{
+		ReprojectHits(HitData, OldOrigin, OldMinDistance, NewViewProjectionMatrix);
+		return true;
+	}
+
+	// Each layer moves on its own, so a mover which uncovers static collision still has it to show
+	ReprojectHits(StaticHitData, OldOrigin, OldMinDistance, NewViewProjectionMatrix);
+	ReprojectHits(DynamicHitData, OldOrigin, OldMinDistance, NewViewProjectionMatrix);
+	FTraceWorkerPool::Get().ParallelFor(Dimensions.Y, [&](int32 Row)
+	{
+		for (int32 PixelIndex = Row * Dimensions.X; PixelIndex < (Row + 1) * Dimensions.X; ++PixelIndex)
+		{
+			HitData[PixelIndex] = CompositeLayers(StaticHitData[PixelIndex], DynamicHitData[PixelIndex]);
+		}
+	});
+	return true;
+}
+
+void FRenderBuffer::ReprojectHits(TArray<FPackedHitRecord>& Hits, const FVector& OldOrigin, double OldMinDistance, const FMatrix& NewViewProjectionMatrix)
+{
+	const FVector NewOrigin = ViewOrigin;
+	const double NewMinDistance = MinDistance;
+
+	const int32 NumPixels = Hits.Num();
+	ReprojectedHitData.SetNumUninitialized(NumPixels);
+	ReprojectedDepth.SetNumUninitialized(NumPixels);
+	FMemory::Memset(ReprojectedDepth.GetData(), 0xff, NumPixels * sizeof(uint64));
+
+	auto ProjectToPixel = [this](const FVector4& Clip, int32& OutPixelIndex)
+	{
+		if (Clip.W <= UE_DOUBLE_SMALL_NUMBER)
+		{
+			return false;
+		}
+
+		// Inverse of FPerspectiveRenderer::GenerateRay
+		const int32 X = FMath::FloorToInt32(((Clip.X / Clip.W) * 0.5 + 0.5) * Dimensions.X);
+		const int32 Y = FMath::FloorToInt32(((Clip.Y / Clip.W) * -0.5 + 0.5) * Dimensions.Y);
+		if (X < 0 || Y < 0 || X >= Dimensions.X || Y >= Dimensions.Y)
+		{
+			return false;
+		}
+
+		OutPixelIndex = Y * Dimensions.X + X;
+		return true;
+	};
+
+	// Splat everything into the new view, keeping the nearest.
+	// Misses are projected as a direction (i.e from infinitely far away), so any hit landing on the same pixel wins.
+	FTraceWorkerPool::Get().ParallelFor(Dimensions.Y, [&](int32 Row)
+	{
+		for (int32 PixelIndex = Row * Dimensions.X; PixelIndex < (Row + 1) * Dimensions.X; ++PixelIndex)
+		{
+			const FPackedHitRecord& Hit = Hits[PixelIndex];
+			if (!Hit.IsTraced())
+			{
+				continue;
+			}
+
+			const FVector Direction = Hit.GetDirection();
+			FVector4 Clip;
+			float Depth;
+			if (Hit.Distance >= 0.0f)
+			{
+				const FVector HitPos = OldOrigin + Direction * (OldMinDistance + Hit.Distance);
+				Clip = NewViewProjectionMatrix.TransformFVector4(FVector4(HitPos, 1.0));
+				Depth = (float)FVector::Dist(HitPos, NewOrigin);
+			}
+			else
+			{
+				Clip = NewViewProjectionMatrix.TransformFVector4(FVector4(Direction, 0.0));
+				Depth = MAX_flt;
+			}
+
+			int32 DestIndex;
+			if (!ProjectToPixel(Clip, DestIndex))
+			{
+				continue;
+			}
+
+			// Positive floats sort the same as their bits, so the nearest splat is just the smallest key.
+			const uint64 Key = ((uint64)(*(uint32*)&Depth) << 32) | (uint64)PixelIndex;
+			volatile int64* Dest = (volatile int64*)&ReprojectedDepth[DestIndex];
+			int64 Current = *Dest;
+			while (Key < (uint64)Current)
+			{
+				const int64 Previous = FPlatformAtomics::InterlockedCompareExchange(Dest, (int64)Key, Current);
+				if (Previous == Current)
+				{
+					break;
+				}
+				Current = Previous;
+			}
+		}
+	});
+
+	FTraceWorkerPool::Get().ParallelFor(Dimensions.Y, [&](int32 Row)
+	{
+		for (int32 PixelIndex = Row * Dimensions.X; PixelIndex < (Row + 1) * Dimensions.X; ++PixelIndex)
+		{
+			FPackedHitRecord& Reprojected = ReprojectedHitData[PixelIndex];
+			const uint64 Key = ReprojectedDepth[PixelIndex];
+			if (Key == MAX_uint64)
+			{
+				Reprojected = FPackedHitRecord();
+				Reprojected.Distance = FPackedHitRecord::DistanceInvalid;
+				continue;
+			}
+
+			const FPackedHitRecord& Hit = Hits[(int32)(Key & 0xffffffffu)];
+			Reprojected = Hit;
+			if (Hit.Distance >= 0.0f)
+			{
+				const FVector HitPos = OldOrigin + Hit.GetDirection() * (OldMinDistance + Hit.Distance);
+				const FVector ToHit = HitPos - NewOrigin;
+				const double Length = ToHit.Length();
+
+				Reprojected.Direction = PackOctNormal((FVector3f)(ToHit / Length));
+				Reprojected.Distance = (float)(Length - NewMinDistance);
+				if (Reprojected.Distance < 0.0f)
+				{
+					// Now inside the min distance, so a trace wouldn't see it.
+					Reprojected.Distance = FPackedHitRecord::DistanceInvalid;
+				}
+			}
+		}
+	});
+
+	// Copied rather than swapped, the trace's FPerspectiveRenderer already holds views of HitData.
+	FMemory::Memcpy(Hits.GetData(), ReprojectedHitData.GetData(), NumPixels * sizeof(FPackedHitRecord));
+}
+
+void FRenderBuffer::ResetTiles(uint32 TileSize, bool bResetCoverage)
+{
+	const int32 NumTilesX = (Dimensions.X + TileSize - 1) / TileSize;
+	const int32 NumTilesY = (Dimensions.Y + TileSize - 1) / TileSize;
+	if (TilesTileSize != TileSize || Tiles.Num() != NumTilesX * NumTilesY)
+	{
+		Tiles.Reset();
+		Tiles.SetNum(NumTilesX * NumTilesY);
+		TilesTileSize = TileSize;
+		TileOrder.Init(FIntPoint(NumTilesX, NumTilesY));
+	}
+
+	const TArray<FPackedHitRecord>& TileHitData = GetTileHitData();
+	if (PixelCovered.Num() != TileHitData.Num())
+	{
+		PixelCovered.SetNumZeroed(TileHitData.Num());
+	}
+	else if (bResetCoverage)
+	{
+		FMemory::Memzero(PixelCovered.GetData(), PixelCovered.Num());
+	}
+
+	FTraceWorkerPool::Get().ParallelFor(NumTilesY, [&](int32 TileY)
+	{
+		for (int32 TileX = 0; TileX < NumTilesX; ++TileX)
+		{
+			FTileState& Tile = Tiles[TileY * NumTilesX + TileX];
+			Tile.NumInvalid = 0;
+			Tile.NumUncovered = 0;
+			if (bResetCoverage)
+			{
+				Tile.NumSamples = 0;
+				Tile.FirstElement = FTileState::MissElement;
+				Tile.bEdge = false;
+			}
+		}
+
+		const int32 EndY = FMath::Min<int32>((TileY + 1) * TileSize, Dimensions.Y);
+		for (int32 Y = TileY * TileSize; Y < EndY; ++Y)
+		{
+			for (int32 X = 0; X < Dimensions.X; ++X)
+			{
+				FTileState& Tile = Tiles[TileY * NumTilesX + X / TileSize];
+				if (!TileHitData[Y * Dimensions.X + X].IsValid())
+				{
+					++Tile.NumInvalid;
+				}
+				if (PixelCovered[Y * Dimensions.X + X] == 0)
+				{
+					++Tile.NumUncovered;
+				}
+			}
+		}
+	});
+}
+
+bool FRenderBuffer::AreTilesConverged() const
+{
+	for (const FTileState& Tile : Tiles)
+	{
+		if (!Tile.IsConverged())
+		{
+			return false;
+		}
+	}
+	return !Tiles.IsEmpty();
+}
+
+// How much of a budgeted trace a tile should get, relative to the others.
+static float GetTilePriority(const FTileState& Tile, uint32 TileSize)
+{
+	if (Tile.NumInvalid > 0)
+	{
+		return 16.0f;
+	}
+	if (!Tile.IsConverged())
+	{
+		return Tile.bEdge ? 8.0f : 4.0f;
+	}
+	return Tile.bEdge ? 2.0f : 1.0f;
+}
+
+// Shares NumRays out between Tiles by priority, no tile getting more than it has pixels.
+// The rounding error is carried from tile to tile, starting from a different offset each trace, so low priority
+// tiles still get their turn even when there's less than a ray each to go round.
+static void AllocateTileRays(	TConstArrayView<FTileState> Tiles,
+								FIntPoint NumTiles,
+								uint32 TileSize,
+								const FFoveation& Foveation,
+								int32 NumRays,
+								uint32 Seed,
+								TArray<uint16>& OutRaysPerTile)
+{
+	OutRaysPerTile.SetNumUninitialized(Tiles.Num(), EAllowShrinking::No);
+
+	float TotalPriority = 0.0f;
+	for (int32 TileIndex = 0; TileIndex < Tiles.Num(); ++TileIndex)
+	{
+		TotalPriority += GetTilePriority(Tiles[TileIndex], TileSize) * Foveation.GetTileWeight(TileIndex, NumTiles, TileSize);
+	}
+
+	const float RaysPerPriority = TotalPriority > 0.0f ? (float)NumRays / TotalPriority : 0.0f;
+	const int32 MaxRaysPerTile = (int32)(TileSize * TileSize);
+	int32 RemainingRays = NumRays;
+	float Carry = FMath::Frac((float)Seed * UE_GOLDEN_RATIO);
+	for (int32 TileIndex = 0; TileIndex < Tiles.Num(); ++TileIndex)
+	{
+		const float Priority = GetTilePriority(Tiles[TileIndex], TileSize) * Foveation.GetTileWeight(TileIndex, NumTiles, TileSize);
+		const float Share = Priority * RaysPerPriority + Carry;
+		const int32 NumTileRays = FMath::FloorToInt32(Share);
+		Carry = Share - (float)NumTileRays;
+
+		// Rounding may leave us a ray or so over, which there's no room for in the dirty list
+		const int32 NumAllocated = FMath::Min3(NumTileRays, MaxRaysPerTile, RemainingRays);
+		OutRaysPerTile[TileIndex] = (uint16)NumAllocated;
+		RemainingRays -= NumAllocated;
+	}
+}
+
+DECLARE_DWORD_COUNTER_STAT(TEXT("Trace Frames In Flight"), STAT_SDCollisionVis_TraceFramesInFlight, STATGROUP_SDCollisionVis);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Presented Lag (Frames)"), STAT_SDCollisionVis_PresentedLag, STATGROUP_SDCollisionVis);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Rays Per Trace"), STAT_SDCollisionVis_RaysPerTrace, STATGROUP_SDCollisionVis);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("Rays Per Ms"), STAT_SDCollisionVis_RaysPerMs, STATGROUP_SDCollisionVis);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Idle (Converged)"), STAT_SDCollisionVis_Idle, STATGROUP_SDCollisionVis);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Realtime Views"), STAT_SDCollisionVis_RealtimeViews, STATGROUP_SDCollisionVis);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("Framebuffer Memory (MB)"), STAT_SDCollisionVis_FramebufferMemoryMB, STATGROUP_SDCollisionVis);
+
+// Smoothing applied to the measured rays per ms, so one slow trace doesn't throw the budget out.
+static constexpr float GRaysPerMsBlend = 0.25f;
+
 static TAutoConsoleVariable<int32> CVarSettingsUseWorldServer(
 	TEXT("r.SDCollisionVis.Settings.UseServerWorld"),
 	0,
 	TEXT("Attempt to use the World from a locally running server on the same process."),
 	ECVF_Default);
 
+static TAutoConsoleVariable<int32> CVarSettingsIdleWhenConverged(
+	TEXT("r.SDCollisionVis.Settings.IdleWhenConverged"),
+	1,
+	TEXT("Stop tracing once every pixel has been traced for the current view, until the view, settings or physics scene change.\n")
+	TEXT("Scene queries can't tell when bodies move, so with those this only applies when MobilityType is Static."),
+	ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarSettingsUpscale(
+	TEXT("r.SDCollisionVis.Settings.Upscale"),
+	1,
+	TEXT("How the realtime image is upscaled to the view (see r.SDCollisionVis.Settings.Scale):\n")
+	TEXT("0 = Bilinear\n")
+	TEXT("1 = Edge aware, blending only hits on the same surface (primitive, depth, and whatever the VisType tells apart)"),
+	ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarSettingsFoveation(
+	TEXT("r.SDCollisionVis.Settings.Foveation"),
+	0,
+	TEXT("Concentrate realtime rays around a point of interest, updating the periphery less often for the same total cost:\n")
+	TEXT("0 = Off, rays are spread evenly over the view\n")
+	TEXT("1 = Screen centre\n")
+	TEXT("2 = Cursor, over the level editor or game viewport (the screen centre while it's elsewhere)"),
+	ECVF_Default);
+
+static TAutoConsoleVariable<float> CVarSettingsFoveationRadius(
+	TEXT("r.SDCollisionVis.Settings.FoveationRadius"),
+	0.1f,
+	TEXT("Radius traced at full density when foveated, as a fraction of the view's shorter side."),
+	ECVF_Default);
+
+static TAutoConsoleVariable<float> CVarSettingsFoveationMinDensity(
+	TEXT("r.SDCollisionVis.Settings.FoveationMinDensity"),
+	0.05f,
+	TEXT("Lowest ray density when foveated, relative to the full density region, so the periphery still converges."),
+	ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarSettingsMaxMemoryMB(
+	TEXT("r.SDCollisionVis.Settings.MaxMemoryMB"),
+	512,
+	TEXT("Memory (MB) the realtime framebuffers of every view can take up together, views which don't fit are traced at a lower resolution."),
+	ECVF_Default);
+
+static TAutoConsoleVariable<float> CVarSettingsFocusedViewWeight(
+	TEXT("r.SDCollisionVis.Settings.FocusedViewWeight"),
+	4.0f,
+	TEXT("How much more of the realtime budget (see r.SDCollisionVis.Settings.BudgetMs and RayBudget) the focused viewport gets, relative to its area."),
+	ECVF_Default);
+
 namespace
 {
 
@@ -53,9 +419,20 @@ class FDrawTracedTexturePS : public FGlobalShader
 	DECLARE_GLOBAL_SHADER(FDrawTracedTexturePS);
 	SHADER_USE_PARAMETER_STRUCT(FDrawTracedTexturePS, FGlobalShader);
 
+	class FVisTypeDim : SHADER_PERMUTATION_INT("VIS_TYPE", (int32)EVisualisationType::TriangleDensity + 1);
+	class FEdgeAwareUpscaleDim : SHADER_PERMUTATION_BOOL("EDGE_AWARE_UPSCALE");
+	using FPermutationDomain = TShaderPermutationDomain<FVisTypeDim, FEdgeAwareUpscaleDim>;
+
 	BEGIN_SHADER_PARAMETER_STRUCT(FParameters, )
-		SHADER_PARAMETER_RDG_TEXTURE(Texture2D, SourceTexture)
+		SHADER_PARAMETER_RDG_BUFFER_SRV(StructuredBuffer<FPackedHitRecord>, HitRecords)
+		SHADER_PARAMETER(FUintVector2, HitBufferSize)
+		SHADER_PARAMETER(FVector2f, ViewportMin)
 		SHADER_PARAMETER(FVector2f, InvViewport)
+		SHADER_PARAMETER(FVector3f, RevViewForward)
+		SHADER_PARAMETER(float, RaytraceTimeMinTime)
+		SHADER_PARAMETER(float, RaytraceTimeMaxTime)
+		SHADER_PARAMETER(float, TriangleDensityMinArea2)
+		SHADER_PARAMETER(float, TriangleDensityMul)
 		SHADER_PARAMETER_STRUCT_REF(FViewUniformShaderParameters, View)
 		RENDER_TARGET_BINDING_SLOTS()
 	END_SHADER_PARAMETER_STRUCT()
@@ -67,171 +444,754 @@ class FDrawTracedTexturePS : public FGlobalShader
 	
 	static void ModifyCompilationEnvironment(const FGlobalShaderPermutationParameters& Parameters, FShaderCompilerEnvironment& OutEnvironment)
 	{
-		FGlobalShader::ModifyCompilationEnvironment(Parameters, OutEnvironment);
+		FGlobalShader::ModifyCompilationEnvironment(Parameters, OutEnvironment);
+	}
+};
+
+IMPLEMENT_GLOBAL_SHADER(FDrawTracedTexturePS, "/Plugin/SDCollisionVis/DrawTracedTexture.usf", "DrawTracedTexturePS", SF_Pixel);
+
+
+class FScatterTracedPixelsCS : public FGlobalShader
+{
+	DECLARE_GLOBAL_SHADER(FScatterTracedPixelsCS);
+	SHADER_USE_PARAMETER_STRUCT(FScatterTracedPixelsCS, FGlobalShader);
+
+	BEGIN_SHADER_PARAMETER_STRUCT(FParameters, )
+		SHADER_PARAMETER_RDG_BUFFER_SRV(StructuredBuffer<uint>, DirtyIndices)
+		SHADER_PARAMETER_RDG_BUFFER_SRV(StructuredBuffer<FPackedHitRecord>, DirtyRecords)
+		SHADER_PARAMETER_RDG_BUFFER_UAV(RWStructuredBuffer<FPackedHitRecord>, HitRecords)
+		SHADER_PARAMETER(uint32, NumDirtyPixels)
+	END_SHADER_PARAMETER_STRUCT()
+
+	static constexpr int32 ThreadGroupSize = 64;
+
+	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters)
+	{
+		 return IsFeatureLevelSupported(Parameters.Platform, ERHIFeatureLevel::SM5);
+	}
+
+	static void ModifyCompilationEnvironment(const FGlobalShaderPermutationParameters& Parameters, FShaderCompilerEnvironment& OutEnvironment)
+	{
+		FGlobalShader::ModifyCompilationEnvironment(Parameters, OutEnvironment);
+		OutEnvironment.SetDefine(TEXT("THREADGROUP_SIZE"), ThreadGroupSize);
+	}
+};
+
+IMPLEMENT_GLOBAL_SHADER(FScatterTracedPixelsCS, "/Plugin/SDCollisionVis/ScatterTracedPixels.usf", "ScatterTracedPixelsCS", SF_Compute);
+
+
+// Brings the view's persistent hit buffer up to date with RenderBuffer.
+// Normally only the pixels traced this frame get scattered in, the whole buffer only goes up
+// when it's resized, or RenderBuffer isn't the one it was last filled from.
+// Full uploads come from the trace's own copy (FDirtyPixelList::FullRecords), never RenderBuffer->HitData,
+// which the next trace may already be writing to.
+static FRDGBufferRef UpdateHitBuffer(	FRDGBuilder& GraphBuilder,
+										FGlobalShaderMap* GlobalShaderMap,
+										FSDCollisionVisRealtimeViewData& ViewData,
+										const TSharedPtr<FRenderBuffer>& RenderBuffer,
+										const FDirtyPixelList* DirtyPixels)
+{
+	const bool bFullUpload = !ViewData.HitBuffer
+							|| ViewData.HitBufferDimensions != RenderBuffer->Dimensions
+							|| ViewData.HitBufferSource.Pin() != RenderBuffer
+							|| (DirtyPixels && DirtyPixels->NeedsFullUpload())
+							;
+
+	if (bFullUpload)
+	{
+		// Anything needing a full upload here starts a new framebuffer, which the trace will have copied out for.
+		if (!ensure(DirtyPixels && DirtyPixels->FullRecords.Num() == RenderBuffer->Dimensions.X * RenderBuffer->Dimensions.Y))
+		{
+			return ViewData.HitBuffer ? GraphBuilder.RegisterExternalBuffer(ViewData.HitBuffer) : nullptr;
+		}
+
+		const TArray<FPackedHitRecord>& HitData = DirtyPixels->FullRecords;
+		FRDGBufferRef HitBuffer = CreateStructuredBuffer(GraphBuilder, TEXT("SDCollisionVis.HitBuffer"), sizeof(FPackedHitRecord), HitData.Num(), HitData.GetData(), HitData.Num() * sizeof(FPackedHitRecord));
+		ViewData.HitBuffer = GraphBuilder.ConvertToExternalBuffer(HitBuffer);
+		ViewData.HitBufferDimensions = RenderBuffer->Dimensions;
+		ViewData.HitBufferSource = RenderBuffer;
+		return HitBuffer;
+	}
+
+	FRDGBufferRef HitBuffer = GraphBuilder.RegisterExternalBuffer(ViewData.HitBuffer);
+	const int32 NumPixels = DirtyPixels ? DirtyPixels->Num.load() : 0;
+	if (NumPixels == 0)
+	{
+		return HitBuffer;
+	}
+
+	FRDGBufferRef Indices = CreateStructuredBuffer(GraphBuilder, TEXT("SDCollisionVis.DirtyIndices"), sizeof(uint32), NumPixels, DirtyPixels->Indices.GetData(), NumPixels * sizeof(uint32));
+	FRDGBufferRef Records = CreateStructuredBuffer(GraphBuilder, TEXT("SDCollisionVis.DirtyRecords"), sizeof(FPackedHitRecord), NumPixels, DirtyPixels->Records.GetData(), NumPixels * sizeof(FPackedHitRecord));
+
+	FScatterTracedPixelsCS::FParameters* PassParameters = GraphBuilder.AllocParameters<FScatterTracedPixelsCS::FParameters>();
+	PassParameters->DirtyIndices = GraphBuilder.CreateSRV(Indices);
+	PassParameters->DirtyRecords = GraphBuilder.CreateSRV(Records);
+	PassParameters->HitRecords = GraphBuilder.CreateUAV(HitBuffer);
+	PassParameters->NumDirtyPixels = (uint32)NumPixels;
+
+	TShaderMapRef<FScatterTracedPixelsCS> ComputeShader(GlobalShaderMap);
+	FComputeShaderUtils::AddPass(
+		GraphBuilder,
+		RDG_EVENT_NAME("SDCollisionVis::ScatterTracedPixels (%d)", NumPixels),
+		ComputeShader,
+		PassParameters,
+		FComputeShaderUtils::GetGroupCountWrapped(NumPixels, FScatterTracedPixelsCS::ThreadGroupSize));
+
+	return HitBuffer;
+}
+
+
+// Whichever viewport ViewFamily is rendering to, if it's the level editor's current one or the game's.
+static const FViewport* FindFocusedViewport(const FSceneViewFamily& ViewFamily)
+{
+#if WITH_EDITOR
+	if (GCurrentLevelEditingViewportClient && GCurrentLevelEditingViewportClient->Viewport == ViewFamily.RenderTarget)
+	{
+		return GCurrentLevelEditingViewportClient->Viewport;
+	}
+#endif // WITH_EDITOR
+	if (GEngine && GEngine->GameViewport && GEngine->GameViewport->Viewport == ViewFamily.RenderTarget)
+	{
+		return GEngine->GameViewport->Viewport;
+	}
+	return nullptr;
+}
+
+// Where the cursor is over whichever viewport ViewFamily is rendering to, if it's one we know how to ask.
+static bool GetViewportCursorPosition(const FSceneViewFamily& ViewFamily, FIntPoint& OutPosition)
+{
+	const FViewport* Viewport = FindFocusedViewport(ViewFamily);
+	if (!Viewport)
+	{
+		return false;
+	}
+	OutPosition = FIntPoint(Viewport->GetMouseX(), Viewport->GetMouseY());
+	return true;
+}
+
+static FFoveation GetFoveation(const FSceneViewFamily& ViewFamily, const FIntRect& ViewRect, float Scale)
+{
+	FFoveation Foveation;
+	const int32 Mode = CVarSettingsFoveation.GetValueOnGameThread();
+	if (Mode <= 0)
+	{
+		return Foveation;
+	}
+
+	FIntPoint Focus = ViewRect.Min + ViewRect.Size() / 2;
+	FIntPoint CursorPosition;
+	if (Mode >= 2 && GetViewportCursorPosition(ViewFamily, CursorPosition) && ViewRect.Contains(CursorPosition))
+	{
+		Focus = CursorPosition;
+	}
+
+	Foveation.Centre = FVector2f((float)(Focus.X - ViewRect.Min.X), (float)(Focus.Y - ViewRect.Min.Y)) * Scale;
+	Foveation.Radius = FMath::Max(CVarSettingsFoveationRadius.GetValueOnGameThread() * (float)ViewRect.Size().GetMin() * Scale, 1.0f);
+	Foveation.MinDensity = FMath::Clamp(CVarSettingsFoveationMinDensity.GetValueOnGameThread(), UE_KINDA_SMALL_NUMBER, 1.0f);
+	return Foveation;
+}
+
+int64 FRenderBufferPool::EstimateBytes(FIntPoint Dimensions, ERenderBufferContents Contents)
+{
+	const int64 NumPixels = (int64)Dimensions.X * Dimensions.Y;
+	const int64 NumLayers = Contents == ERenderBufferContents::LayeredHits ? 3 : 1;
+	const int64 BytesPerPixel = NumLayers * sizeof(FPackedHitRecord)	//< HitData (and each layer)
+								+ sizeof(uint8)							//< PixelCovered
+								+ sizeof(FPackedHitRecord) + sizeof(uint64);	//< Reproject scratch
+	return NumPixels * BytesPerPixel;
+}
+
+TSharedPtr<FRenderBuffer> FRenderBufferPool::Acquire(FIntPoint Dimensions, ERenderBufferContents Contents, int64 MaxBytes)
+{
+	check(IsInGameThread());
+
+	for (FEntry& Entry : Entries)
+	{
+		if (IsFree(Entry) && Entry.Contents == Contents && Entry.Buffer->Dimensions == Dimensions)
+		{
+			Entry.Buffer->Init(Dimensions, Contents);
+			Entry.LastUsed = GFrameCounter;
+			return Entry.Buffer;
+		}
+	}
+
+	// Make room by dropping whatever isn't in use, least recently used first.
+	const int64 Bytes = EstimateBytes(Dimensions, Contents);
+	if (AllocatedBytes + Bytes > MaxBytes)
+	{
+		Entries.Sort([](const FEntry& A, const FEntry& B) { return A.LastUsed < B.LastUsed; });
+		for (int32 Index = 0; Index < Entries.Num() && AllocatedBytes + Bytes > MaxBytes; )
+		{
+			if (IsFree(Entries[Index]))
+			{
+				AllocatedBytes -= Entries[Index].Bytes;
+				Entries.RemoveAt(Index);
+			}
+			else
+			{
+				++Index;
+			}
+		}
+		if (AllocatedBytes + Bytes > MaxBytes)
+		{
+			return {};
+		}
+	}
+
+	FEntry& Entry = Entries.AddDefaulted_GetRef();
+	Entry.Buffer = MakeShared<FRenderBuffer>();
+	Entry.Buffer->Init(Dimensions, Contents);
+	Entry.Contents = Contents;
+	Entry.Bytes = Bytes;
+	Entry.LastUsed = GFrameCounter;
+	AllocatedBytes += Bytes;
+	return Entry.Buffer;
+}
+
+void FRenderBufferPool::Prune(uint64 KeepAliveFrames)
+{
+	check(IsInGameThread());
+
+	for (int32 Index = Entries.Num() - 1; Index >= 0; --Index)
+	{
+		FEntry& Entry = Entries[Index];
+		if (!IsFree(Entry))
+		{
+			Entry.LastUsed = GFrameCounter;
+		}
+		else if ((GFrameCounter - Entry.LastUsed) > KeepAliveFrames)
+		{
+			AllocatedBytes -= Entry.Bytes;
+			Entries.RemoveAtSwap(Index);
+		}
+	}
+}
+
+void FRenderBufferPool::Empty()
+{
+	Entries.Empty();
+	AllocatedBytes = 0;
+}
+
+float FRealtimeRayScheduler::GetShare(uint32 ViewKey, float Weight)
+{
+	check(IsInGameThread());
+
+	Weight = FMath::Max(Weight, UE_KINDA_SMALL_NUMBER);
+	Views.FindOrAdd(ViewKey) = FEntry{ .Weight = Weight, .LastFrame = GFrameCounter };
+
+	float TotalWeight = 0.0f;
+	for (const TPair<uint32, FEntry>& Pair : Views)
+	{
+		if (Pair.Value.LastFrame + 1 >= GFrameCounter)
+		{
+			TotalWeight += Pair.Value.Weight;
+		}
+	}
+	return Weight / TotalWeight;
+}
+
+void FRealtimeRayScheduler::Prune()
+{
+	check(IsInGameThread());
+
+	for (auto It = Views.CreateIterator(); It; ++It)
+	{
+		if (It->Value.LastFrame + 1 < GFrameCounter)
+		{
+			It.RemoveCurrent();
+		}
+	}
+}
+
+FSDCollisionVisRealtimeViewExtension::FSDCollisionVisRealtimeViewExtension(const FAutoRegister& AutoRegister)
+	: FSceneViewExtensionBase(AutoRegister)
+{
+	ConsoleVariableSinkHandle = IConsoleManager::Get().RegisterConsoleVariableSink_Handle(
+		FConsoleCommandDelegate::CreateRaw(this, &FSDCollisionVisRealtimeViewExtension::OnConsoleVariablesChanged));
+}
+
+FSDCollisionVisRealtimeViewExtension::~FSDCollisionVisRealtimeViewExtension()
+{
+	IConsoleManager::Get().UnregisterConsoleVariableSink_Handle(ConsoleVariableSinkHandle);
+}
+
+void FSDCollisionVisRealtimeViewExtension::OnConsoleVariablesChanged()
+{
+	bSettingsDirty = true;
+}
+
+const FSDCollisionSettings& FSDCollisionVisRealtimeViewExtension::GetSettings()
+{
+	check(IsInGameThread());
+
+	if (bSettingsDirty)
+	{
+		// Keep hold of everything about each hit, so switching between (most) VisTypes is free.
+		Settings = FSDCollisionSettings();
+		Settings.bGatherAllAttributes = true;
+		Settings.UpdateSettings();
+		bSettingsDirty = false;
 	}
-};
+	return Settings;
+}
 
-IMPLEMENT_GLOBAL_SHADER(FDrawTracedTexturePS, "/Plugin/SDCollisionVis/DrawTracedTexture.usf", "DrawTracedTexturePS", SF_Pixel);
+void FSDCollisionVisRealtimeViewExtension::RegisterViewData(uint32 ViewKey, const TSharedPtr<FSDCollisionVisRealtimeViewData>& ViewData)
+{
+	ENQUEUE_RENDER_COMMAND(SDCollisionVisRegisterViewData)(
+		[Extension = StaticCastSharedRef<FSDCollisionVisRealtimeViewExtension>(AsShared()), ViewKey, ViewData](FRHICommandListImmediate&)
+		{
+			Extension->ViewDataRenderThread.Add(ViewKey, ViewData);
+		});
+}
+
+void FSDCollisionVisRealtimeViewExtension::UnregisterViewData(uint32 ViewKey)
+{
+	ENQUEUE_RENDER_COMMAND(SDCollisionVisUnregisterViewData)(
+		[Extension = StaticCastSharedRef<FSDCollisionVisRealtimeViewExtension>(AsShared()), ViewKey](FRHICommandListImmediate&)
+		{
+			Extension->ViewDataRenderThread.Remove(ViewKey);
+		});
+}
 
+void FSDCollisionVisRealtimeViewExtension::UnregisterAllViewData()
+{
+	ENQUEUE_RENDER_COMMAND(SDCollisionVisUnregisterAllViewData)(
+		[Extension = StaticCastSharedRef<FSDCollisionVisRealtimeViewExtension>(AsShared())](FRHICommandListImmediate&)
+		{
+			Extension->ViewDataRenderThread.Empty();
+		});
+}
 
 void FSDCollisionVisRealtimeViewExtension::BeginRenderViewFamily(FSceneViewFamily& ViewFamily)
 {
+	LLM_SCOPE_BYTAG(SDCollisionVisRealtime);
 
 	if (ViewFamily.Views.IsEmpty() || !ViewFamily.bIsMainViewFamily || !ViewFamily.Scene || !ViewFamily.Scene->GetWorld())
 	{
 		return;
 	}
 
+	if (!ShowSDCollisionVis.IsEnabled(ViewFamily.EngineShowFlags))
+	{
+		return;
+	}
+
+	// The trace only ever goes through the world it's given, so with a server world it takes the server's scene lock
+	// and none of the client's.
 	UWorld* World = ViewFamily.Scene->GetWorld();
-	const FSceneView& MainView = *ViewFamily.Views[0];
-	bool bEnabled = ShowSDCollisionVis.IsEnabled(MainView.Family->EngineShowFlags)
-					&& (MainView.UnscaledViewRect.Area() > 0)
-					;
-	
-	if (bEnabled)
+	if (CVarSettingsUseWorldServer.GetValueOnGameThread())
 	{
-		TSharedPtr<FSDCollisionVisRealtimeViewData> RenderData = FModuleManager::LoadModuleChecked<FSDCollisionVisModule>("SDCollisionVis").GetRealtimeViewFamilyData(ViewFamily);
-		if (!RenderData)
+		FSDCollisionVisModule& Module = FModuleManager::LoadModuleChecked<FSDCollisionVisModule>("SDCollisionVis");
+		if (UWorld* ServerWorld = Module.GetServerWorld())
 		{
-			return;
+			World = ServerWorld;
 		}
+	}
+
+	const FSDCollisionSettings& CurrentSettings = GetSettings();
 
-		if (CVarSettingsUseWorldServer.GetValueOnGameThread())
+	// Split screen views share the game viewport's focus, whereas only the editor viewport being worked in has it.
+	const bool bFocused = FindFocusedViewport(ViewFamily) != nullptr;
+	for (int32 ViewIndex = 0; ViewIndex < ViewFamily.Views.Num(); ++ViewIndex)
+	{
+		if (ViewFamily.Views[ViewIndex]->UnscaledViewRect.Area() > 0)
 		{
-			for (UWorld* It : TObjectRange<UWorld>(RF_ClassDefaultObject | RF_ArchetypeObject, true, EInternalObjectFlags::Garbage))
-			{
-				if (It->GetNetMode() == NM_DedicatedServer)
-				{
-					World = It;
-					break;
-				}
-			}
+			BeginRenderView(ViewFamily, ViewIndex, World, CurrentSettings, bFocused);
 		}
+	}
+
+	FSDCollisionVisModule& Module = FModuleManager::LoadModuleChecked<FSDCollisionVisModule>("SDCollisionVis");
+	SET_FLOAT_STAT(STAT_SDCollisionVis_FramebufferMemoryMB, (float)((double)Module.GetRenderBufferPool().GetAllocatedBytes() / (1024.0 * 1024.0)));
+}
+
+void FSDCollisionVisRealtimeViewExtension::BeginRenderView(	FSceneViewFamily& ViewFamily,
+															int32 ViewIndex,
+															UWorld* World,
+															const FSDCollisionSettings& Settings,
+															bool bFocused)
+{
+	const FSceneView& View = *ViewFamily.Views[ViewIndex];
+	FSDCollisionVisModule& Module = FModuleManager::LoadModuleChecked<FSDCollisionVisModule>("SDCollisionVis");
+	TSharedPtr<FSDCollisionVisRealtimeViewData> RenderData = Module.GetRealtimeViewData(View);
+	if (!RenderData)
+	{
+		return;
+	}
 
-		FSDCollisionSettings Settings;
+	FIntPoint ViewRectSize = View.UnscaledViewRect.Size();
+	float Scale = FMath::Max(Settings.Scale, 1.0f / float(FMath::Min(ViewRectSize.X, ViewRectSize.Y)));
+	FIntPoint RenderTargetSize((int32)(ViewRectSize.X * Scale + 0.5f),
+								(int32)(ViewRectSize.Y * Scale + 0.5f));
 
-		FIntPoint ViewRectSize = MainView.UnscaledViewRect.Size();
-		float Scale = FMath::Max(Settings.Scale, 1.0f / float(FMath::Min(ViewRectSize.X, ViewRectSize.Y)));
-		FIntPoint RenderTargetSize((int32)(ViewRectSize.X * Scale + 0.5f),
-									(int32)(ViewRectSize.Y * Scale + 0.5f));
+	// Layers are split by mobility, which the snapshot already keeps up to date by refitting whatever moves,
+	// and which would have nothing to split if we're only tracing one of them anyway.
+	const bool bLayered = Settings.bLayered
+						&& Settings.TraceEngine == ETraceEngine::SceneQuery
+						&& Settings.CollisionQueryParams.MobilityType == EQueryMobilityType::Any;
 
-		bool bKeepFrameBuffer = RenderData->FramebufferGameThread.IsValid()
-								&& RenderData->FramebufferGameThread->Dimensions == RenderTargetSize;
+	// Compared against what was asked for, so a view squeezed down to fit the pool doesn't ask again every frame.
+	bool bKeepFrameBuffer = RenderData->FramebufferGameThread.IsValid()
+							&& RenderData->FramebufferRequestedSize == RenderTargetSize
+							&& RenderData->FramebufferGameThread->IsLayered() == bLayered;
 
-		if (!bKeepFrameBuffer)
+	if (!bKeepFrameBuffer)
+	{
+		// Let go of the old one first, so the pool can reuse it once any traces using it have finished.
+		RenderData->FramebufferGameThread.Reset();
+		RenderData->FramebufferRequestedSize = RenderTargetSize;
+
+		// Halve the resolution until the view fits in what's left of the pool, giving up on it entirely once it's tiny.
+		constexpr int32 MinDimension = 32;
+		const int64 MaxBytes = (int64)FMath::Max(CVarSettingsMaxMemoryMB.GetValueOnGameThread(), 0) * 1024 * 1024;
+		FIntPoint Dimensions = RenderTargetSize;
+		while (!RenderData->FramebufferGameThread && Dimensions.GetMin() >= FMath::Min(MinDimension, RenderTargetSize.GetMin()))
 		{
-			RenderData->FramebufferGameThread = MakeShared<FRenderBuffer>();
-			RenderData->FramebufferGameThread->Init(RenderTargetSize);
+			RenderData->FramebufferGameThread = Module.GetRenderBufferPool().Acquire(Dimensions, bLayered ? ERenderBufferContents::LayeredHits : ERenderBufferContents::Hits, MaxBytes);
+			Dimensions /= 2;
 		}
+	}
 
-		FPerspectiveRenderer PerspectiveRenderer(	World,
-													*RenderData->FramebufferGameThread,
-													Settings,
-													(FVector)MainView.ViewLocation,
-													MainView.ViewMatrices);
+	if (!RenderData->FramebufferGameThread)
+	{
+		return;
+	}
 
-		TFunction<void()> TraceFunc = [	PerspectiveRenderer = MoveTemp(PerspectiveRenderer),
-										KeepAlive=RenderData->FramebufferGameThread]()
-		{
-			const auto& Settings = PerspectiveRenderer.Settings;
-			const int32 NumTileY = (PerspectiveRenderer.RenderTargetSize.Y + Settings.TileSize - 1) / Settings.TileSize;
+	// One budget for every view, rather than each taking the whole thing.
+	const float FocusWeight = bFocused ? FMath::Max(CVarSettingsFocusedViewWeight.GetValueOnGameThread(), 1.0f) : 1.0f;
+	const float Share = Module.GetRayScheduler().GetShare(View.GetViewKey(), (float)View.UnscaledViewRect.Area() * FocusWeight);
 
-			auto Kernel = [&](auto DispatchParameters)
-			{
-				const static ESamplingPattern SamplingPattern = decltype(DispatchParameters)::SamplingPattern;
-				const static EVisualisationType VisType = decltype(DispatchParameters)::VisType;
-				
-				ParallelFor(NumTileY, [&, Settings=Settings](int32 TileIdY)
-				{
-					int32 TileY = Settings.TileSize * TileIdY;
-					for (int32 TileX = 0; TileX < PerspectiveRenderer.RenderTargetSize.X; TileX += Settings.TileSize)
-					{
-						PerspectiveRenderer.RenderPerspectiveTilePixel<SamplingPattern, VisType>(FIntPoint(TileX, TileY));
-					}
-				});
-			};
+	// Don't let the trace queue run away from us if it can't keep up, just keep presenting what we have.
+	bool bTrace = RenderData->NumTraceFramesInFlight.load() < GMaxTraceFramesInFlight;
+	bool bSceneMoved = false;
+	TSharedPtr<FCollisionSnapshot> Snapshot;
+	if (Settings.TraceEngine == ETraceEngine::Snapshot)
+	{
+		// Snapshot is built in the background, keep presenting what we have until it's ready.
+		// Fetched even when we're not tracing, since that's what keeps an eye on bodies moving.
+		Snapshot = Module.GetCollisionSnapshotCache().Get(World, Settings);
+		bTrace = bTrace && Snapshot.IsValid();
+		bSceneMoved = Snapshot.IsValid() && Snapshot->HasPendingRefit();
+	}
 
-			FKernelExecutor Executor
-			{
-				.VisType = Settings.VisType,
-				.SamplingPattern = Settings.SamplingPattern
-			};
+	// Once the last trace has been over every pixel, tracing again with the same view and scene won't change a thing.
+	// Not so when layered, where dynamic collision is still traced every frame once the static layer has converged.
+	const FVector Origin = (FVector)View.ViewLocation;
+	const FMatrix ViewProjectionMatrix = View.ViewMatrices.GetViewProjectionMatrix();
+	const uint32 SettingsHash = Settings.GetTraceHash();
+	const uint32 PhysicsGeneration = Module.GetPhysicsSceneGeneration(World);
+	const bool bHasTraced = RenderData->NumTracesDispatched > 0;
+	const bool bViewChanged = !bHasTraced
+							|| RenderData->LastTraceOrigin != Origin
+							|| !RenderData->LastTraceViewProjectionMatrix.Equals(ViewProjectionMatrix, UE_DOUBLE_SMALL_NUMBER)
+							;
+	const bool bSceneChanged = !bHasTraced
+							|| bSceneMoved
+							|| RenderData->LastTraceSettingsHash != SettingsHash
+							|| RenderData->LastTracePhysicsGeneration != PhysicsGeneration
+							|| RenderData->LastTraceSnapshot.Pin() != Snapshot
+							;
+	// Scene queries only find out about bodies being added or removed, so anything which can move has to keep being traced.
+	const bool bCanSeeMovement = Settings.TraceEngine == ETraceEngine::Snapshot
+								|| Settings.CollisionQueryParams.MobilityType == EQueryMobilityType::Static
+								;
+	const bool bIdle = CVarSettingsIdleWhenConverged.GetValueOnGameThread() != 0
+						&& bCanSeeMovement
+						&& !bLayered
+						&& !bViewChanged
+						&& !bSceneChanged
+						&& RenderData->FramebufferGameThread->ConvergedTrace.load() == (int64)RenderData->NumTracesDispatched - 1
+						;
+	bTrace = bTrace && !bIdle;
+
+	// Summed over every view, other than the lag and throughput, which are the last view's.
+	INC_DWORD_STAT(STAT_SDCollisionVis_RealtimeViews);
+	INC_DWORD_STAT_BY(STAT_SDCollisionVis_TraceFramesInFlight, RenderData->NumTraceFramesInFlight.load());
+	SET_DWORD_STAT(STAT_SDCollisionVis_PresentedLag, RenderData->PresentedLag.load());
+	INC_DWORD_STAT_BY(STAT_SDCollisionVis_RaysPerTrace, RenderData->FramebufferGameThread->LastNumRays.load());
+	SET_FLOAT_STAT(STAT_SDCollisionVis_RaysPerMs, RenderData->FramebufferGameThread->RaysPerMs.load());
+	INC_DWORD_STAT_BY(STAT_SDCollisionVis_Idle, bIdle ? 1 : 0);
+
+	// Should the RenderThread have fallen behind and not picked up the last few, just present this one late.
+	RenderData->PresentStates.Enqueue(FPresentState
+	{
+		.FrameNumber = GFrameCounter,
+		.ColourParams = Settings.GetColourParams(-View.ViewMatrices.GetOverriddenTranslatedViewMatrix().GetColumn(2)),
+		.VisType = Settings.VisType,
+		.bEdgeAwareUpscale = CVarSettingsUpscale.GetValueOnGameThread() != 0
+	});
 
-			Executor.Dispatch<	TKernelDispatchParameters<>,
-								(EKD_VisType | EKD_SamplingPattern)>(Kernel);
-		};
+	if (!bTrace)
+	{
+		return;
+	}
 
-		FRenderState& RenderState = *ViewFamily.GetOrCreateExtentionData<FRenderState>();
-		RenderState.ViewFamilyData = RenderData;
-		RenderState.TraceTask = FFunctionGraphTask::CreateAndDispatchWhenReady(MoveTemp(TraceFunc), TStatId(), nullptr);
-		RenderState.FramebufferRenderThreadQueued = RenderData->FramebufferGameThread;
+	RenderData->LastTraceOrigin = Origin;
+	RenderData->LastTraceViewProjectionMatrix = ViewProjectionMatrix;
+	RenderData->LastTraceSettingsHash = SettingsHash;
+	RenderData->LastTracePhysicsGeneration = PhysicsGeneration;
+	RenderData->LastTraceSnapshot = Snapshot;
+
+	// Sample positions advance per trace rather than per frame, so frames we skip don't leave holes in the pattern.
+	const int64 TraceIndex = (int64)RenderData->NumTracesDispatched++;
+
+	// Fewer than GMaxTraceFramesInFlight are queued, and they're presented in order, so whichever trace last used this one has been.
+	FRealtimeTrace& Trace = RenderData->Traces[(int32)(TraceIndex % GMaxTraceFramesInFlight)];
+	Trace.Framebuffer = RenderData->FramebufferGameThread;
+	Trace.TraceIndex = TraceIndex;
+	Trace.bSceneChanged = bSceneChanged;
+	Trace.bNewFramebuffer = !bKeepFrameBuffer;
+	Trace.Foveation = GetFoveation(ViewFamily, View.UnscaledViewRect, (float)Trace.Framebuffer->Dimensions.X / (float)ViewRectSize.X);
+	Trace.RayBudget = Settings.RayBudget > 0 ? FMath::Max(FMath::RoundToInt32((float)Settings.RayBudget * Share), 1) : 0;
+
+	FPerspectiveRenderer& PerspectiveRenderer = Trace.PerspectiveRenderer.Emplace(	World,
+																					*Trace.Framebuffer,
+																					Settings,
+																					Origin,
+																					View.ViewMatrices);
+	PerspectiveRenderer.Snapshot = MoveTemp(Snapshot);
+	PerspectiveRenderer.DirtyPixels = &Trace.DirtyPixels;
+	PerspectiveRenderer.Settings.BudgetMs *= Share;
+	PerspectiveRenderer.Settings.SetSampleIndex((uint64)TraceIndex);
+	if (bLayered)
+	{
+		PerspectiveRenderer.Settings.CollisionQueryParams.MobilityType = EQueryMobilityType::Static;
+		PerspectiveRenderer.DynamicSettings.CollisionQueryParams.MobilityType = EQueryMobilityType::Dynamic;
+	}
+
+	// Traces all write into the same framebuffer, so chain them to keep them from overlapping.
+	FGraphEventArray Prerequisites;
+	if (RenderData->LastTraceTask)
+	{
+		Prerequisites.Add(RenderData->LastTraceTask);
 	}
+	RenderData->LastTraceTask = TGraphTask<FRealtimeTraceTask>::CreateTask(&Prerequisites).ConstructAndDispatchWhenReady(Trace);
+
+	++RenderData->NumTraceFramesInFlight;
+	RenderData->TraceFrames.Enqueue(FTraceFrame
+	{
+		.Task = RenderData->LastTraceTask,
+		.Framebuffer = RenderData->FramebufferGameThread,
+		.DirtyPixels = &Trace.DirtyPixels,
+		.FrameNumber = GFrameCounter
+	});
 }
 
-void FSDCollisionVisRealtimeViewExtension::PostRenderViewFamily_RenderThread(FRDGBuilder& GraphBuilder, FSceneViewFamily& ViewFamily)
+void FRealtimeTrace::Run()
 {
-	FRenderState* RenderStatePtr = ViewFamily.GetExtentionData<FRenderState>();
-	if (!RenderStatePtr)
+	LLM_SCOPE_BYTAG(SDCollisionVisRealtime);
+
+	const auto& Settings = PerspectiveRenderer->Settings;
+
+	// Reprojecting comes out of the budget too.
+	const double StartTime = FPlatformTime::Seconds();
+
+	// Keep what we've already traced when the view moves, rather than starting over.
+	const bool bReprojected = Framebuffer->Reproject(PerspectiveRenderer->Origin, PerspectiveRenderer->ViewMatrices, Settings.MinDistance);
+	// Hits which have been reprojected, or were traced against a different scene, need tracing again.
+	const bool bResetCoverage = bReprojected || bSceneChanged;
+	if (bResetCoverage || Framebuffer->TilesTileSize != Settings.TileSize)
 	{
-		return;
+		Framebuffer->ResetTiles(Settings.TileSize, bResetCoverage);
 	}
-
-	FRenderState& RenderState = *RenderStatePtr;
-	RenderState.ViewFamilyData->FramebufferRenderThread = RenderState.FramebufferRenderThreadQueued;
-	if (RenderState.TraceTask)
+	PerspectiveRenderer->Tiles = Framebuffer->Tiles;
+	PerspectiveRenderer->PixelCovered = Framebuffer->PixelCovered;
+	if (PerspectiveRenderer->Snapshot)
 	{
-		FTaskGraphInterface::Get().WaitUntilTaskCompletes(RenderState.TraceTask);
+		PerspectiveRenderer->Snapshot->ApplyPendingRefit();
 	}
 
-	FRDGTextureRef ViewFamilyTexture = TryCreateViewFamilyTexture(GraphBuilder, ViewFamily);
-	if (!ViewFamilyTexture)
+	const FIntPoint NumTiles = PerspectiveRenderer->GetNumTiles();
+	const int32 NumPixels = PerspectiveRenderer->RenderTargetSize.X * PerspectiveRenderer->RenderTargetSize.Y;
+
+	// Budgeted traces size themselves from how fast the previous ones went, until there's been one, just do a ray per tile.
+	// Foveated traces without a budget keep to a ray per tile too, just not spread evenly.
+	const bool bBudgeted = Settings.BudgetMs > 0.0f;
+	const bool bAllocated = bBudgeted || RayBudget > 0 || Foveation.IsEnabled();
+	int32 NumRays = NumTiles.X * NumTiles.Y;
+	if (bAllocated)
 	{
-		return;
+		const float RaysPerMs = Framebuffer->RaysPerMs.load();
+		if (bBudgeted && RaysPerMs > 0.0f)
+		{
+			const double RemainingMs = Settings.BudgetMs - (FPlatformTime::Seconds() - StartTime) * 1000.0;
+			NumRays = FMath::Clamp((int32)(RemainingMs * RaysPerMs), GMaxTraceBatchSize, NumPixels);
+		}
+		// The ray budget caps the time budget, or stands in for it.
+		if (RayBudget > 0)
+		{
+			NumRays = FMath::Min(bBudgeted ? NumRays : NumPixels, RayBudget);
+		}
+		AllocateTileRays(Framebuffer->Tiles, NumTiles, Settings.TileSize, Foveation, NumRays, Settings.FrameId, RaysPerTile);
+	}
+	DirtyPixels.Init(NumRays);
+	// A pooled framebuffer may be one the GPU copy was last uploaded from, before it was reset.
+	if (bReprojected || bNewFramebuffer)
+	{
+		DirtyPixels.bFullUpload = true;
 	}
 
-	struct FTraceTextureUploadData : FResourceBulkDataInterface
+	auto Kernel = [&](auto DispatchParameters)
+	{
+		const static ESamplingPattern SamplingPattern = decltype(DispatchParameters)::SamplingPattern;
+		const static EVisualisationType VisType = decltype(DispatchParameters)::VisType;
+		
+		// Blocks of neighbouring tiles rather than rows, so each batch of rays (and each worker's share of them) stays compact.
+		const FMortonOrder& TileOrder = Framebuffer->TileOrder;
+		FTraceWorkerPool::Get().ParallelFor(TileOrder.Blocks.Num(), [&](int32 BlockIndex)
+		{
+			if (bAllocated)
+			{
+				PerspectiveRenderer->RenderPerspectiveTileBlockBudgeted<SamplingPattern, VisType>(TileOrder.Blocks[BlockIndex], RaysPerTile);
+			}
+			else
+			{
+				PerspectiveRenderer->RenderPerspectiveTileBlock<SamplingPattern, VisType>(TileOrder.Blocks[BlockIndex]);
+			}
+		});
+	};
+
+	FKernelExecutor Executor
 	{
-		const void* GetResourceBulkData() const override final { return RenderBuffer->PixelData.GetData(); }
-		uint32 GetResourceBulkDataSize() const override final { return RenderBuffer->PixelData.Num() * RenderBuffer->PixelData.GetTypeSize(); }
-		void Discard() override final{ }
-		FRenderBuffer* RenderBuffer;
+		.VisType = Settings.VisType,
+		.SamplingPattern = Settings.SamplingPattern
 	};
-	
-	FRenderBuffer& RenderBuffer = *RenderState.FramebufferRenderThreadQueued.Get();
 
-	FTraceTextureUploadData Loader;
-	Loader.RenderBuffer = &RenderBuffer;
+	const double TraceStartTime = FPlatformTime::Seconds();
+	Executor.Dispatch<	TKernelDispatchParameters<>,
+						(EKD_VisType | EKD_SamplingPattern)>(Kernel);
+
+	// Whole buffer uploads are copied out now, while nothing else is writing to HitData (see UpdateHitBuffer).
+	if (DirtyPixels.NeedsFullUpload())
+	{
+		const TArray<FPackedHitRecord>& HitData = Framebuffer->HitData;
+		DirtyPixels.FullRecords.SetNumUninitialized(HitData.Num(), EAllowShrinking::No);
+		FMemory::Memcpy(DirtyPixels.FullRecords.GetData(), HitData.GetData(), HitData.Num() * sizeof(FPackedHitRecord));
+	}
+
+	const int32 NumTraced = FMath::Min(DirtyPixels.Num.load(), NumRays);
+	Framebuffer->LastNumRays = NumTraced;
+	if (Framebuffer->AreTilesConverged())
+	{
+		Framebuffer->ConvergedTrace = TraceIndex;
+	}
+	const double TraceMs = (FPlatformTime::Seconds() - TraceStartTime) * 1000.0;
+	if (bBudgeted && NumTraced > 0 && TraceMs > 0.0)
+	{
+		const float Measured = (float)(NumTraced / TraceMs);
+		const float Previous = Framebuffer->RaysPerMs.load();
+		Framebuffer->RaysPerMs = Previous > 0.0f ? FMath::Lerp(Previous, Measured, GRaysPerMsBlend) : Measured;
+	}
+}
+
+void FSDCollisionVisRealtimeViewExtension::PostRenderViewFamily_RenderThread(FRDGBuilder& GraphBuilder, FSceneViewFamily& ViewFamily)
+{
+	LLM_SCOPE_BYTAG(SDCollisionVisRealtime);
+
+	if (ViewDataRenderThread.IsEmpty())
+	{
+		return;
+	}
 
-	FTextureRHIRef TraceTexture = RHICreateTexture(
-		FRHITextureCreateDesc::Create2D(TEXT("SDCollisionVis.TracedTexture"), RenderBuffer.Dimensions.X, RenderBuffer.Dimensions.Y, PF_B8G8R8A8)
-			.SetFlags(TexCreate_ShaderResource)
-#if UE_VERSION_NEWER_THAN_OR_EQUAL(5, 7, 0)
-			.SetInitActionBulkData(&Loader))
-#else	// UE_VERSION_NEWER_THAN_OR_EQUAL(5, 6, 0)
-			.SetBulkData(&Loader))
-#endif // UE_VERSION
-		;
+	FRDGTextureRef ViewFamilyTexture = nullptr;
+	FGlobalShaderMap* GlobalShaderMap = GetGlobalShaderMap(ViewFamily.GetFeatureLevel());
 
+	for (int32 ViewIndex = 0; ViewIndex < ViewFamily.Views.Num(); ++ViewIndex)
 	{
-		FIntVector DestSize = ViewFamilyTexture->Desc.GetSize();
+		const FSceneView& View = *ViewFamily.Views[ViewIndex];
+		TSharedPtr<FSDCollisionVisRealtimeViewData>* Found = ViewDataRenderThread.Find(View.GetViewKey());
+		if (!Found)
+		{
+			continue;
+		}
+		FSDCollisionVisRealtimeViewData& ViewData = **Found;
+
+		// Only present views BeginRenderView has seen this frame, anything else has been turned off (or isn't ours).
+		while (const FPresentState* PresentState = ViewData.PresentStates.Peek())
+		{
+			if (PresentState->FrameNumber > GFrameCounterRenderThread)
+			{
+				break;
+			}
+			ViewData.PresentStates.Dequeue(ViewData.PresentState);
+		}
+		if (ViewData.PresentState.FrameNumber != GFrameCounterRenderThread)
+		{
+			continue;
+		}
+
+		if (!ViewFamilyTexture)
+		{
+			ViewFamilyTexture = TryCreateViewFamilyTexture(GraphBuilder, ViewFamily);
+			if (!ViewFamilyTexture)
+			{
+				return;
+			}
+		}
+
+		// Pick up every trace which has finished since last time, oldest first, without waiting on the rest.
+		FRDGBufferRef HitBuffer = nullptr;
+		while (const FTraceFrame* Frame = ViewData.TraceFrames.Peek())
+		{
+			if (!Frame->Task->IsComplete())
+			{
+				break;
+			}
+
+			HitBuffer = UpdateHitBuffer(GraphBuilder,
+										GlobalShaderMap,
+										ViewData,
+										Frame->Framebuffer,
+										Frame->DirtyPixels);
+			ViewData.FramebufferRenderThread = Frame->Framebuffer;
+			ViewData.PresentedFrameNumber = Frame->FrameNumber;
+
+			// Moved out rather than just dropped, so the queue doesn't hold onto the framebuffer.
+			FTraceFrame Presented;
+			ViewData.TraceFrames.Dequeue(Presented);
+			--ViewData.NumTraceFramesInFlight;
+		}
+
+		if (!HitBuffer)
+		{
+			if (!ViewData.HitBuffer)
+			{
+				// Nothing has finished tracing yet
+				continue;
+			}
+			HitBuffer = GraphBuilder.RegisterExternalBuffer(ViewData.HitBuffer);
+		}
+
+		ViewData.PresentedLag = (uint32)(GFrameCounterRenderThread - FMath::Min(ViewData.PresentedFrameNumber, GFrameCounterRenderThread));
+
+		const FIntRect& ViewRect = View.UnscaledViewRect;
 
-		FGlobalShaderMap* GlobalShaderMap = GetGlobalShaderMap(ViewFamily.GetFeatureLevel());
 		FDrawTracedTexturePS::FParameters* PassParameters = GraphBuilder.AllocParameters<FDrawTracedTexturePS::FParameters>();
-		PassParameters->SourceTexture = TryRegisterExternalTexture(GraphBuilder, CreateRenderTarget(TraceTexture, TEXT("SDVisCollision.TracedTextureSrc")));
-		PassParameters->InvViewport = FVector2f(1.0f / DestSize.X, 1.0f / DestSize.Y);
-		PassParameters->View = ViewFamily.Views[0]->ViewUniformBuffer;
-		PassParameters->RenderTargets[0] = FRenderTargetBinding(ViewFamilyTexture, ERenderTargetLoadAction::ENoAction);
+		const FColourParams& ColourParams = ViewData.PresentState.ColourParams;
+		PassParameters->HitRecords = GraphBuilder.CreateSRV(HitBuffer);
+		PassParameters->HitBufferSize = FUintVector2((uint32)ViewData.HitBufferDimensions.X, (uint32)ViewData.HitBufferDimensions.Y);
+		PassParameters->ViewportMin = FVector2f((float)ViewRect.Min.X, (float)ViewRect.Min.Y);
+		PassParameters->InvViewport = FVector2f(1.0f / ViewRect.Width(), 1.0f / ViewRect.Height());
+		PassParameters->RevViewForward = (FVector3f)ColourParams.RevViewForward;
+		PassParameters->RaytraceTimeMinTime = ColourParams.RaytraceTimeMinTime;
+		PassParameters->RaytraceTimeMaxTime = ColourParams.RaytraceTimeMaxTime;
+		PassParameters->TriangleDensityMinArea2 = ColourParams.TriangleDensityMinArea2;
+		PassParameters->TriangleDensityMul = ColourParams.TriangleDensityMul;
+		PassParameters->View = View.ViewUniformBuffer;
+		PassParameters->RenderTargets[0] = FRenderTargetBinding(ViewFamilyTexture, ERenderTargetLoadAction::ELoad);
 		
 		FDrawTracedTexturePS::FPermutationDomain PermutationVector;
+		PermutationVector.Set<FDrawTracedTexturePS::FVisTypeDim>((int32)ViewData.PresentState.VisType);
+		PermutationVector.Set<FDrawTracedTexturePS::FEdgeAwareUpscaleDim>(ViewData.PresentState.bEdgeAwareUpscale);
 		TShaderMapRef<FDrawTracedTexturePS> PixelShader(GlobalShaderMap, PermutationVector);
 
 		FPixelShaderUtils::AddFullscreenPass(
 			GraphBuilder,
 			GlobalShaderMap,
-			RDG_EVENT_NAME("SDCollisionVis::UpdateFromRenderThread"),
+			RDG_EVENT_NAME("SDCollisionVis::UpdateFromRenderThread (View %d)", ViewIndex),
 			PixelShader,
 			PassParameters,
-			FIntRect(0, 0, DestSize.X, DestSize.Y)
+			ViewRect
 		);
 	}
 
@@ -252,41 +1212,51 @@ static void LogInfoMessageKey(uint64 Key, const FString& Payload, const float Ti
 }
 
 
-static void RenderOfflineCollision(FSDOfflineCollisionSettings Settings)
+static FViewMatrices CreateViewMatrices(FVector RayOrigin, FRotator RayRotator, int32 Resolution, FMatrix CubemapRotation)
 {
-	auto CreateViewMatrices = [](FVector RayOrigin, FRotator RayRotator, int32 Resolution, FMatrix CubemapRotation)
-	{
-		FViewMatrices::FMinimalInitializer ViewMatricesInit;
-		ViewMatricesInit.ViewOrigin = RayOrigin;
-		ViewMatricesInit.ViewRotationMatrix = FInverseRotationMatrix(RayRotator);
+	FViewMatrices::FMinimalInitializer ViewMatricesInit;
+	ViewMatricesInit.ViewOrigin = RayOrigin;
+	ViewMatricesInit.ViewRotationMatrix = FInverseRotationMatrix(RayRotator);
+
+	// Random 90deg rotation that seems to be the done thing.
+	ViewMatricesInit.ViewRotationMatrix = ViewMatricesInit.ViewRotationMatrix * FMatrix(
+			FPlane(0, 0, 1, 0),
+			FPlane(1, 0, 0, 0),
+			FPlane(0, 1, 0, 0),
+			FPlane(0, 0, 0, 1));
+
+	ViewMatricesInit.ViewRotationMatrix = ViewMatricesInit.ViewRotationMatrix * CubemapRotation;
+
+	ViewMatricesInit.ProjectionMatrix = FReversedZPerspectiveMatrix(
+		UE_PI * 0.25,      //< 90 degrees FOV
+		(float)Resolution,
+		(float)Resolution,
+		4.0f              //< MinZ
+	);
+	ViewMatricesInit.ConstrainedViewRect = FIntRect(0, 0, Resolution, Resolution);
+	
+	return FViewMatrices(ViewMatricesInit);
+}
 
-		// Random 90deg rotation that seems to be the done thing.
-		ViewMatricesInit.ViewRotationMatrix = ViewMatricesInit.ViewRotationMatrix * FMatrix(
-				FPlane(0, 0, 1, 0),
-				FPlane(1, 0, 0, 0),
-				FPlane(0, 1, 0, 0),
-				FPlane(0, 0, 0, 1));
 
-		ViewMatricesInit.ViewRotationMatrix = ViewMatricesInit.ViewRotationMatrix * CubemapRotation;
+// Size of each face of an offline render, equirectangular panoramas being twice as wide as they are tall.
+static FIntPoint GetOfflineImageSize(const FSDOfflineCollisionSettings& Settings)
+{
+	if (Settings.Panorama == EPanoramaProjection::Equirectangular)
+	{
+		return FIntPoint(Settings.Resolution, FMath::Max(Settings.Resolution / 2, 1));
+	}
+	return FIntPoint(Settings.Resolution, Settings.Resolution);
+}
 
-		ViewMatricesInit.ProjectionMatrix = FReversedZPerspectiveMatrix(
-			UE_PI * 0.25,      //< 90 degrees FOV
-			(float)Resolution,
-			(float)Resolution,
-			4.0f              //< MinZ
-		);
-		ViewMatricesInit.ConstrainedViewRect = FIntRect(0, 0, Resolution, Resolution);
-		
-		return FViewMatrices(ViewMatricesInit);
-	};
-	
-	TArray<TSharedPtr<FRenderBuffer>> RenderBuffers;
-	TArray<TSharedPtr<FPerspectiveRenderer>> PerspectiveRenderers;
+// View for each face of an offline render, one per cubemap face, or just the one.
+// Panoramas only use theirs for colouring, as they trace in every direction.
+static TArray<FViewMatrices> CreateOfflineViewMatrices(const FSDOfflineCollisionSettings& Settings)
+{
+	TArray<FViewMatrices> FaceViewMatrices;
 
 	if (Settings.bCubeMap)
 	{
-		Settings.MaxRaysPerFrame = FMath::Max(1, Settings.MaxRaysPerFrame / 6);
-	
 		// Dealing with unreals man lying down cubemaps is rather confusing and painful
 		// (https://dev.epicgames.com/documentation/en-us/unreal-engine/creating-cubemaps)
 		// Mercifully, UMoviePipelineImagePassBase::CalcCubeFaceTransform provides a good
@@ -314,197 +1284,408 @@ static void RenderOfflineCollision(FSDOfflineCollisionSettings Settings)
 
 		for (int32 i = 0; i < 6; ++i)
 		{
-			FViewMatrices ViewMatrices = CreateViewMatrices(Settings.RayOrigin, Settings.RayRotator, Settings.Resolution, BasisRotations[i]);
-			TSharedPtr<FRenderBuffer> Buffer = MakeShared<FRenderBuffer>();
-			Buffer->Init({ Settings.Resolution, Settings.Resolution });
-			TSharedPtr<FPerspectiveRenderer> PerspectiveRenderer = MakeShared<FPerspectiveRenderer>(Settings.World, *Buffer, Settings, Settings.RayOrigin, ViewMatrices);
+			FaceViewMatrices.Add(CreateViewMatrices(Settings.RayOrigin, Settings.RayRotator, Settings.Resolution, BasisRotations[i]));
+		}
+	}
+	else
+	{
+		FaceViewMatrices.Add(CreateViewMatrices(Settings.RayOrigin, Settings.RayRotator, Settings.Resolution, FMatrix::Identity));
+	}
+
+	return FaceViewMatrices;
+}
+
+// Where an offline render goes unless told otherwise, Saved/SDCollisionVis/<Map><Suffix>_<DateTime>.<Extension>
+static FString MakeOfflineOutputFilename(const FSDOfflineCollisionSettings& Settings, const FString& Suffix, const FString& Extension)
+{
+	FString OutDir = FPaths::Combine(FPaths::ProjectDir(), TEXT("Saved"), TEXT("SDCollisionVis"));
+	if (!IFileManager::Get().DirectoryExists(*OutDir))
+	{
+		IFileManager::Get().MakeDirectory(*OutDir, true);
+	}
+
+	FString MapName;
+	if (ULevel* Level = Settings.World->GetCurrentLevel())
+	{
+		MapName = Level->GetOutermost()->GetName();
+		if (MapName.Contains(TEXT("/")))
+		{
+			MapName.Split(TEXT("/"), nullptr, &MapName, ESearchCase::IgnoreCase, ESearchDir::FromEnd);
+		}
+	}
+	if (MapName.IsEmpty())
+	{
+		MapName = TEXT("UnknownMap");
+	}
+
+	FString OutFile;
+	FFileHelper::GenerateDateTimeBasedBitmapFilename(OutDir / (MapName + Suffix), Extension, OutFile);
+	return OutFile;
+}
+
+// Saves a finished offline render which was kept in memory, as a .png, or a .dds for cubemaps.
+// Safe to call off the GameThread, encoding straight out of the render buffers.
+static bool WriteOfflineRender(	const FSDOfflineCollisionSettings& Settings,
+								const TArray<TSharedPtr<FRenderBuffer>>& RenderBuffers,
+								const FString& OutFile)
+{
+	IFileManager::Get().MakeDirectory(*FPaths::GetPath(OutFile), true);
+
+	if (!Settings.bCubeMap)
+	{
+		const FRenderBuffer& Buffer = *RenderBuffers[0];
+		FImageView Data(Buffer.PixelData.GetData(), Buffer.Dimensions.X, Buffer.Dimensions.Y);
+		return FImageUtils::SaveImageByExtension(*OutFile, Data);
+	}
+
+	TArray<TConstArrayView<FColor>, TFixedAllocator<6>> Faces;
+	for (const TSharedPtr<FRenderBuffer>& Buffer : RenderBuffers)
+	{
+		Faces.Add(Buffer->PixelData);
+	}
+	return WriteCubemapDDS(OutFile, Settings.Resolution, Faces, Settings.bCompressBC7);
+}
+
+
+// Pixels (of every face) traced by each batch of an offline render kept in memory.
+static constexpr int32 GOfflineBatchSize = 8 * GMaxTraceBatchSize;
+
+// Worker pool jobs each background offline render keeps queued, so the next is ready to go as soon as one finishes.
+static constexpr int32 GOfflineJobsInFlight = 2;
+
+// An offline render, cut up into batches which can be traced in any order, and in parallel.
+// Either the whole image is kept in memory until it's written out at the end, or when tiled, each batch is a tile
+// which is streamed out to a TIFF as soon as it's been traced, so only the tiles being traced are ever in memory.
+// Run in the background by RenderOfflineCollision, or all in one go by RenderOfflineCollisionBlocking.
+struct FOfflineRenderJob
+{
+	FSDOfflineCollisionSettings    Settings;
+	FString                        OutputFile;
+	TArray<FViewMatrices>          FaceViewMatrices;
+	FColourParams                  ColourParams;	//< Use a consistent forward vector, so things don't look super weird between faces
+	TSharedPtr<FCollisionSnapshot> Snapshot;
+	FKernelExecutor                Executor;
+	FIntPoint                      ImageSize;
+
+	// Every face is cut into the same number of batches, all of which go into one pool, so faces are traced side by side.
+	int64                          ItemsPerFace = 0;	//< Pixels (of PixelOrder) when kept in memory, or tiles when tiled
+	int64                          ItemsPerBatch = 1;
+	int64                          NumBatchesPerFace = 0;
+	int64                          NumItems = 0;		//< Of every face
+
+	// Kept in memory only
+	TArray<TSharedPtr<FRenderBuffer>>        RenderBuffers;
+	TArray<TSharedPtr<FPerspectiveRenderer>> PerspectiveRenderers;
+	FMortonOrder                             PixelOrder;	//< Rays go out in Morton order, so each batch covers a compact patch of the image
+
+	// Tiled only
+	TUniquePtr<FTiledTiffWriter> TileWriter;
+	FMortonOrder                 TilePixelOrder;
+
+	// Background only, GameThread only (other than bCancelled), see RenderOfflineCollision.
+	int64                                NextBatch = 0;	//< First batch not yet dispatched
+	int64                                NumItemsDone = 0;
+	int64                                BatchesPerJob = 1;
+	TArray<TPair<FGraphEventRef, int64>> InFlight;	//< Worker pool jobs dispatched, and how many items each covers
+	std::atomic<bool>                    bCancelled = false;	//< The world is going away, batches yet to start are skipped
+	FDelegateHandle                      WorldCleanupHandle;
+	FGraphEventRef                       WriteTask;	//< Encoding and writing the file out, once every batch is done
+	bool                                 bFileWritten = false;	//< Set by WriteTask
+	uint64                               LogKey = 0;
+
+	bool Init(const FSDOfflineCollisionSettings& InSettings, const FString& OutputPath)
+	{
+		Settings = InSettings;
+		Executor = FKernelExecutor{ .VisType = Settings.VisType };
+		FaceViewMatrices = CreateOfflineViewMatrices(Settings);
+		ColourParams = Settings.GetColourParams(-FaceViewMatrices[0].GetOverriddenTranslatedViewMatrix().GetColumn(2));
+
+		// Offline renders snapshot the scene once up front, so everything is traced against the same state.
+		if (Settings.TraceEngine == ETraceEngine::Snapshot)
+		{
+			Snapshot = FCollisionSnapshot::Gather(Settings.World, Settings);
+			Snapshot->Build();
+		}
+
+		const FString Suffix = Settings.bCubeMap ? TEXT("_cubemap") : (Settings.Panorama != EPanoramaProjection::None ? TEXT("_panorama") : TEXT(""));
+		ImageSize = GetOfflineImageSize(Settings);
+		if (Settings.bTiled)
+		{
+			OutputFile = OutputPath.IsEmpty() ? MakeOfflineOutputFilename(Settings, Suffix, TEXT("tif")) : OutputPath;
+			TileWriter = MakeUnique<FTiledTiffWriter>();
+			if (!TileWriter->Open(OutputFile, ImageSize, Settings.OutputTileSize, FaceViewMatrices.Num()))
+			{
+				return false;
+			}
+
+			TilePixelOrder.Init(FIntPoint(Settings.OutputTileSize, Settings.OutputTileSize));
+			ItemsPerFace = (int64)TileWriter->GetNumTiles().X * TileWriter->GetNumTiles().Y;
+			ItemsPerBatch = 1;
+		}
+		else
+		{
+			OutputFile = OutputPath.IsEmpty() ? MakeOfflineOutputFilename(Settings, Suffix, Settings.bCubeMap ? TEXT("dds") : TEXT("png")) : OutputPath;
 
-			RenderBuffers.Add(Buffer);
-			PerspectiveRenderers.Add(PerspectiveRenderer);
+			// Loaded up front, since the image gets encoded off the GameThread.
+			FModuleManager::Get().LoadModule(TEXT("ImageWrapper"));
+
+			for (const FViewMatrices& ViewMatrices : FaceViewMatrices)
+			{
+				TSharedPtr<FRenderBuffer> Buffer = MakeShared<FRenderBuffer>();
+				Buffer->Init(ImageSize);
+				TSharedPtr<FPerspectiveRenderer> PerspectiveRenderer = MakeShared<FPerspectiveRenderer>(Settings.World, *Buffer, Settings, Settings.RayOrigin, ViewMatrices);
+				PerspectiveRenderer->SetPanorama(Settings.Panorama, Settings.RayRotator);
+				PerspectiveRenderer->ColourParams = ColourParams;
+				PerspectiveRenderer->Snapshot = Snapshot;
+
+				RenderBuffers.Add(Buffer);
+				PerspectiveRenderers.Add(PerspectiveRenderer);
+			}
+
+			PixelOrder.Init(ImageSize);
+			ItemsPerFace = PixelOrder.Num();
+			ItemsPerBatch = GOfflineBatchSize;
+		}
+
+		NumBatchesPerFace = FMath::DivideAndRoundUp(ItemsPerFace, ItemsPerBatch);
+		NumItems = ItemsPerFace * FaceViewMatrices.Num();
+		return true;
+	}
+
+	int64 GetNumBatches() const
+	{
+		return NumBatchesPerFace * FaceViewMatrices.Num();
+	}
+
+	// Face a batch belongs to, and the range of items within it.
+	int32 GetBatchRange(int64 BatchIndex, int64& OutStart, int64& OutEnd) const
+	{
+		OutStart = (BatchIndex % NumBatchesPerFace) * ItemsPerBatch;
+		OutEnd = FMath::Min(OutStart + ItemsPerBatch, ItemsPerFace);
+		return (int32)(BatchIndex / NumBatchesPerFace);
+	}
+
+	int64 GetNumRaysPerBatch() const
+	{
+		return TileWriter ? (int64)Settings.OutputTileSize * Settings.OutputTileSize : ItemsPerBatch;
+	}
+
+	uint64 GetNumRays() const
+	{
+		return (uint64)ImageSize.X * (uint64)ImageSize.Y * (uint64)FaceViewMatrices.Num();
+	}
+
+	void TraceBatch(int64 BatchIndex) const
+	{
+		int64 Start, End;
+		const int32 Face = GetBatchRange(BatchIndex, Start, End);
+
+		Executor.Dispatch<	TKernelDispatchParameters<>,
+							EKD_VisType>([&](auto DispatchParameters)
+		{
+			const static EVisualisationType VisType = decltype(DispatchParameters)::VisType;
+
+			if (TileWriter)
+			{
+				for (int64 Item = Start; Item < End; ++Item)
+				{
+					TraceTile<VisType>(Face, (int32)Item);
+				}
+				return;
+			}
+
+			// Blocks hanging off the edge give out positions outside the image, which get skipped.
+			TTraceBatchArray<FIntPoint> PixelPositions;
+			for (int64 BatchStart = Start; BatchStart < End; BatchStart += GMaxTraceBatchSize)
+			{
+				PixelPositions.Reset();
+				const int64 BatchEnd = FMath::Min(BatchStart + GMaxTraceBatchSize, End);
+				for (int64 PixelOffset = BatchStart; PixelOffset < BatchEnd; ++PixelOffset)
+				{
+					PixelPositions.Add(PixelOrder.GetCell(PixelOffset));
+				}
+
+				PerspectiveRenderers[Face]->RenderPerspectivePixels<VisType>(PixelPositions);
+			}
+		});
+	}
+
+	// Traces a single tile into a buffer of its own, then streams it out.
+	template<EVisualisationType VisType>
+	void TraceTile(int32 Face, int32 TileIndex) const
+	{
+		const FIntPoint NumTiles = TileWriter->GetNumTiles();
+		const FIntPoint Tile(TileIndex % NumTiles.X, TileIndex / NumTiles.X);
+		const FIntPoint TileStart = Tile * Settings.OutputTileSize;
+
+		// Edge tiles are cut short, the rest of the tile is left blank.
+		const FIntPoint TileSize = FIntPoint(Settings.OutputTileSize, Settings.OutputTileSize).ComponentMin(ImageSize - TileStart);
+
+		FRenderBuffer Buffer;
+		Buffer.Init(FIntPoint(Settings.OutputTileSize, Settings.OutputTileSize));
+		FPerspectiveRenderer PerspectiveRenderer(Settings.World, Buffer, Settings, Settings.RayOrigin, FaceViewMatrices[Face]);
+		PerspectiveRenderer.SetImageRegion(ImageSize, TileStart);
+		PerspectiveRenderer.SetPanorama(Settings.Panorama, Settings.RayRotator);
+		PerspectiveRenderer.ColourParams = ColourParams;
+		PerspectiveRenderer.Snapshot = Snapshot;
+
+		TTraceBatchArray<FIntPoint> PixelPositions;
+		for (int64 Cell = 0; Cell < TilePixelOrder.Num(); ++Cell)
+		{
+			const FIntPoint PixelPos = TilePixelOrder.GetCell(Cell);
+			if (PixelPos.X < TileSize.X && PixelPos.Y < TileSize.Y)
+			{
+				PixelPositions.Add(PixelPos);
+			}
+			if (PixelPositions.Num() == GMaxTraceBatchSize || (Cell + 1 == TilePixelOrder.Num()))
+			{
+				PerspectiveRenderer.RenderPerspectivePixels<VisType>(PixelPositions);
+				PixelPositions.Reset();
+			}
+		}
+
+		TileWriter->WriteTile(Face, Tile, Buffer.PixelData);
+	}
+
+	// Writes out whatever hasn't been already, safe to call off the GameThread.
+	bool Write()
+	{
+		return TileWriter ? TileWriter->Close() : WriteOfflineRender(Settings, RenderBuffers, OutputFile);
+	}
+
+	// GameThread only.
+	void ReportWritten(bool bFileWritten) const
+	{
+		if (bFileWritten)
+		{
+			LogInfoMessageKey(	LogKey,
+								FString::Printf(TEXT("Written to: %s"),
+								*FPaths::ConvertRelativePathToFull(OutputFile)));
+		}
+		else
+		{
+			LogInfoMessageKey(LogKey, FString::Printf(TEXT("Failed to write: %s"), *FPaths::ConvertRelativePathToFull(OutputFile)));
+		}
+	}
+
+	void RetireFinished()
+	{
+		for (int32 Index = InFlight.Num() - 1; Index >= 0; --Index)
+		{
+			if (InFlight[Index].Key->IsComplete())
+			{
+				NumItemsDone += InFlight[Index].Value;
+				InFlight.RemoveAtSwap(Index, 1, EAllowShrinking::No);
+			}
 		}
+	}
 
-		// Use a consistent forward vector, so things don't look super weird between slices
-		for (int32 i = 1; i < 6; ++i)
+	void WaitForAll()
+	{
+		for (const TPair<FGraphEventRef, int64>& Batch : InFlight)
 		{
-			PerspectiveRenderers[i]->RevViewForward = PerspectiveRenderers[0]->RevViewForward;
+			FTaskGraphInterface::Get().WaitUntilTaskCompletes(Batch.Key);
+			NumItemsDone += Batch.Value;
 		}
+		InFlight.Reset();
 	}
-	else
-	{
-		FViewMatrices ViewMatrices = CreateViewMatrices(Settings.RayOrigin, Settings.RayRotator, Settings.Resolution, FMatrix::Identity);
-
-		TSharedPtr<FRenderBuffer> Buffer = MakeShared<FRenderBuffer>();
-		Buffer->Init({ Settings.Resolution, Settings.Resolution });
-		TSharedPtr<FPerspectiveRenderer> PerspectiveRenderer = MakeShared<FPerspectiveRenderer>(Settings.World, *Buffer, Settings, Settings.RayOrigin, ViewMatrices);
-
-		RenderBuffers.Add(Buffer);
-		PerspectiveRenderers.Add(PerspectiveRenderer);
-	}
+};
 
-	FKernelExecutor Executor
+static void RenderOfflineCollision(const FSDOfflineCollisionSettings& Settings)
+{
+	TSharedRef<FOfflineRenderJob> Job = MakeShared<FOfflineRenderJob>();
+	Job->LogKey = uint64(FMath::Rand());
+	if (!Job->Init(Settings, FString()))
 	{
-		.VisType = Settings.VisType
-	};
+		LogInfoMessageKey(Job->LogKey, FString::Printf(TEXT("Failed to open: %s"), *FPaths::ConvertRelativePathToFull(Job->OutputFile)));
+		return;
+	}
 
-	uint64 MaxIterations = FMath::DivideAndRoundUp(	uint64(Settings.Resolution) * uint64(Settings.Resolution),
-													uint64(Settings.MaxRaysPerFrame));
+	// Traced on the worker pool like everything else, so it stays out of the way of gameplay tasks.
+	// MaxRaysPerFrame is how many rays we'd like in flight at once, split between the queued jobs,
+	// but never so few that the pool's threads can't all have a couple of batches each.
+	const int64 NumParticipants = FTraceWorkerPool::Get().GetNumParticipants();
+	const int64 MaxBatchesInFlight = FMath::DivideAndRoundUp((int64)Settings.MaxRaysPerFrame, Job->GetNumRaysPerBatch());
+	Job->BatchesPerJob = FMath::Max(2 * NumParticipants, FMath::DivideAndRoundUp(MaxBatchesInFlight, (int64)GOfflineJobsInFlight));
 
-	FTSTicker::GetCoreTicker().AddTicker(FTickerDelegate::CreateLambda(
-	[
-		Executor=FKernelExecutor{ .VisType = Settings.VisType },
-		RenderBuffers=MoveTemp(RenderBuffers),
-		PerspectiveRenderers=MoveTemp(PerspectiveRenderers),
-		Iteration=uint64(0),
-		MaxIterations=MaxIterations,
-		Settings=Settings,
-		TraceTask=FGraphEventRef(),
-		LogKey = uint64(FMath::Rand())
-	]
-	(float) mutable
+	// Batches can still be running when the world goes, so skip whatever hasn't started, and hold its cleanup until the rest are done.
+	Job->WorldCleanupHandle = FWorldDelegates::OnWorldCleanup.AddLambda([WeakJob=TWeakPtr<FOfflineRenderJob>(Job)](UWorld* World, bool, bool)
 	{
-		if (TraceTask)
+		if (TSharedPtr<FOfflineRenderJob> PinnedJob = WeakJob.Pin(); PinnedJob && PinnedJob->Settings.World == World)
 		{
-			FTaskGraphInterface::Get().WaitUntilTaskCompletes(TraceTask);
+			PinnedJob->bCancelled = true;
+			PinnedJob->WaitForAll();
 		}
+	});
+
+	FTSTicker::GetCoreTicker().AddTicker(FTickerDelegate::CreateLambda([Job](float)
+	{
+		Job->RetireFinished();
 
-		if (!IsValid(Settings.World))
+		if (!Job->WriteTask && (Job->bCancelled || !IsValid(Job->Settings.World)))
 		{
-			LogInfoMessageKey(LogKey, TEXT("World has gone out of scope! Bailing!"));
+			LogInfoMessageKey(Job->LogKey, TEXT("World has gone out of scope! Bailing!"));
+			Job->bCancelled = true;
+			Job->WaitForAll();
+			FWorldDelegates::OnWorldCleanup.Remove(Job->WorldCleanupHandle);
 			return false;
 		}
 
-		LogInfoMessageKey(	LogKey,
-							FString::Printf(TEXT("%02.02f%% [%d / %d]"),
-											(100.0f * Iteration) / MaxIterations,
-											Iteration,
-											MaxIterations));
-
-		// Hooray we're done
-		if (Iteration == MaxIterations)
+		// Keep the pool topped up, the jobs hold a reference to the render so it outlives them regardless.
+		const int64 NumBatches = Job->GetNumBatches();
+		while (Job->InFlight.Num() < GOfflineJobsInFlight && Job->NextBatch < NumBatches)
 		{
-			FString OutDir = FPaths::Combine(FPaths::ProjectDir(), TEXT("Saved"), TEXT("SDCollisionVis"));
-			if (!IFileManager::Get().DirectoryExists(*OutDir))
-			{
-				IFileManager::Get().MakeDirectory(*OutDir, true);
-			}
+			const int64 FirstBatch = Job->NextBatch;
+			const int64 NumJobBatches = FMath::Min(Job->BatchesPerJob, NumBatches - FirstBatch);
+			Job->NextBatch += NumJobBatches;
 
-			FString MapName;
-			if (ULevel* Level = Settings.World->GetCurrentLevel())
+			int64 NumJobItems = 0;
+			for (int64 BatchIndex = FirstBatch; BatchIndex < FirstBatch + NumJobBatches; ++BatchIndex)
 			{
-				MapName = Level->GetOutermost()->GetName();
-				if (MapName.Contains(TEXT("/")))
-				{
-					MapName.Split(TEXT("/"), nullptr, &MapName, ESearchCase::IgnoreCase, ESearchDir::FromEnd);
-				}
-			}
-			if (MapName.IsEmpty())
-			{
-				MapName = TEXT("UnknownMap");
+				int64 Start, End;
+				Job->GetBatchRange(BatchIndex, Start, End);
+				NumJobItems += End - Start;
 			}
 
-			bool bFileWritten = false;
-			FString OutFile;
-			
-			if (!Settings.bCubeMap)
-			{
-				FFileHelper::GenerateDateTimeBasedBitmapFilename(OutDir / MapName, TEXT("png"), OutFile);
-
-				const FRenderBuffer& Buffer = *RenderBuffers[0];
-				FImageView Data(Buffer.PixelData.GetData(), Settings.Resolution, Settings.Resolution);
-				FImageUtils::SaveImageByExtension(*OutFile, Data);
-				bFileWritten = true;
-			}
-			else
+			FGraphEventRef Event = FTraceWorkerPool::Get().ParallelForAsync((int32)NumJobBatches, [Job, FirstBatch](int32 Index)
 			{
-				FFileHelper::GenerateDateTimeBasedBitmapFilename(OutDir / (MapName + TEXT("_cubemap")), TEXT("dds"), OutFile);
-
-				UE::DDS::EDDSError Error;
-				UE::DDS::FDDSFile* DDS = UE::DDS::FDDSFile::CreateEmpty(/* Dimensions*/     2,
-																		/* InWidth */       Settings.Resolution,
-																		/* InHeight */      Settings.Resolution,
-																		/* InDepth */       1,
-																		/* InMipCount */    1,
-																		/* ArraySize */     6,
-																		/* InFormat */      UE::DDS::EDXGIFormat::B8G8R8A8_UNORM_SRGB,
-																		/* InCreateFlags */ UE::DDS::FDDSFile::CREATE_FLAG_CUBEMAP,
-																		/* OutError */      &Error);
-				if ( DDS == nullptr || Error != UE::DDS::EDDSError::OK )
+				if (!Job->bCancelled)
 				{
-					LogInfoMessageKey(	LogKey,
-										FString::Printf(TEXT("Failed to save cubemap! FDDSFile::CreateEmpty (Error=%d)"),
-														(int)Error));
+					Job->TraceBatch(FirstBatch + Index);
 				}
-				else
-				{
-					TUniquePtr<UE::DDS::FDDSFile> DeleteOnExit(DDS);
-					for(int32 Face = 0; Face < 6; Face++)
-					{
-						FImageView Data(	RenderBuffers[Face]->PixelData.GetData(),
-											Settings.Resolution,
-											Settings.Resolution);
-						DDS->FillMip( Data, Face );
-					}
+			});
+			Job->InFlight.Emplace(MoveTemp(Event), NumJobItems);
+		}
 
-					TArray64<uint8> BytesToWrite;
-					check(DDS->WriteDDS(BytesToWrite) == UE::DDS::EDDSError::OK);
+		LogInfoMessageKey(	Job->LogKey,
+							FString::Printf(TEXT("%02.02f%% [%lld / %lld]"),
+											(100.0 * Job->NumItemsDone) / Job->NumItems,
+											Job->NumItemsDone,
+											Job->NumItems));
 
-					if (FArchive* FileHandle = IFileManager::Get().CreateFileWriter(*OutFile))
-					{
-						FileHandle->Serialize(BytesToWrite.GetData(), BytesToWrite.Num());
-						FileHandle->Close();
-						delete FileHandle;
-					}
-					bFileWritten = true;
-				}
+		// Hooray we're done, encoding and writing can take a while at high resolutions, so that's left to the background too.
+		if (Job->NumItemsDone == Job->NumItems)
+		{
+			if (!Job->WriteTask)
+			{
+				FWorldDelegates::OnWorldCleanup.Remove(Job->WorldCleanupHandle);
+				Job->WriteTask = FFunctionGraphTask::CreateAndDispatchWhenReady(	[Job]() { Job->bFileWritten = Job->Write(); },
+																					TStatId(),
+																					nullptr,
+																					ENamedThreads::AnyBackgroundThreadNormalTask);
 			}
-
-			if (bFileWritten)
+			else if (Job->WriteTask->IsComplete())
 			{
-				LogInfoMessageKey(	LogKey,
-									FString::Printf(TEXT("Written to: %s"),
-									*FPaths::ConvertRelativePathToFull(OutFile)));
+				Job->ReportWritten(Job->bFileWritten);
+				return false;
 			}
-
-			return false;
 		}
 
-		TFunction<void()> TraceFunc = [	&PerspectiveRenderers,
-										Executor,
-										MaxRaysPerFrame=Settings.MaxRaysPerFrame,
-										Resolution=Settings.Resolution,
-										Iteration=Iteration++]
-		{
-			// NB: We don't care about sampling pattern, since we just stride stuff out
-			Executor.Dispatch<	TKernelDispatchParameters<>,
-								EKD_VisType>([&](auto DispatchParameters)
-			{
-				const static EVisualisationType VisType = decltype(DispatchParameters)::VisType;
-
-				ParallelFor(MaxRaysPerFrame, [&](int32 Offset)
-				{
-					// TODO: Fully linear tiling is a bit crap, since whats on screen can change
-					//       (e.g, the bottom half of the screen would change as a player moves)
-					//       I'm sure there's some sort of stochastically stable way to dither it.
-					//       Could do something like:
-					//          PixelOffset = (PixelOffset * p) % NumPixels;
-					//       Where p is a large prime number, although that would create a white
-					//       noise pattern.
-					uint64 PixelOffset = MaxRaysPerFrame * Iteration + Offset;
-					FIntPoint PixelPos = FIntPoint(PixelOffset % Resolution, PixelOffset / Resolution);
-					for (const auto& PerspectiveRenderer : PerspectiveRenderers)
-					{
-						PerspectiveRenderer->RenderPerspectivePixel<VisType>(PixelPos);
-					}
-				});
-			});
-		};
-
-		TraceTask = FFunctionGraphTask::CreateAndDispatchWhenReady(MoveTemp(TraceFunc), TStatId(), nullptr);
 		return true;
 	}));
 }
 
-static void DeriveTransformFromWorld(FVector& RayOrigin, FRotator& RayRotator, UWorld* World, int32 PlayerControllerIndex, TArray<FString> Messages)
+static void DeriveTransformFromWorld(FVector& RayOrigin, FRotator& RayRotator, UWorld* World, int32 PlayerControllerIndex, TArray<FString>& Messages)
 {
 	if (PlayerControllerIndex < 0)
 	{
@@ -577,13 +1758,42 @@ static void DeriveTransformFromWorld(FVector& RayOrigin, FRotator& RayRotator, U
 	}
 }
 
+// Largest offline render which is kept in memory, anything bigger gets tiled.
+static constexpr int32 GMaxOfflineResolution = 8192;
+static constexpr int32 GMaxTiledOfflineResolution = 65536;
+
+// Parses the resolution, cubemap and tiling arguments common to every offline render.
+static void ParseOfflineImageParams(const TCHAR* Params, FSDOfflineCollisionSettings& Settings)
+{
+	Settings.Resolution = 512;			FParse::Value(Params, TEXT("resolution="), Settings.Resolution);
+	Settings.bCubeMap	=				FParse::Param(Params, TEXT("cubemap"));
+	Settings.bTiled		=				FParse::Param(Params, TEXT("tiled"));
+	Settings.OutputTileSize = 512;		FParse::Value(Params, TEXT("tile-size="), Settings.OutputTileSize);
+	Settings.bCompressBC7 =				FParse::Param(Params, TEXT("bc7"));
+
+	FString Panorama;					FParse::Value(Params, TEXT("panorama="), Panorama);
+	Settings.Panorama = Panorama == TEXT("equirect") ? EPanoramaProjection::Equirectangular
+						: (Panorama == TEXT("octahedral") ? EPanoramaProjection::Octahedral : EPanoramaProjection::None);
+	Settings.bCubeMap &= Settings.Panorama == EPanoramaProjection::None;
+
+	Settings.bTiled |= Settings.Resolution > GMaxOfflineResolution;
+	Settings.Resolution = FMath::Clamp(Settings.Resolution, 32, Settings.bTiled ? GMaxTiledOfflineResolution : GMaxOfflineResolution);
+
+	// TIFF tiles have to be a multiple of 16
+	Settings.OutputTileSize = Align(FMath::Clamp(Settings.OutputTileSize, 16, 4096), 16);
+}
+
 static FAutoConsoleCommandWithWorldAndArgs ConsoleCommandOfflineRender(
 	TEXT("r.SDCollisionVis.OfflineRender()"),
 	TEXT("Render the phys scene and save the result")
 	TEXT("Args:\n")
 	TEXT("    -resolution         : Resolution to use. (Default: 512)\n")
-	TEXT("    -max-rays-per-frame : Number of rays to dispatch per frame. (Default: 1024)\n")
+	TEXT("    -max-rays-per-frame : Number of rays to keep in flight, more are if the workers would otherwise go idle. (Default: 1024)\n")
 	TEXT("    -cubemap            : Render as a CubeMap. (Default: false)\n")
+	TEXT("    -tiled              : Stream the render out to a tiled TIFF a tile at a time, always on above 8192. (Default: false)\n")
+	TEXT("    -tile-size          : Size of each tile when tiled. (Default: 512)\n")
+	TEXT("    -bc7                : Compress cubemaps to BC7. (Default: false)\n")
+	TEXT("    -panorama           : Render the whole sphere into one image instead, equirect or octahedral. (Default: none)\n")
 	TEXT("    -player-controller  : Player controller for fetching transform info. (Default: 0)\n")
 	,
 	FConsoleCommandWithWorldAndArgsDelegate::CreateLambda([](const TArray<FString>& Args, UWorld* World)
@@ -594,16 +1804,15 @@ static FAutoConsoleCommandWithWorldAndArgs ConsoleCommandOfflineRender(
 		Settings.World = World;
 
 		FString Params = FString::Join(Args, TEXT(" "));
-		Settings.Resolution = 512;             FParse::Value(*Params, TEXT("resolution="), Settings.Resolution);
+		ParseOfflineImageParams(*Params, Settings);
 		Settings.MaxRaysPerFrame = 1024;       FParse::Value(*Params, TEXT("max-rays-per-frame="), Settings.MaxRaysPerFrame);
-		Settings.bCubeMap	=                  FParse::Param(*Params, TEXT("cubemap"));
 		
 		int32 PlayerControllerIndex = 0;    FParse::Value(*Params, TEXT("player-controller="), PlayerControllerIndex);
 		
-		Settings.Resolution = FMath::Clamp(Settings.Resolution, 32, 8192);
 		Settings.MaxRaysPerFrame = FMath::Clamp(Settings.MaxRaysPerFrame, 4, (WITH_EDITOR) ? (1 << 16) : 4096);
 
-		uint64 NumRays = (uint64)Settings.MaxRaysPerFrame * (uint64)Settings.MaxRaysPerFrame;
+		const FIntPoint ImageSize = GetOfflineImageSize(Settings);
+		uint64 NumRays = (uint64)ImageSize.X * (uint64)ImageSize.Y;
 		if (Settings.bCubeMap)
 		{
 			NumRays *= 6llu;
@@ -615,6 +1824,8 @@ static FAutoConsoleCommandWithWorldAndArgs ConsoleCommandOfflineRender(
 		Messages.Add(FString::Printf(TEXT("MaxRaysPerFrame = %d"), Settings.MaxRaysPerFrame));
 		Messages.Add(FString::Printf(TEXT("|- NumRays = %llu"), NumRays));
 		Messages.Add(FString::Printf(TEXT("bCubeMap = %d"), (int32)Settings.bCubeMap));
+		Messages.Add(FString::Printf(TEXT("bTiled = %d"), (int32)Settings.bTiled));
+		Messages.Add(FString::Printf(TEXT("Panorama = %d"), (int32)Settings.Panorama));
 		Messages.Add(FString::Printf(TEXT("PlayerControllerIndex = %d"), PlayerControllerIndex));
 
 		Settings.RayOrigin = FVector::Zero();
@@ -632,6 +1843,526 @@ static FAutoConsoleCommandWithWorldAndArgs ConsoleCommandOfflineRender(
 		RenderOfflineCollision(Settings);
 	}));
 
+
+// Traces the whole of an offline render in one go, blocking until it's done.
+// Rather than being metered out a frame at a time, every batch of every face goes into one ParallelFor on the
+// task graph, so it'll keep every core busy until it's finished.
+static bool RenderOfflineCollisionBlocking(const FSDOfflineCollisionSettings& Settings, const FString& OutputPath)
+{
+	const double StartTime = FPlatformTime::Seconds();
+
+	FOfflineRenderJob Job;
+	Job.LogKey = INDEX_NONE;
+	if (!Job.Init(Settings, OutputPath))
+	{
+		UE_LOG(LogSDCollisionVis, Error, TEXT("Failed to open: %s"), *FPaths::ConvertRelativePathToFull(Job.OutputFile));
+		return false;
+	}
+
+	const double TraceStartTime = FPlatformTime::Seconds();
+
+	const int32 NumBatches = (int32)Job.GetNumBatches();
+	std::atomic<int32> NumBatchesDone = 0;
+	ParallelFor(NumBatches, [&](int32 BatchIndex)
+	{
+		Job.TraceBatch(BatchIndex);
+
+		// Whoever finishes the batch which crosses the next 10% reports it.
+		const int32 Done = NumBatchesDone.fetch_add(1) + 1;
+		if ((Done * 10) / NumBatches != ((Done - 1) * 10) / NumBatches)
+		{
+			UE_LOG(LogSDCollisionVis, Display, TEXT("Offline render %d%% [%d / %d batches]"), (Done * 100) / NumBatches, Done, NumBatches);
+		}
+	}, EParallelForFlags::Unbalanced);
+
+	const double WriteStartTime = FPlatformTime::Seconds();
+
+	const bool bFileWritten = Job.Write();
+	Job.ReportWritten(bFileWritten);
+
+	const double EndTime = FPlatformTime::Seconds();
+	const double TraceTime = WriteStartTime - TraceStartTime;
+	const uint64 NumRays = Job.GetNumRays();
+
+	UE_LOG(LogSDCollisionVis, Display, TEXT("Offline render finished in %.2fs"), EndTime - StartTime);
+	UE_LOG(LogSDCollisionVis, Display, TEXT("|- Setup = %.2fs"), TraceStartTime - StartTime);
+	UE_LOG(LogSDCollisionVis, Display, TEXT("|- Trace = %.2fs (%llu rays, %.2f MRays/s, %d threads)"),
+			TraceTime,
+			NumRays,
+			TraceTime > 0.0 ? (double)NumRays / TraceTime / 1000000.0 : 0.0,
+			FTaskGraphInterface::Get().GetNumWorkerThreads() + 1);
+	UE_LOG(LogSDCollisionVis, Display, TEXT("|- Write = %.2fs"), EndTime - WriteStartTime);
+
+	return bFileWritten;
+}
+
+static bool ParseVectorParam(const TCHAR* Params, const TCHAR* Match, FVector& OutValue)
+{
+	FString Value;
+	if (!FParse::Value(Params, Match, Value, /* bShouldStopOnSeparator */ false))
+	{
+		return false;
+	}
+
+	TArray<FString> Components;
+	Value.ParseIntoArray(Components, TEXT(","));
+	if (Components.Num() != 3)
+	{
+		return false;
+	}
+
+	OutValue = FVector(FCString::Atod(*Components[0]), FCString::Atod(*Components[1]), FCString::Atod(*Components[2]));
+	return true;
+}
+
+void StartHeadlessOfflineRender()
+{
+	const TCHAR* Params = FCommandLine::Get();
+	if (!FParse::Param(Params, TEXT("SDCollisionVisRender")))
+	{
+		return;
+	}
+
+	UE_LOG(LogSDCollisionVis, Display, TEXT("Headless offline render requested, waiting for the map to load"));
+
+	static FDelegateHandle PostLoadMapHandle;
+	PostLoadMapHandle = FCoreUObjectDelegates::PostLoadMapWithWorld.AddLambda([](UWorld* World)
+	{
+		FCoreUObjectDelegates::PostLoadMapWithWorld.Remove(PostLoadMapHandle);
+
+		const TCHAR* Params = FCommandLine::Get();
+		if (!World)
+		{
+			UE_LOG(LogSDCollisionVis, Error, TEXT("Headless offline render failed, no map was loaded"));
+			FPlatformMisc::RequestExitWithStatus(false, 1);
+			return;
+		}
+
+		FSDOfflineCollisionSettings Settings;
+		Settings.World = World;
+
+		ParseOfflineImageParams(Params, Settings);
+
+		FString OutputPath;			FParse::Value(Params, TEXT("output="), OutputPath);
+
+		TArray<FString> Messages;
+		Settings.RayOrigin = FVector::Zero();
+		Settings.RayRotator = FRotator::ZeroRotator;
+		FVector Rotation;
+		const bool bHasLocation = ParseVectorParam(Params, TEXT("location="), Settings.RayOrigin);
+		const bool bHasRotation = ParseVectorParam(Params, TEXT("rotation="), Rotation);
+		if (bHasRotation)
+		{
+			Settings.RayRotator = FRotator(Rotation.X, Rotation.Y, Rotation.Z);
+		}
+		if (!bHasLocation && !bHasRotation)
+		{
+			int32 PlayerControllerIndex = 0;	FParse::Value(Params, TEXT("player-controller="), PlayerControllerIndex);
+			DeriveTransformFromWorld(Settings.RayOrigin, Settings.RayRotator, World, PlayerControllerIndex, Messages);
+		}
+
+		Messages.Add(FString::Printf(TEXT("Map = %s"), *World->GetMapName()));
+		Messages.Add(FString::Printf(TEXT("Resolution = %d"), Settings.Resolution));
+		Messages.Add(FString::Printf(TEXT("bCubeMap = %d"), (int32)Settings.bCubeMap));
+		Messages.Add(FString::Printf(TEXT("bTiled = %d"), (int32)Settings.bTiled));
+		Messages.Add(FString::Printf(TEXT("Panorama = %d"), (int32)Settings.Panorama));
+		Messages.Add(FString::Printf(TEXT("Location = %s"), *Settings.RayOrigin.ToString()));
+		Messages.Add(FString::Printf(TEXT("Rotation = %s"), *Settings.RayRotator.ToString()));
+		for (const FString& Message : Messages)
+		{
+			// Falling back to the origin etc. should stand out in a build machine's log.
+			if (Message.Contains(TEXT("ERR:")))
+			{
+				UE_LOG(LogSDCollisionVis, Warning, TEXT("%s"), *Message);
+			}
+			else
+			{
+				UE_LOG(LogSDCollisionVis, Display, TEXT("%s"), *Message);
+			}
+		}
+
+		const bool bFileWritten = RenderOfflineCollisionBlocking(Settings, OutputPath);
+		FPlatformMisc::RequestExitWithStatus(false, bFileWritten ? 0 : 1);
+	});
+}
+
+
+// Traces the same view once with rays going out in scanlines, and once in Morton order, to see what keeping
+// neighbouring rays together buys us.
+// Hardware cache counters aren't something we can get at from here, so alongside rays/s this reports how often one
+// ray lands on the same element as the ray before it, as a stand in for how much each ray reuses of the last one's walk.
+static void BenchmarkDispatchOrder(const FSDOfflineCollisionSettings& Settings, int32 NumIterations)
+{
+	const FViewMatrices ViewMatrices = CreateViewMatrices(Settings.RayOrigin, Settings.RayRotator, Settings.Resolution, FMatrix::Identity);
+
+	FRenderBuffer Buffer;
+	Buffer.Init({ Settings.Resolution, Settings.Resolution }, ERenderBufferContents::Hits);
+	FPerspectiveRenderer PerspectiveRenderer(Settings.World, Buffer, Settings, Settings.RayOrigin, ViewMatrices);
+	if (Settings.TraceEngine == ETraceEngine::Snapshot)
+	{
+		PerspectiveRenderer.Snapshot = FCollisionSnapshot::Gather(Settings.World, Settings);
+		PerspectiveRenderer.Snapshot->Build();
+	}
+
+	FMortonOrder MortonOrder;
+	MortonOrder.Init(Buffer.Dimensions);
+
+	auto Run = [&](const TCHAR* Name, bool bMorton)
+	{
+		const int64 NumOffsets = bMorton ? MortonOrder.Num() : (int64)Settings.Resolution * Settings.Resolution;
+		auto GetPixel = [&](int64 Offset)
+		{
+			return bMorton ? MortonOrder.GetCell(Offset) : FIntPoint((int32)(Offset % Settings.Resolution), (int32)(Offset / Settings.Resolution));
+		};
+
+		double BestSeconds = TNumericLimits<double>::Max();
+		for (int32 Iteration = 0; Iteration < NumIterations; ++Iteration)
+		{
+			const double StartTime = FPlatformTime::Seconds();
+			FKernelExecutor{ .VisType = Settings.VisType }.Dispatch<	TKernelDispatchParameters<>,
+																		EKD_VisType>([&](auto DispatchParameters)
+			{
+				const static EVisualisationType VisType = decltype(DispatchParameters)::VisType;
+
+				const int32 NumBatches = (int32)FMath::DivideAndRoundUp(NumOffsets, (int64)GMaxTraceBatchSize);
+				FTraceWorkerPool::Get().ParallelFor(NumBatches, [&](int32 BatchIndex)
+				{
+					TTraceBatchArray<FIntPoint> PixelPositions;
+					const int64 BatchEnd = FMath::Min((int64)(BatchIndex + 1) * GMaxTraceBatchSize, NumOffsets);
+					for (int64 Offset = (int64)BatchIndex * GMaxTraceBatchSize; Offset < BatchEnd; ++Offset)
+					{
+						PixelPositions.Add(GetPixel(Offset));
+					}
+					PerspectiveRenderer.RenderPerspectivePixels<VisType>(PixelPositions);
+				});
+			});
+			BestSeconds = FMath::Min(BestSeconds, FPlatformTime::Seconds() - StartTime);
+		}
+
+		// Misses all count as the same element.
+		int64 NumPairs = 0;
+		int64 NumSameElement = 0;
+		const FPackedHitRecord* Previous = nullptr;
+		for (int64 Offset = 0; Offset < NumOffsets; ++Offset)
+		{
+			const FIntPoint PixelPos = GetPixel(Offset);
+			if (PixelPos.X >= Buffer.Dimensions.X || PixelPos.Y >= Buffer.Dimensions.Y)
+			{
+				continue;
+			}
+
+			const FPackedHitRecord& Hit = Buffer.HitData[PixelPos.Y * Buffer.Dimensions.X + PixelPos.X];
+			if (Previous)
+			{
+				const bool bHit = Hit.Distance >= 0.0f;
+				const bool bPreviousHit = Previous->Distance >= 0.0f;
+				++NumPairs;
+				if (bHit == bPreviousHit && (!bHit || (Hit.ElementIndex == Previous->ElementIndex && Hit.MaterialId == Previous->MaterialId)))
+				{
+					++NumSameElement;
+				}
+			}
+			Previous = &Hit;
+		}
+
+		const double NumRays = (double)Settings.Resolution * (double)Settings.Resolution;
+		LogInfoMessageKey(	INDEX_NONE,
+							FString::Printf(TEXT("%-8s : %8.3f ms, %6.2f MRays/s, %5.1f%% of rays hit the same element as the ray before"),
+											Name,
+											BestSeconds * 1000.0,
+											NumRays / BestSeconds / 1000000.0,
+											NumPairs > 0 ? (100.0 * NumSameElement) / NumPairs : 0.0),
+							15.0f);
+	};
+
+	LogInfoMessageKey(	INDEX_NONE,
+						FString::Printf(TEXT("Dispatch order benchmark, %dx%d, best of %d, %s"),
+										Settings.Resolution,
+										Settings.Resolution,
+										NumIterations,
+										Settings.TraceEngine == ETraceEngine::Snapshot ? TEXT("Snapshot") : TEXT("Scene Queries")),
+						15.0f);
+	Run(TEXT("Scanline"), false);
+	Run(TEXT("Morton"), true);
+}
+
+static FAutoConsoleCommandWithWorldAndArgs ConsoleCommandBenchmarkDispatchOrder(
+	TEXT("r.SDCollisionVis.Benchmark.DispatchOrder()"),
+	TEXT("Trace the view in scanline and then Morton order, and compare how fast each went (blocks the game thread)")
+	TEXT("Args:\n")
+	TEXT("    -resolution         : Resolution to use. (Default: 1024)\n")
+	TEXT("    -iterations         : Number of times to trace each, the fastest is reported. (Default: 4)\n")
+	TEXT("    -player-controller  : Player controller for fetching transform info. (Default: 0)\n")
+	,
+	FConsoleCommandWithWorldAndArgsDelegate::CreateLambda([](const TArray<FString>& Args, UWorld* World)
+	{
+		check(World);
+
+		FSDOfflineCollisionSettings Settings;
+		Settings.World = World;
+
+		FString Params = FString::Join(Args, TEXT(" "));
+		Settings.Resolution = 1024;         FParse::Value(*Params, TEXT("resolution="), Settings.Resolution);
+		int32 NumIterations = 4;            FParse::Value(*Params, TEXT("iterations="), NumIterations);
+		int32 PlayerControllerIndex = 0;    FParse::Value(*Params, TEXT("player-controller="), PlayerControllerIndex);
+
+		Settings.Resolution = FMath::Clamp(Settings.Resolution, 32, 8192);
+		NumIterations = FMath::Clamp(NumIterations, 1, 64);
+
+		TArray<FString> Messages;
+		Settings.RayOrigin = FVector::Zero();
+		Settings.RayRotator = FRotator::ZeroRotator;
+		DeriveTransformFromWorld(Settings.RayOrigin, Settings.RayRotator, World, PlayerControllerIndex, Messages);
+		for (const FString& Message : Messages)
+		{
+			LogInfoMessageKey(INDEX_NONE, Message, 7.0f);
+		}
+
+		BenchmarkDispatchOrder(Settings, NumIterations);
+	}));
+
+
+// Plays each sampling pattern back over a single full resolution trace of the view, to see how they'd fill in a tile.
+// Reports how many samples it takes every pixel of a tile to have been visited, and how many pixels would show the wrong
+// primitive after each power of two samples, if every pixel showed whichever sample in its tile was nearest.
+static void BenchmarkSamplingPatterns(const FSDOfflineCollisionSettings& Settings)
+{
+	const FViewMatrices ViewMatrices = CreateViewMatrices(Settings.RayOrigin, Settings.RayRotator, Settings.Resolution, FMatrix::Identity);
+
+	FRenderBuffer Reference;
+	Reference.Init({ Settings.Resolution, Settings.Resolution }, ERenderBufferContents::Hits);
+	FPerspectiveRenderer PerspectiveRenderer(Settings.World, Reference, Settings, Settings.RayOrigin, ViewMatrices);
+	if (Settings.TraceEngine == ETraceEngine::Snapshot)
+	{
+		PerspectiveRenderer.Snapshot = FCollisionSnapshot::Gather(Settings.World, Settings);
+		PerspectiveRenderer.Snapshot->Build();
+	}
+
+	FKernelExecutor{ .VisType = Settings.VisType }.Dispatch<	TKernelDispatchParameters<>,
+																EKD_VisType>([&](auto DispatchParameters)
+	{
+		const static EVisualisationType VisType = decltype(DispatchParameters)::VisType;
+		FTraceWorkerPool::Get().ParallelFor(Settings.Resolution, [&](int32 Row)
+		{
+			TArray<FIntPoint> PixelPositions;
+			PixelPositions.Reserve(Settings.Resolution);
+			for (int32 X = 0; X < Settings.Resolution; ++X)
+			{
+				PixelPositions.Add(FIntPoint(X, Row));
+			}
+			PerspectiveRenderer.RenderPerspectivePixels<VisType>(PixelPositions);
+		});
+	});
+
+	// Misses all count as the same primitive.
+	auto IsSamePrimitive = [](const FPackedHitRecord& A, const FPackedHitRecord& B)
+	{
+		const bool bHit = A.Distance >= 0.0f;
+		return bHit == (B.Distance >= 0.0f) && (!bHit || A.ElementIndex == B.ElementIndex);
+	};
+
+	// Partial tiles along the edges are left out, so every tile has the same number of pixels to cover.
+	const int32 TileSize = (int32)Settings.TileSize;
+	const int32 NumTilePixels = TileSize * TileSize;
+	const int32 NumTilesPerSide = Settings.Resolution / TileSize;
+	const int32 MaxSamples = 4 * NumTilePixels;		//< R2 doesn't promise to ever cover a tile, so give up at some point
+
+	TArray<int32> Checkpoints;
+	for (int32 NumSamples = 1; NumSamples < NumTilePixels; NumSamples *= 2)
+	{
+		Checkpoints.Add(NumSamples);
+	}
+	Checkpoints.Add(NumTilePixels);
+
+	auto Run = [&](const TCHAR* Name, ESamplingPattern SamplingPattern)
+	{
+		// Per row of tiles, summed up afterwards
+		TArray<int64> RowWrongPixels;
+		RowWrongPixels.SetNumZeroed(NumTilesPerSide * Checkpoints.Num());
+		TArray<int64> RowSamplesToCover;
+		RowSamplesToCover.SetNumZeroed(NumTilesPerSide);
+		TArray<int32> RowMaxSamplesToCover;
+		RowMaxSamplesToCover.SetNumZeroed(NumTilesPerSide);
+		TArray<int32> RowNumUncovered;
+		RowNumUncovered.SetNumZeroed(NumTilesPerSide);
+
+		FKernelExecutor{ .SamplingPattern = SamplingPattern }.Dispatch<	TKernelDispatchParameters<>,
+																		EKD_SamplingPattern>([&](auto DispatchParameters)
+		{
+			const static ESamplingPattern Pattern = decltype(DispatchParameters)::SamplingPattern;
+			FTraceWorkerPool::Get().ParallelFor(NumTilesPerSide, [&](int32 TileY)
+			{
+				TArray<int32> Visited;			//< Tile pixels visited so far, in order
+				TArray<uint8> IsVisited;
+				TArray<int32> NearestSample;	//< Tile pixel each tile pixel is filled from
+				TArray<int32> Frontier;
+				TArray<int32> NextFrontier;
+				for (int32 TileX = 0; TileX < NumTilesPerSide; ++TileX)
+				{
+					const FIntPoint TileStart(TileX * TileSize, TileY * TileSize);
+					auto GetReference = [&](int32 Local) -> const FPackedHitRecord&
+					{
+						return Reference.HitData[(TileStart.Y + Local / TileSize) * Settings.Resolution + TileStart.X + Local % TileSize];
+					};
+
+					Visited.Reset();
+					IsVisited.Init(0, NumTilePixels);
+					int32 SamplesToCover = INDEX_NONE;
+					int32 NextCheckpoint = 0;
+					for (int32 Sample = 0; Sample < MaxSamples && (SamplesToCover == INDEX_NONE || NextCheckpoint < Checkpoints.Num()); ++Sample)
+					{
+						const FIntPoint PixelPos = NextTileSamplePosition<Pattern>(TileStart, Settings.TileSize, MakeSampleFrameId(Pattern, Settings.TileSize, (uint64)Sample));
+						const int32 Local = (PixelPos.Y - TileStart.Y) * TileSize + (PixelPos.X - TileStart.X);
+						if (IsVisited[Local] == 0)
+						{
+							IsVisited[Local] = 1;
+							Visited.Add(Local);
+						}
+						if (SamplesToCover == INDEX_NONE && Visited.Num() == NumTilePixels)
+						{
+							SamplesToCover = Sample + 1;
+						}
+
+						if (NextCheckpoint >= Checkpoints.Num() || Sample + 1 != Checkpoints[NextCheckpoint])
+						{
+							continue;
+						}
+
+						// Flood out from every sample at once, so each pixel ends up with (roughly) the nearest.
+						NearestSample.Init(INDEX_NONE, NumTilePixels);
+						Frontier.Reset();
+						for (int32 VisitedPixel : Visited)
+						{
+							NearestSample[VisitedPixel] = VisitedPixel;
+							Frontier.Add(VisitedPixel);
+						}
+						while (!Frontier.IsEmpty())
+						{
+							NextFrontier.Reset();
+							for (int32 Pixel : Frontier)
+							{
+								const int32 X = Pixel % TileSize;
+								const int32 Y = Pixel / TileSize;
+								const int32 Neighbours[4] = {	X > 0 ? Pixel - 1 : INDEX_NONE,
+																X < TileSize - 1 ? Pixel + 1 : INDEX_NONE,
+																Y > 0 ? Pixel - TileSize : INDEX_NONE,
+																Y < TileSize - 1 ? Pixel + TileSize : INDEX_NONE };
+								for (int32 Neighbour : Neighbours)
+								{
+									if (Neighbour != INDEX_NONE && NearestSample[Neighbour] == INDEX_NONE)
+									{
+										NearestSample[Neighbour] = NearestSample[Pixel];
+										NextFrontier.Add(Neighbour);
+									}
+								}
+							}
+							Swap(Frontier, NextFrontier);
+						}
+
+						int64 NumWrong = 0;
+						for (int32 Pixel = 0; Pixel < NumTilePixels; ++Pixel)
+						{
+							NumWrong += IsSamePrimitive(GetReference(Pixel), GetReference(NearestSample[Pixel])) ? 0 : 1;
+						}
+						RowWrongPixels[TileY * Checkpoints.Num() + NextCheckpoint] += NumWrong;
+						++NextCheckpoint;
+					}
+
+					if (SamplesToCover == INDEX_NONE)
+					{
+						++RowNumUncovered[TileY];
+					}
+					else
+					{
+						RowSamplesToCover[TileY] += SamplesToCover;
+						RowMaxSamplesToCover[TileY] = FMath::Max(RowMaxSamplesToCover[TileY], SamplesToCover);
+					}
+				}
+			});
+		});
+
+		int64 SamplesToCover = 0;
+		int32 MaxSamplesToCover = 0;
+		int32 NumUncovered = 0;
+		for (int32 TileY = 0; TileY < NumTilesPerSide; ++TileY)
+		{
+			SamplesToCover += RowSamplesToCover[TileY];
+			MaxSamplesToCover = FMath::Max(MaxSamplesToCover, RowMaxSamplesToCover[TileY]);
+			NumUncovered += RowNumUncovered[TileY];
+		}
+
+		const int32 NumTiles = NumTilesPerSide * NumTilesPerSide;
+		const int32 NumCovered = NumTiles - NumUncovered;
+		FString Coverage = FString::Printf(TEXT("covers a tile in %6.1f samples on average, %5d at most"),
+											NumCovered > 0 ? (double)SamplesToCover / NumCovered : 0.0,
+											MaxSamplesToCover);
+		if (NumUncovered > 0)
+		{
+			Coverage += FString::Printf(TEXT(" (%d of %d tiles still not covered after %d)"), NumUncovered, NumTiles, MaxSamples);
+		}
+
+		FString Error;
+		for (int32 Checkpoint = 0; Checkpoint < Checkpoints.Num(); ++Checkpoint)
+		{
+			int64 NumWrong = 0;
+			for (int32 TileY = 0; TileY < NumTilesPerSide; ++TileY)
+			{
+				NumWrong += RowWrongPixels[TileY * Checkpoints.Num() + Checkpoint];
+			}
+			Error += FString::Printf(TEXT(" %d:%.2f%%"), Checkpoints[Checkpoint], (100.0 * NumWrong) / ((double)NumTiles * NumTilePixels));
+		}
+
+		LogInfoMessageKey(INDEX_NONE, FString::Printf(TEXT("%-8s : %s"), Name, *Coverage), 15.0f);
+		LogInfoMessageKey(INDEX_NONE, FString::Printf(TEXT("%-8s : wrong primitive after (samples:pixels)%s"), Name, *Error), 15.0f);
+	};
+
+	LogInfoMessageKey(	INDEX_NONE,
+						FString::Printf(TEXT("Sampling pattern benchmark, %dx%d, TileSize %d, %s"),
+										Settings.Resolution,
+										Settings.Resolution,
+										TileSize,
+										Settings.TraceEngine == ETraceEngine::Snapshot ? TEXT("Snapshot") : TEXT("Scene Queries")),
+						15.0f);
+	Run(TEXT("Linear"), ESamplingPattern::Linear);
+	Run(TEXT("R2"), ESamplingPattern::R2);
+	Run(TEXT("Sobol"), ESamplingPattern::Sobol);
+}
+
+static FAutoConsoleCommandWithWorldAndArgs ConsoleCommandBenchmarkSamplingPatterns(
+	TEXT("r.SDCollisionVis.Benchmark.SamplingPatterns()"),
+	TEXT("Trace the view once, then compare how well each sampling pattern would have filled in the tiles (blocks the game thread)")
+	TEXT("Args:\n")
+	TEXT("    -resolution         : Resolution to use. (Default: 512)\n")
+	TEXT("    -tile-size          : Tile size to use. (Default: r.SDCollisionVis.Settings.TileSize)\n")
+	TEXT("    -player-controller  : Player controller for fetching transform info. (Default: 0)\n")
+	,
+	FConsoleCommandWithWorldAndArgsDelegate::CreateLambda([](const TArray<FString>& Args, UWorld* World)
+	{
+		check(World);
+
+		FSDOfflineCollisionSettings Settings;
+		Settings.World = World;
+
+		FString Params = FString::Join(Args, TEXT(" "));
+		Settings.Resolution = 512;          FParse::Value(*Params, TEXT("resolution="), Settings.Resolution);
+		int32 TileSize = Settings.TileSize; FParse::Value(*Params, TEXT("tile-size="), TileSize);
+		int32 PlayerControllerIndex = 0;    FParse::Value(*Params, TEXT("player-controller="), PlayerControllerIndex);
+
+		Settings.TileSize = (uint32)FMath::Clamp(TileSize, 2, 128);
+		Settings.Resolution = FMath::Clamp(Settings.Resolution, (int32)Settings.TileSize, 8192);
+
+		TArray<FString> Messages;
+		Settings.RayOrigin = FVector::Zero();
+		Settings.RayRotator = FRotator::ZeroRotator;
+		DeriveTransformFromWorld(Settings.RayOrigin, Settings.RayRotator, World, PlayerControllerIndex, Messages);
+		for (const FString& Message : Messages)
+		{
+			LogInfoMessageKey(INDEX_NONE, Message, 7.0f);
+		}
+
+		BenchmarkSamplingPatterns(Settings);
+	}));
+
 } // namespace SDCollisionVis
 
 #undef LOCTEXT_NAMESPACE 
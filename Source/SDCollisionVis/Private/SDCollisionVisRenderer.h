@@ -8,58 +8,230 @@
 #include <SceneView.h>
 #include <SceneViewExtension.h>
 #include <RenderGraph.h>
+#include <RendererInterface.h>
 #include <Async/TaskGraphInterfaces.h>
+#include <HAL/IConsoleManager.h>
+#include <Misc/Optional.h>
+#include <Containers/CircularQueue.h>
+#include <Containers/StaticArray.h>
 #include <PostProcess/PostProcessing.h>
 #include <PostProcess/PostProcessMaterial.h>
 
+#include <atomic>
+
 #include "SDCollisionVisSettings.h"
+#include "SDCollisionVisTrace.h"
+#include "SDCollisionVisBVH.h"
 
 
 namespace SDCollisionVis
 {
 
-struct FRenderBuffer
+enum class ERenderBufferContents : uint8
+{
+	Colours,	//< Coloured on the CPU (offline renders)
+	Hits,		//< Coloured by the GPU when presenting (realtime)
+	LayeredHits	//< As Hits, with static and dynamic collision traced separately (see FRenderBuffer::StaticHitData)
+};
+
+// Which layers of a layered FRenderBuffer a trace should update.
+enum class ETraceLayers : uint8
 {
-	FIntPoint       Dimensions;
-	TArray<FColor>  PixelData;
-	void Init(FIntPoint InDimensions)
+	Static  = 1 << 0,
+	Dynamic = 1 << 1,
+	Both    = Static | Dynamic
+};
+ENUM_CLASS_FLAGS(ETraceLayers);
+
+// Order to visit the cells (pixels, or tiles) of a grid in, so that ones visited one after the other are close together
+// on screen, and so likely to be walking the same parts of the scene.
+// The grid is cut into blocks of BlockSize x BlockSize cells, with both the blocks and the cells within them in Z-order (Morton order).
+struct FMortonOrder
+{
+	static constexpr int32 BlockSize = 16;
+	static constexpr int32 CellsPerBlock = BlockSize * BlockSize;
+
+	FIntPoint         GridSize = FIntPoint::ZeroValue;
+	TArray<FIntPoint> Blocks;	//< First cell of each block, in Morton order
+
+	void Init(FIntPoint InGridSize);
+
+	// Number of cells in all the blocks, which will be more than the grid has if it isn't a multiple of BlockSize.
+	int64 Num() const { return (int64)Blocks.Num() * CellsPerBlock; }
+
+	// Cells of blocks hanging off the edge of the grid can be outside of it, and should be skipped.
+	FIntPoint GetCell(int64 Index) const
 	{
-		Dimensions = InDimensions;
-		PixelData.SetNumZeroed(Dimensions.X * Dimensions.Y);
+		return Blocks[(int32)(Index / CellsPerBlock)] + MortonDecode2D((uint32)(Index % CellsPerBlock));
 	}
 };
 
+// Realtime bookkeeping for a single tile, used to decide where the next rays should go.
+struct FTileState
+{
+	static constexpr int32 MissElement = INDEX_NONE - 1;	//< Stands in for ElementIndex when a ray hit nothing
 
-struct FSDCollisionVisRealtimeViewData
+	int32  NumInvalid = 0;						//< Pixels with nothing to show (see FPackedHitRecord::IsValid), traced ahead of everything else
+	int32  NumUncovered = 0;					//< Pixels which haven't been traced since the view (or scene) last changed
+	uint32 NumSamples = 0;						//< Samples taken since the view last changed
+	uint32 SampleIndex = 0;						//< How far along the sampling pattern the tile is (budgeted traces only)
+	int32  FirstElement = MissElement;			//< What the first of those samples hit
+	bool   bEdge = false;						//< Samples since the view changed haven't all hit the same thing
+
+	// Every pixel is up to date, so tracing the tile again won't change anything.
+	bool IsConverged() const
+	{
+		return NumUncovered <= 0;
+	}
+
+	void RecordSample(const FPackedHitRecord& Hit)
+	{
+		const int32 Element = Hit.Distance >= 0.0f ? (int32)Hit.ElementIndex : MissElement;
+		if (NumSamples == 0)
+		{
+			FirstElement = Element;
+		}
+		else if (Element != FirstElement)
+		{
+			bEdge = true;
+		}
+		++NumSamples;
+	}
+};
+
+struct FRenderBuffer
 {
-	uint64 LastAccessed = 0;
-	TSharedPtr<FRenderBuffer> FramebufferGameThread;	//< Framebuffer held onto by the GameThread
-	TSharedPtr<FRenderBuffer> FramebufferRenderThread;	//< Framebuffer held onto by the RenderThread
+	FIntPoint                   Dimensions;
+	TArray<FColor>              PixelData;
+	TArray<FPackedHitRecord>    HitData;
+
+	// Layered hits only, HitData is then the nearest of these two (see CompositeLayers).
+	// Static collision is only traced until it's covered every pixel, so the tiles follow StaticHitData rather than HitData,
+	// while dynamic collision keeps being traced so whatever is moving stays up to date.
+	TArray<FPackedHitRecord>    StaticHitData;
+	TArray<FPackedHitRecord>    DynamicHitData;
+
+	// Hits only, the view HitData is currently relative to.
+	FVector  ViewOrigin = FVector::ZeroVector;
+	FMatrix  ViewProjectionMatrix = FMatrix::Identity;
+	double   MinDistance = 0.0;
+	bool     bHasView = false;
+
+	// Hits only, state of each tile, see ResetTiles.
+	TArray<FTileState> Tiles;
+	uint32             TilesTileSize = 0;
+	FMortonOrder       TileOrder;	//< Order tiles are handed out to the workers in
+
+	// Hits only, whether each pixel has been traced since the view (or scene) last changed, see ResetTiles.
+	// Bytes rather than bits, since neighbouring tiles are written by different workers.
+	TArray<uint8> PixelCovered;
+
+	// Hits only, index of the last trace (see FSDCollisionVisRealtimeViewData::NumTracesDispatched) which finished with every tile converged.
+	std::atomic<int64> ConvergedTrace = -1;
+
+	// Hits only, measured throughput of budgeted traces (0 until the first one), only written by the trace task.
+	std::atomic<float> RaysPerMs = 0.0f;
+	std::atomic<int32> LastNumRays = 0;
+
+	// Also forgets any view and tile state, so a pooled buffer (see FRenderBufferPool) starts over.
+	void Init(FIntPoint InDimensions, ERenderBufferContents Contents = ERenderBufferContents::Colours)
+	{
+		Dimensions = InDimensions;
+		bHasView = false;
+		Tiles.Reset();
+		TilesTileSize = 0;
+		PixelCovered.Reset();
+		ConvergedTrace = -1;
+		RaysPerMs = 0.0f;
+		LastNumRays = 0;
+		if (Contents == ERenderBufferContents::Colours)
+		{
+			PixelData.SetNumZeroed(Dimensions.X * Dimensions.Y);
+		}
+		else
+		{
+			FPackedHitRecord Invalid;
+			Invalid.Distance = FPackedHitRecord::DistanceInvalid;
+			HitData.Init(Invalid, Dimensions.X * Dimensions.Y);
+			if (Contents == ERenderBufferContents::LayeredHits)
+			{
+				StaticHitData.Init(Invalid, Dimensions.X * Dimensions.Y);
+				DynamicHitData.Init(Invalid, Dimensions.X * Dimensions.Y);
+			}
+		}
+	}
+
+	bool IsLayered() const
+	{
+		return !StaticHitData.IsEmpty();
+	}
+
+	// Hits the tiles are kept up to date with, see ResetTiles.
+	const TArray<FPackedHitRecord>& GetTileHitData() const
+	{
+		return IsLayered() ? StaticHitData : HitData;
+	}
+
+	// Whichever of a pixel's layers is nearest, a dynamic miss letting the static layer (hit, miss or hole) show through.
+	static FPackedHitRecord CompositeLayers(const FPackedHitRecord& Static, const FPackedHitRecord& Dynamic)
+	{
+		if (!Dynamic.IsValid() || Dynamic.Distance < 0.0f)
+		{
+			return Static;
+		}
+		if (Static.IsValid() && Static.Distance >= 0.0f && Static.Distance <= Dynamic.Distance)
+		{
+			return Static;
+		}
+		return Dynamic;
+	}
+
+	// Moves HitData (or each layer) over to a new view, by splatting each hit (or miss, as a direction) into it, nearest first.
+	// Anything which doesn't get covered is left invalid. Returns false if the view hasn't changed.
+	bool Reproject(const FVector& NewOrigin, const FViewMatrices& NewViewMatrices, double NewMinDistance);
+
+	// Recounts the invalid and uncovered pixels in each tile of TileSize.
+	// bResetCoverage forgets what's been traced, along with how many samples each tile has taken (e.g after the view moved).
+	// Where each tile is along the sampling pattern is kept, unless TileSize changed (which also rebuilds TileOrder).
+	void ResetTiles(uint32 TileSize, bool bResetCoverage);
+
+	// Whether every tile is converged, see FTileState::IsConverged.
+	bool AreTilesConverged() const;
+
+private:
+	void ReprojectHits(TArray<FPackedHitRecord>& Hits, const FVector& OldOrigin, double OldMinDistance, const FMatrix& NewViewProjectionMatrix);
+
+	TArray<FPackedHitRecord> ReprojectedHitData;	//< Scratch space for Reproject
+	TArray<uint64>           ReprojectedDepth;		//< Scratch space for Reproject, (depth << 32 | source pixel) of the nearest splat onto each pixel
 };
 
-// Realtime renderer, rays are dispatched on the gamethread and then joined
-// just before presenting the final image, whereby we overwrite whatever is there.
-class FSDCollisionVisRealtimeViewExtension final : public FSceneViewExtensionBase
+
+// Pixels written by a single realtime trace, so only those need to go up to the GPU.
+// Workers reserve a range per batch, so the order is arbitrary.
+struct FDirtyPixelList
 {
-public:
-	FSDCollisionVisRealtimeViewExtension(const FAutoRegister& AutoRegister)
-		: FSceneViewExtensionBase(AutoRegister)
-	{}
-	
-	struct FRenderState final : ISceneViewFamilyExtentionData
-	{
-		/** ISceneViewFamilyExtentionData implementation */
-		const static inline TCHAR* GSubclassIdentifier = TEXT("FSDCollisionVisRealtimeViewExtension::FRenderState");
-		const TCHAR* GetSubclassIdentifier() const { return GSubclassIdentifier; }
-
-		FGraphEventRef TraceTask;					//< Raytracing task which is dispatched by the GameThread, but waited on by the RenderThread.
-		TSharedPtr<FRenderBuffer>					FramebufferRenderThreadQueued;
-		TSharedPtr<FSDCollisionVisRealtimeViewData> ViewFamilyData;
-	};
+	TArray<uint32>           Indices;    //< Linear index into FRenderBuffer::HitData
+	TArray<FPackedHitRecord> Records;
+	std::atomic<int32>       Num = 0;
 
-	/** ISceneViewExtension implementation */
-	void BeginRenderViewFamily(FSceneViewFamily& InViewFamily) override;
-	void PostRenderViewFamily_RenderThread(FRDGBuilder& GraphBuilder, FSceneViewFamily& InViewFamily) override;
+	// Copy of the whole of FRenderBuffer::HitData as the trace left it, only when it needs a full upload.
+	// The next trace will already be writing into HitData by the time this one is uploaded.
+	TArray<FPackedHitRecord> FullRecords;
+
+	// Never shrinks, so once a view's traces have settled on a size, the same memory keeps being reused.
+	void Init(int32 MaxPixels)
+	{
+		Indices.SetNumUninitialized(MaxPixels, EAllowShrinking::No);
+		Records.SetNumUninitialized(MaxPixels, EAllowShrinking::No);
+		FullRecords.Reset();
+		Num = 0;
+		bFullUpload = false;
+	}
+
+	bool bFullUpload = false;	//< Every pixel changed (e.g the buffer was reprojected), so just upload the whole buffer
+
+	// Either everything changed, or more pixels were written than we had room for.
+	bool NeedsFullUpload() const { return bFullUpload || (Num.load() > Indices.Num()); }
 };
 
 
@@ -74,70 +246,537 @@ public:
 		: World(InWorld)
 		, RenderTargetSize(InRenderBuffer.Dimensions)
 		, PixelData(InRenderBuffer.PixelData)
+		, HitData(InRenderBuffer.HitData)
+		, StaticHitData(InRenderBuffer.StaticHitData)
+		, DynamicHitData(InRenderBuffer.DynamicHitData)
 		, Settings(InSettings)
+		, DynamicSettings(InSettings)
 		, Origin(InOrigin)
 		, ViewMatrices(InViewMatrices)
-		, PointToUV(FVector2D::One() / (FVector2D)RenderTargetSize)
-		, RevViewForward(-ViewMatrices.GetOverriddenTranslatedViewMatrix().GetColumn(2))
+		, ColourParams(Settings.GetColourParams(-ViewMatrices.GetOverriddenTranslatedViewMatrix().GetColumn(2)))
 	{
-		check((RenderTargetSize.X * RenderTargetSize.Y) == InRenderBuffer.PixelData.Num());
+		check(((RenderTargetSize.X * RenderTargetSize.Y) == InRenderBuffer.PixelData.Num())
+				|| ((RenderTargetSize.X * RenderTargetSize.Y) == InRenderBuffer.HitData.Num()));
+		SetImageRegion(RenderTargetSize, FIntPoint::ZeroValue);
 	}
 
 	FPerspectiveRenderer(const FPerspectiveRenderer& Other) = default;
 	FPerspectiveRenderer& operator= (const FPerspectiveRenderer& Other) = default;
 
-	template<EVisualisationType VisType>
-	void RenderPerspectivePixel(FIntPoint PixelPos) const
+	FORCEINLINE FTraceRay GenerateRay(FIntPoint PixelPos) const
 	{
-		if (PixelPos.X < RenderTargetSize.X && PixelPos.Y < RenderTargetSize.Y)
+		FVector TraceNormal;
+		if (Panorama != EPanoramaProjection::None)
 		{
-			FVector2D UV = PointToUV * ((FVector2D)PixelPos + 0.5);
-			FVector2D NDC  = UV * FVector2D(2.0, -2.0) + FVector2D(-1.0, 1.0);
-			FVector4 Screen = FVector4(NDC.X, NDC.Y, 0.5, 1.0);
-
-			FVector4 WorldPointHomogenous = ViewMatrices.GetInvViewProjectionMatrix().TransformFVector4(Screen);
+			TraceNormal = GeneratePanoramaDirection(PixelPos);
+		}
+		else
+		{
+			// Screen position is linear in the pixel position, so the homogenous world position is too, leaving just the divide.
+			FVector4 WorldPointHomogenous = RayStart + RayStepX * (double)PixelPos.X + RayStepY * (double)PixelPos.Y;
 			FVector TraceWorldPos (	WorldPointHomogenous.X / WorldPointHomogenous.W,
 									WorldPointHomogenous.Y / WorldPointHomogenous.W,
 									WorldPointHomogenous.Z / WorldPointHomogenous.W);
-			FVector TraceNormal = (TraceWorldPos - Origin).GetUnsafeNormal();
+			TraceNormal = (TraceWorldPos - Origin).GetUnsafeNormal();
+		}
+
+		return FTraceRay{ Origin + TraceNormal * Settings.MinDistance, TraceNormal };
+	}
+
+	// Traces the part of a larger ImageSize image starting at Offset, rather than the whole view, into the render target.
+	// e.g to render an image too big to keep in memory a piece at a time.
+	void SetImageRegion(FIntPoint ImageSize, FIntPoint Offset)
+	{
+		PointToUV = FVector2D::One() / (FVector2D)ImageSize;
+		PixelOffset = Offset;
+
+		// Screen position of the centre of pixel 0, and how far it moves per pixel, taken through to (homogenous) world space.
+		const FMatrix& InvViewProjectionMatrix = ViewMatrices.GetInvViewProjectionMatrix();
+		const FVector2D UV = PointToUV * ((FVector2D)PixelOffset + 0.5);
+		RayStart = InvViewProjectionMatrix.TransformFVector4(FVector4(UV.X * 2.0 - 1.0, 1.0 - UV.Y * 2.0, 0.5, 1.0));
+		RayStepX = InvViewProjectionMatrix.TransformFVector4(FVector4(PointToUV.X * 2.0, 0.0, 0.0, 0.0));
+		RayStepY = InvViewProjectionMatrix.TransformFVector4(FVector4(0.0, PointToUV.Y * -2.0, 0.0, 0.0));
+	}
+
+	// Traces the whole sphere around Origin instead, facing Rotation, with the view matrices only used for colouring.
+	void SetPanorama(EPanoramaProjection InPanorama, const FRotator& Rotation)
+	{
+		Panorama = InPanorama;
+		PanoramaBasis = FRotationMatrix(Rotation);
+	}
+
+	FVector GeneratePanoramaDirection(FIntPoint PixelPos) const
+	{
+		const FVector2D UV = PointToUV * ((FVector2D)(PixelPos + PixelOffset) + 0.5);
+
+		// Local space is forward X, right Y, up Z, with the centre of the image straight ahead.
+		FVector Local;
+		if (Panorama == EPanoramaProjection::Equirectangular)
+		{
+			const double Longitude = (UV.X - 0.5) * UE_DOUBLE_TWO_PI;
+			const double Latitude = (0.5 - UV.Y) * UE_DOUBLE_PI;
+			Local = FVector(FMath::Cos(Latitude) * FMath::Cos(Longitude), FMath::Cos(Latitude) * FMath::Sin(Longitude), FMath::Sin(Latitude));
+		}
+		else
+		{
+			// Clarberg's equal-area octahedral mapping, so every pixel covers the same solid angle
+			// (a plain octahedral unfold varies by as much as a cube face does).
+			// Forward is the centre of the square, with the back folded out into the corners.
+			const FVector2D P = UV * 2.0 - 1.0;
+			const double SignedDistance = 1.0 - (FMath::Abs(P.X) + FMath::Abs(P.Y));	//< From the diagonals, positive in front
+			const double R = 1.0 - FMath::Abs(SignedDistance);
+			const double Phi = (R == 0.0 ? 1.0 : (FMath::Abs(P.Y) - FMath::Abs(P.X)) / R + 1.0) * UE_DOUBLE_PI / 4.0;
+			const double Forward = FMath::Sign(SignedDistance) * (1.0 - FMath::Square(R));
+			const double Radial = R * FMath::Sqrt(FMath::Max(2.0 - FMath::Square(R), 0.0));
+			const double Right = FMath::Abs(FMath::Cos(Phi)) * (P.X < 0.0 ? -1.0 : 1.0) * Radial;
+			const double Down = FMath::Abs(FMath::Sin(Phi)) * (P.Y < 0.0 ? -1.0 : 1.0) * Radial;
+			Local = FVector(Forward, Right, -Down);
+		}
+
+		return PanoramaBasis.TransformVector(Local).GetUnsafeNormal();
+	}
+
+	bool IsLayered() const
+	{
+		return !DynamicHitData.IsEmpty();
+	}
+
+	// Hits the tiles follow, see FRenderBuffer::GetTileHitData.
+	TArrayView<FPackedHitRecord> GetTileHitData() const
+	{
+		return IsLayered() ? StaticHitData : HitData;
+	}
+
+	// Traces a batch of pixels through a single TraceRayBatch call (per layer, when layered).
+	// Any pixels outside of the render target are skipped.
+	template<EVisualisationType VisType>
+	void RenderPerspectivePixels(TArrayView<const FIntPoint> PixelPositions, ETraceLayers Layers = ETraceLayers::Both) const
+	{
+		for (int32 BatchStart = 0; BatchStart < PixelPositions.Num(); BatchStart += GMaxTraceBatchSize)
+		{
+			const int32 BatchEnd = FMath::Min(BatchStart + GMaxTraceBatchSize, PixelPositions.Num());
+
+			TTraceBatchArray<FTraceRay> Rays;
+			TTraceBatchArray<int32> PixelIndices;
+			for (int32 i = BatchStart; i < BatchEnd; ++i)
+			{
+				const FIntPoint PixelPos = PixelPositions[i];
+				if (PixelPos.X < RenderTargetSize.X && PixelPos.Y < RenderTargetSize.Y)
+				{
+					Rays.Add(GenerateRay(PixelPos));
+					PixelIndices.Add(PixelPos.Y * RenderTargetSize.X + PixelPos.X);
+				}
+			}
+
+			TTraceBatchArray<FHitRecord> Hits;
+			Hits.SetNumUninitialized(Rays.Num());
+			auto TraceBatch = [&](const FSDCollisionSettings& BatchSettings)
+			{
+				if (Snapshot)
+				{
+					Snapshot->TraceRayBatch<VisType>(BatchSettings, Rays, Hits);
+				}
+				else
+				{
+					TraceRayBatch<VisType>(World, BatchSettings, Rays, Hits);
+				}
+			};
+
+			if (IsLayered())
+			{
+				// Both layers trace the same pixels, so each one is only composited (and goes in the dirty list) once.
+				auto TraceLayer = [&](const FSDCollisionSettings& LayerSettings, TArrayView<FPackedHitRecord> LayerHitData)
+				{
+					TraceBatch(LayerSettings);
+					for (int32 i = 0; i < Rays.Num(); ++i)
+					{
+						LayerHitData[PixelIndices[i]] = FPackedHitRecord::Pack(Hits[i], Rays[i].Direction);
+					}
+				};
+
+				if (EnumHasAnyFlags(Layers, ETraceLayers::Static))
+				{
+					TraceLayer(Settings, StaticHitData);
+				}
+				if (EnumHasAnyFlags(Layers, ETraceLayers::Dynamic))
+				{
+					TraceLayer(DynamicSettings, DynamicHitData);
+				}
+				for (int32 PixelIndex : PixelIndices)
+				{
+					HitData[PixelIndex] = FRenderBuffer::CompositeLayers(StaticHitData[PixelIndex], DynamicHitData[PixelIndex]);
+				}
+			}
+			else
+			{
+				TraceBatch(Settings);
+
+				if (!PixelData.IsEmpty())
+				{
+					for (int32 i = 0; i < Rays.Num(); ++i)
+					{
+						PixelData[PixelIndices[i]] = CalculateVisualisationColour<VisType>(Hits[i], Rays[i].Direction, ColourParams);
+					}
+				}
+
+				if (!HitData.IsEmpty())
+				{
+					for (int32 i = 0; i < Rays.Num(); ++i)
+					{
+						HitData[PixelIndices[i]] = FPackedHitRecord::Pack(Hits[i], Rays[i].Direction);
+					}
+				}
+			}
+
+			if (DirtyPixels)
+			{
+				const int32 First = DirtyPixels->Num.fetch_add(Rays.Num());
+				if (First + Rays.Num() <= DirtyPixels->Indices.Num())
+				{
+					for (int32 i = 0; i < Rays.Num(); ++i)
+					{
+						DirtyPixels->Indices[First + i] = (uint32)PixelIndices[i];
+						DirtyPixels->Records[First + i] = HitData[PixelIndices[i]];
+					}
+				}
+			}
+		}
+	}
+
+	template<EVisualisationType VisType>
+	void RenderPerspectivePixel(FIntPoint PixelPos) const
+	{
+		RenderPerspectivePixels<VisType>(MakeArrayView(&PixelPos, 1));
+	}
+
+	// Swaps SamplePos for a pixel in the same tile which needs it more, so holes get filled first, and once a tile has
+	// been through a whole pattern's worth of samples, whatever the pattern missed gets picked up.
+	// Tiles are only ever touched by the worker doing their block, so no need to be atomic about the counts.
+	FIntPoint PrioritisePixel(FIntPoint TileStart, FIntPoint SamplePos) const
+	{
+		const int32 TileSize = (int32)Settings.TileSize;
+		FTileState& Tile = GetTile(TileStart);
+
+		// Edge tiles may be cut short
+		const int32 Width = FMath::Min(TileSize, RenderTargetSize.X - TileStart.X);
+		const int32 Height = FMath::Min(TileSize, RenderTargetSize.Y - TileStart.Y);
+		const int32 NumTilePixels = Width * Height;
+
+		// Start from the sample position, so which pixel gets picked still follows the pattern
+		auto FindPixel = [&](auto Predicate, FIntPoint& OutPixelPos)
+		{
+			const int32 First = FMath::Min(SamplePos.Y - TileStart.Y, Height - 1) * Width + FMath::Min(SamplePos.X - TileStart.X, Width - 1);
+			for (int32 i = 0; i < NumTilePixels; ++i)
+			{
+				const int32 Local = (First + i) % NumTilePixels;
+				OutPixelPos = FIntPoint(TileStart.X + Local % Width, TileStart.Y + Local / Width);
+				if (Predicate(OutPixelPos.Y * RenderTargetSize.X + OutPixelPos.X))
+				{
+					return true;
+				}
+			}
+			return false;
+		};
+
+		FIntPoint PixelPos;
+		if (Tile.NumInvalid > 0)
+		{
+			const TArrayView<FPackedHitRecord> TileHitData = GetTileHitData();
+			bool bPending = false;
+			const bool bFound = Settings.bProgressive
+								? FindProgressivePixel(TileStart, FIntPoint(Width, Height), Tile, PixelPos, bPending)
+								: FindPixel([&](int32 PixelIndex) { return !TileHitData[PixelIndex].IsValid(); }, PixelPos);
+			if (bFound)
+			{
+				// Claim it, so a budgeted trace taking more than one sample from the tile doesn't pick it again before it's traced.
+				TileHitData[PixelPos.Y * RenderTargetSize.X + PixelPos.X].Distance = FPackedHitRecord::DistanceClaimed;
+				--Tile.NumInvalid;
+				return PixelPos;
+			}
+			if (!bPending)
+			{
+				Tile.NumInvalid = 0;
+			}
+		}
+
+		if (Tile.NumUncovered > 0 && Tile.NumSamples >= (uint32)(TileSize * TileSize) && !PixelCovered.IsEmpty())
+		{
+			if (FindPixel([&](int32 PixelIndex) { return PixelCovered[PixelIndex] == 0; }, PixelPos))
+			{
+				// Counted straight away for the same reason as above.
+				MarkCovered(Tile, PixelPos.Y * RenderTargetSize.X + PixelPos.X);
+				return PixelPos;
+			}
+			Tile.NumUncovered = 0;
+		}
+
+		return SamplePos;
+	}
+
+	// Whether two traced samples look to be on the same surface, so whatever's between them can be upsampled rather than traced.
+	static bool SamplesAgree(const FPackedHitRecord& A, const FPackedHitRecord& B)
+	{
+		const bool bHit = A.Distance >= 0.0f;
+		if (bHit != (B.Distance >= 0.0f))
+		{
+			return false;
+		}
+		if (!bHit)
+		{
+			return true;
+		}
+		if (A.ElementIndex != B.ElementIndex || A.MaterialId != B.MaterialId)
+		{
+			return false;
+		}
+		if ((UnpackOctNormal(A.Normal) | UnpackOctNormal(B.Normal)) < ProgressiveMinNormalDot)
+		{
+			return false;
+		}
+		return FMath::Abs(A.Distance - B.Distance) <= ProgressiveMaxDepthRatio * FMath::Max(A.Distance, B.Distance);
+	}
+
+	enum class ESampleAgreement : uint8
+	{
+		Agree,
+		Disagree,
+		Pending		//< Something it depends on hasn't been traced yet
+	};
 
-			FHitResult HitResult;
+	// Compares the samples on the corners of the ParentStride sized cell PixelPos is in.
+	// Corners left to the upsample are skipped, they're inside a cell which already agreed.
+	// Corners may be in a neighbouring tile, being written by another worker, at worst that traces a pixel which didn't need it.
+	ESampleAgreement CompareParentSamples(FIntPoint PixelPos, int32 ParentStride) const
+	{
+		const TArrayView<FPackedHitRecord> TileHitData = GetTileHitData();
+		const FIntPoint Cell = (PixelPos / ParentStride) * ParentStride;
 
-			constexpr bool bUseTimer = (VisType == EVisualisationType::RayTime)
-										|| (VisType == EVisualisationType::RayTimeEvenMiss)
-										;							
-			FTimer Timer;
-			if constexpr (bUseTimer)
+		const FPackedHitRecord* First = nullptr;
+		for (int32 Corner = 0; Corner < 4; ++Corner)
+		{
+			const FIntPoint CornerPos = Cell + FIntPoint(Corner & 1, Corner >> 1) * ParentStride;
+			if (CornerPos.X >= RenderTargetSize.X || CornerPos.Y >= RenderTargetSize.Y)
 			{
-				Timer.MinTime = Settings.RaytraceTimeMinTime;
-				Timer.MaxTime = Settings.RaytraceTimeMaxTime;
-				Timer.Start();
+				continue;
 			}
 
-			bool bHit = World->LineTraceSingleByObjectType(	HitResult,
-															Origin + TraceNormal * Settings.MinDistance,
-															Origin + TraceNormal * HALF_WORLD_MAX,
-															Settings.CollisionObjectQueryParams,
-															Settings.CollisionQueryParams);
-							
-			if constexpr (bUseTimer)
+			const FPackedHitRecord& Sample = TileHitData[CornerPos.Y * RenderTargetSize.X + CornerPos.X];
+			if (Sample.Distance == FPackedHitRecord::DistanceInferred)
 			{
-				Timer.End();
+				continue;
 			}
+			if (!Sample.IsTraced())
+			{
+				return ESampleAgreement::Pending;
+			}
+			if (!First)
+			{
+				First = &Sample;
+			}
+			else if (!SamplesAgree(*First, Sample))
+			{
+				return ESampleAgreement::Disagree;
+			}
+		}
+		return ESampleAgreement::Agree;
+	}
+
+	// Progressive version of picking a hole to fill, see r.SDCollisionVis.Settings.Progressive.
+	// Holes on a coarse grid (spaced by the largest power of two TileSize is a multiple of) go first, then each finer grid
+	// in turn, with holes on the finer grids only being traced where the samples around them on the grid above disagree.
+	// The rest are left for DrawTracedTexture.usf to upsample, and count as covered.
+	// Returns false once there's nothing left to trace, bOutPending being set if that's only until more of the grid above is.
+	bool FindProgressivePixel(FIntPoint TileStart, FIntPoint TileExtent, FTileState& Tile, FIntPoint& OutPixelPos, bool& bOutPending) const
+	{
+		const TArrayView<FPackedHitRecord> TileHitData = GetTileHitData();
+		const int32 TileSize = (int32)Settings.TileSize;
+		const int32 CoarseStride = TileSize & -TileSize;
+
+		bOutPending = false;
+		for (int32 Stride = CoarseStride; Stride >= 1; Stride /= 2)
+		{
+			for (int32 Y = 0; Y < TileExtent.Y; Y += Stride)
+			{
+				for (int32 X = 0; X < TileExtent.X; X += Stride)
+				{
+					// Already been through the coarser grids
+					if (Stride < CoarseStride && ((X | Y) & Stride) == 0)
+					{
+						continue;
+					}
+
+					const FIntPoint PixelPos = TileStart + FIntPoint(X, Y);
+					const int32 PixelIndex = PixelPos.Y * RenderTargetSize.X + PixelPos.X;
+					if (TileHitData[PixelIndex].IsValid())
+					{
+						continue;
+					}
+
+					const ESampleAgreement Agreement = Stride == CoarseStride ? ESampleAgreement::Disagree : CompareParentSamples(PixelPos, Stride * 2);
+					if (Agreement == ESampleAgreement::Disagree)
+					{
+						OutPixelPos = PixelPos;
+						return true;
+					}
+					if (Agreement == ESampleAgreement::Pending)
+					{
+						bOutPending = true;
+						continue;
+					}
+
+					TileHitData[PixelIndex].Distance = FPackedHitRecord::DistanceInferred;
+					--Tile.NumInvalid;
+					if (!PixelCovered.IsEmpty())
+					{
+						MarkCovered(Tile, PixelIndex);
+					}
+				}
+			}
+		}
+		return false;
+	}
+
+	void MarkCovered(FTileState& Tile, int32 PixelIndex) const
+	{
+		if (PixelCovered[PixelIndex] == 0)
+		{
+			PixelCovered[PixelIndex] = 1;
+			--Tile.NumUncovered;
+		}
+	}
 
-			FColor WritebackColour = CalculateVisualisationColour<VisType>(	bHit,
-																			Origin,
-																			HitResult,
-																			TraceNormal,
-																			RevViewForward,
-																			Timer,
-																			Settings.TriangleDensityMinArea2,
-																			Settings.TriangleDensityMul);
+	FIntPoint GetNumTiles() const
+	{
+		const int32 TileSize = (int32)Settings.TileSize;
+		return FIntPoint((RenderTargetSize.X + TileSize - 1) / TileSize, (RenderTargetSize.Y + TileSize - 1) / TileSize);
+	}
+
+	FTileState& GetTile(FIntPoint PixelPos) const
+	{
+		const int32 TileSize = (int32)Settings.TileSize;
+		return Tiles[(PixelPos.Y / TileSize) * GetNumTiles().X + (PixelPos.X / TileSize)];
+	}
 
-			PixelData[PixelPos.Y * RenderTargetSize.X + PixelPos.X] = WritebackColour;
+	// Traces PixelPositions, then lets the tiles they're in know what they hit.
+	// Tiles follow the static layer when layered, so tracing just the dynamic layer leaves them be.
+	template<EVisualisationType VisType>
+	void RenderTilePixels(TArrayView<const FIntPoint> PixelPositions, ETraceLayers Layers = ETraceLayers::Both) const
+	{
+		RenderPerspectivePixels<VisType>(PixelPositions, Layers);
+		if (Tiles.IsEmpty() || !EnumHasAnyFlags(Layers, ETraceLayers::Static))
+		{
+			return;
+		}
+
+		const TArrayView<FPackedHitRecord> TileHitData = GetTileHitData();
+		for (const FIntPoint& PixelPos : PixelPositions)
+		{
+			if (PixelPos.X < RenderTargetSize.X && PixelPos.Y < RenderTargetSize.Y)
+			{
+				const int32 PixelIndex = PixelPos.Y * RenderTargetSize.X + PixelPos.X;
+				FTileState& Tile = GetTile(PixelPos);
+				Tile.RecordSample(TileHitData[PixelIndex]);
+				if (!PixelCovered.IsEmpty())
+				{
+					MarkCovered(Tile, PixelIndex);
+				}
+			}
 		}
 	}
 
+	// Samples taken from a block of tiles, waiting to be traced as a batch.
+	struct FTileSampleBatch
+	{
+		TTraceBatchArray<FIntPoint> PixelPositions;
+		TTraceBatchArray<FIntPoint> DynamicPixelPositions;	//< Layered only, from tiles whose static layer has converged
+	};
+
+	// Adds a sample from the tile at TileStart to Batch, tracing it once it's full.
+	// Once a layered tile's static layer has converged, only its dynamic layer is traced, right where the pattern says.
+	template<EVisualisationType VisType>
+	void AddTileSample(FIntPoint TileStart, FIntPoint SamplePos, FTileSampleBatch& Batch) const
+	{
+		if (IsLayered() && !Tiles.IsEmpty() && GetTile(TileStart).IsConverged())
+		{
+			Batch.DynamicPixelPositions.Add(SamplePos);
+			if (Batch.DynamicPixelPositions.Num() == GMaxTraceBatchSize)
+			{
+				RenderTilePixels<VisType>(Batch.DynamicPixelPositions, ETraceLayers::Dynamic);
+				Batch.DynamicPixelPositions.Reset();
+			}
+			return;
+		}
+
+		Batch.PixelPositions.Add(Tiles.IsEmpty() ? SamplePos : PrioritisePixel(TileStart, SamplePos));
+		if (Batch.PixelPositions.Num() == GMaxTraceBatchSize)
+		{
+			RenderTilePixels<VisType>(Batch.PixelPositions);
+			Batch.PixelPositions.Reset();
+		}
+	}
+
+	template<EVisualisationType VisType>
+	void FlushTileSamples(FTileSampleBatch& Batch) const
+	{
+		RenderTilePixels<VisType>(Batch.PixelPositions);
+		RenderTilePixels<VisType>(Batch.DynamicPixelPositions, ETraceLayers::Dynamic);
+		Batch.PixelPositions.Reset();
+		Batch.DynamicPixelPositions.Reset();
+	}
+
+	// Traces one pixel from each tile in a block of tiles (see FMortonOrder), as a batch.
+	template<ESamplingPattern SamplingPattern, EVisualisationType VisType>
+	void RenderPerspectiveTileBlock(FIntPoint FirstTile) const
+	{
+		const FIntPoint NumTiles = GetNumTiles();
+
+		FTileSampleBatch Batch;
+		for (int32 Cell = 0; Cell < FMortonOrder::CellsPerBlock; ++Cell)
+		{
+			const FIntPoint Tile = FirstTile + MortonDecode2D((uint32)Cell);
+			if (Tile.X >= NumTiles.X || Tile.Y >= NumTiles.Y)
+			{
+				continue;
+			}
+
+			const FIntPoint TileStart = Tile * (int32)Settings.TileSize;
+			const FIntPoint PixelPos = NextTileSamplePosition<SamplingPattern>(	TileStart,
+																				Settings.TileSize,
+																				Settings.FrameId);
+			AddTileSample<VisType>(TileStart, PixelPos, Batch);
+		}
+		FlushTileSamples<VisType>(Batch);
+	}
+
+	// Budgeted version of RenderPerspectiveTileBlock, tracing RaysPerTile[i] pixels from the i'th tile.
+	// Each tile keeps its own place along the sampling pattern, since they no longer advance in lockstep.
+	template<ESamplingPattern SamplingPattern, EVisualisationType VisType>
+	void RenderPerspectiveTileBlockBudgeted(FIntPoint FirstTile, TArrayView<const uint16> RaysPerTile) const
+	{
+		const uint32 TileSize = Settings.TileSize;
+		const FIntPoint NumTiles = GetNumTiles();
+
+		FTileSampleBatch Batch;
+		for (int32 Cell = 0; Cell < FMortonOrder::CellsPerBlock; ++Cell)
+		{
+			const FIntPoint TileCoord = FirstTile + MortonDecode2D((uint32)Cell);
+			if (TileCoord.X >= NumTiles.X || TileCoord.Y >= NumTiles.Y)
+			{
+				continue;
+			}
+
+			const FIntPoint TileStart = TileCoord * (int32)TileSize;
+			FTileState& Tile = GetTile(TileStart);
+			for (int32 Ray = 0; Ray < RaysPerTile[TileCoord.Y * NumTiles.X + TileCoord.X]; ++Ray)
+			{
+				const uint32 SampleFrameId = MakeSampleFrameId(SamplingPattern, TileSize, Tile.SampleIndex++);
+				const FIntPoint PixelPos = NextTileSamplePosition<SamplingPattern>(TileStart, TileSize, SampleFrameId);
+				AddTileSample<VisType>(TileStart, PixelPos, Batch);
+			}
+		}
+		FlushTileSamples<VisType>(Batch);
+	}
+
 	template<ESamplingPattern SamplingPattern, EVisualisationType VisType>
 	void RenderPerspectiveTilePixel(FIntPoint Tile) const
 	{
@@ -147,21 +786,270 @@ public:
 		RenderPerspectivePixel<VisType>(PixelPos);
 	}
 
+	// How closely neighbouring samples have to agree for progressive traces to upsample between them, see SamplesAgree.
+	static constexpr float ProgressiveMinNormalDot = 0.9f;
+	static constexpr float ProgressiveMaxDepthRatio = 0.1f;
+
 	UWorld* World;
+	TSharedPtr<FCollisionSnapshot> Snapshot;	//< When set, rays are traced against this rather than the World
+	FDirtyPixelList* DirtyPixels = nullptr;		//< When set, every pixel written is also recorded here
 
 	// Localised version of FRenderBuffer
 	FIntPoint RenderTargetSize;
 	TArrayView<FColor> PixelData;
+	TArrayView<FPackedHitRecord> HitData;
+	TArrayView<FPackedHitRecord> StaticHitData;		//< Layered only, see FRenderBuffer::StaticHitData
+	TArrayView<FPackedHitRecord> DynamicHitData;	//< Layered only
+	TArrayView<FTileState> Tiles;				//< Optional, see FRenderBuffer::Tiles
+	TArrayView<uint8> PixelCovered;				//< Optional, see FRenderBuffer::PixelCovered
 
 	FSDCollisionSettings Settings;
+	FSDCollisionSettings DynamicSettings;		//< Layered only, what the dynamic layer is traced with (Settings tracing the static layer)
 
 	// Stuff needed to figure out ray direction and what have you.
 	FVector       Origin;
 	FViewMatrices ViewMatrices;
 	FVector2D     PointToUV;
-	FVector       RevViewForward;
+	FIntPoint     PixelOffset = FIntPoint::ZeroValue;	//< See SetImageRegion
+	FVector4      RayStart;		//< Homogenous world position of the centre of pixel 0, see SetImageRegion
+	FVector4      RayStepX;		//< Change in RayStart per pixel
+	FVector4      RayStepY;
+	FColourParams ColourParams;
+
+	// Offline only, see SetPanorama
+	EPanoramaProjection Panorama = EPanoramaProjection::None;
+	FMatrix             PanoramaBasis = FMatrix::Identity;
+};
+
+
+// Maximum number of realtime traces which can be queued up (or running) per view before the GameThread stops dispatching more.
+constexpr int32 GMaxTraceFramesInFlight = 3;
+
+// Where foveated traces concentrate their rays, in render target pixels, see r.SDCollisionVis.Settings.Foveation.
+struct FFoveation
+{
+	FVector2f Centre = FVector2f::ZeroVector;
+	float     Radius = 0.0f;		//< Full density inside this, 0 when not foveated
+	float     MinDensity = 1.0f;	//< Density at the periphery, relative to inside Radius
+
+	bool IsEnabled() const { return Radius > 0.0f; }
+
+	// Falls off with the square of the distance outside Radius, down to MinDensity.
+	float GetTileWeight(int32 TileIndex, FIntPoint NumTiles, uint32 TileSize) const
+	{
+		if (!IsEnabled())
+		{
+			return 1.0f;
+		}
+		const FVector2f TileCentre(	((float)(TileIndex % NumTiles.X) + 0.5f) * (float)TileSize,
+									((float)(TileIndex / NumTiles.X) + 0.5f) * (float)TileSize);
+		const float Distance = FVector2f::Distance(TileCentre, Centre);
+		return Distance > Radius ? FMath::Max(FMath::Square(Radius / Distance), MinDensity) : 1.0f;
+	}
+};
+
+// Everything a realtime trace needs, kept per view and reused round robin (one per trace which can be in flight), so
+// dispatching a trace doesn't allocate. Filled in by the GameThread before the trace is queued, then only touched by the trace.
+struct FRealtimeTrace
+{
+	TOptional<FPerspectiveRenderer> PerspectiveRenderer;
+	TSharedPtr<FRenderBuffer>       Framebuffer;				//< Framebuffer the trace writes into
+	FDirtyPixelList                 DirtyPixels;
+	TArray<uint16>                  RaysPerTile;				//< Scratch space for allocated traces, see AllocateTileRays
+	FFoveation                      Foveation;
+	int64                           TraceIndex = 0;
+	int32                           RayBudget = 0;				//< This view's share of r.SDCollisionVis.Settings.RayBudget, 0 for no limit
+	bool                            bSceneChanged = false;
+	bool                            bNewFramebuffer = false;	//< Framebuffer may have come from the pool, uploaded by some earlier trace before it was reset
+
+	void Run();
+};
+
+// Runs an FRealtimeTrace on the task graph, as a task of its own rather than a TFunction, which would box it on the heap.
+class FRealtimeTraceTask
+{
+public:
+	FRealtimeTraceTask(FRealtimeTrace& InTrace) : Trace(InTrace) {}
+
+	static ESubsequentsMode::Type GetSubsequentsMode() { return ESubsequentsMode::TrackSubsequents; }
+	ENamedThreads::Type GetDesiredThread() { return ENamedThreads::AnyThread; }
+	TStatId GetStatId() const { RETURN_QUICK_DECLARE_CYCLE_STAT(FRealtimeTraceTask, STATGROUP_TaskGraphTasks); }
+
+	void DoTask(ENamedThreads::Type CurrentThread, const FGraphEventRef& MyCompletionGraphEvent)
+	{
+		Trace.Run();
+	}
+
+private:
+	FRealtimeTrace& Trace;
+};
+
+// A realtime trace which has been dispatched, but not yet presented.
+struct FTraceFrame
+{
+	FGraphEventRef            Task;
+	TSharedPtr<FRenderBuffer> Framebuffer;				//< Framebuffer the trace writes into
+	const FDirtyPixelList*    DirtyPixels = nullptr;	//< Owned by the trace's FRealtimeTrace, which isn't reused until this has been presented
+	uint64                    FrameNumber = 0;			//< GFrameCounter when dispatched
 };
 
+// How a view should be presented, handed from the GameThread to the RenderThread each frame.
+struct FPresentState
+{
+	uint64             FrameNumber = 0;		//< GFrameCounter it was made on
+	FColourParams      ColourParams;		//< Hits are coloured as they're presented, so these apply straight away
+	EVisualisationType VisType = EVisualisationType::Default;
+	bool               bEdgeAwareUpscale = true;
+};
+
+
+struct FSDCollisionVisRealtimeViewData
+{
+	uint64 LastAccessed = 0;
+	TSharedPtr<FRenderBuffer> FramebufferGameThread;	//< Framebuffer held onto by the GameThread, traces write into this
+	TSharedPtr<FRenderBuffer> FramebufferRenderThread;	//< Framebuffer last presented by the RenderThread
+	FIntPoint                 FramebufferRequestedSize = FIntPoint::ZeroValue;	//< What FramebufferGameThread was asked for, it may be smaller to fit FRenderBufferPool
+
+	// Traces are chained one after the other, so they complete in the order they were queued.
+	// GameThread enqueues, RenderThread dequeues once complete.
+	TCircularQueue<FTraceFrame> TraceFrames { GMaxTraceFramesInFlight + 1 };
+	std::atomic<int32>  NumTraceFramesInFlight = 0;
+	std::atomic<uint32> PresentedLag = 0;	//< How many frames behind the view the presented trace was
+
+	// GameThread enqueues one a frame, RenderThread takes the latest it's caught up with.
+	TCircularQueue<FPresentState> PresentStates { 4 };
+
+	// GameThread only
+	FGraphEventRef LastTraceTask;			//< Tail of the trace chain
+	uint64         NumTracesDispatched = 0;
+	TStaticArray<FRealtimeTrace, GMaxTraceFramesInFlight> Traces;	//< By NumTracesDispatched, see FRealtimeTrace
+
+	// GameThread only, what the last trace was dispatched with, so we know whether tracing again could change anything.
+	FVector                      LastTraceOrigin = FVector::ZeroVector;
+	FMatrix                      LastTraceViewProjectionMatrix = FMatrix::Identity;
+	uint32                       LastTraceSettingsHash = 0;		//< See FSDCollisionSettings::GetTraceHash
+	uint32                       LastTracePhysicsGeneration = 0;	//< See FSDCollisionVisModule::GetPhysicsSceneGeneration
+	TWeakPtr<FCollisionSnapshot> LastTraceSnapshot;
+
+	// RenderThread only, persistent copy of FramebufferRenderThread's hits on the GPU.
+	TRefCountPtr<FRDGPooledBuffer> HitBuffer;
+	FIntPoint                      HitBufferDimensions = FIntPoint::ZeroValue;
+	TWeakPtr<FRenderBuffer>        HitBufferSource;	//< Framebuffer last uploaded into HitBuffer, anything else needs a full upload
+	uint64                         PresentedFrameNumber = 0;
+	FPresentState                  PresentState;	//< Latest taken from PresentStates
+
+	// Blocks until every queued trace has finished, e.g before the world they're tracing goes away.
+	void WaitForTraces()
+	{
+		if (LastTraceTask)
+		{
+			FTaskGraphInterface::Get().WaitUntilTaskCompletes(LastTraceTask);
+		}
+	}
+};
+
+// Realtime framebuffers for every view, allocated under one memory cap (see r.SDCollisionVis.Settings.MaxMemoryMB).
+// Buffers nothing references any more (e.g after a resize, or a viewport closing) are kept to be reused by the next
+// request for the same size, and are the first to go when a new one wouldn't otherwise fit. GameThread only.
+class FRenderBufferPool
+{
+public:
+	// Returns a hits framebuffer initialised to Dimensions, or null if there's no room for it under MaxBytes.
+	TSharedPtr<FRenderBuffer> Acquire(FIntPoint Dimensions, ERenderBufferContents Contents, int64 MaxBytes);
+
+	// Frees buffers which haven't been used for KeepAliveFrames.
+	void Prune(uint64 KeepAliveFrames);
+	void Empty();
+
+	int64 GetAllocatedBytes() const { return AllocatedBytes; }
+
+	// What a realtime framebuffer takes up, including the scratch space it'll need once the view moves.
+	static int64 EstimateBytes(FIntPoint Dimensions, ERenderBufferContents Contents);
+
+private:
+	struct FEntry
+	{
+		TSharedPtr<FRenderBuffer> Buffer;
+		ERenderBufferContents     Contents = ERenderBufferContents::Hits;
+		int64                     Bytes = 0;
+		uint64                    LastUsed = 0;
+	};
+
+	// Only the GameThread hands out references, so once the pool is the last one holding a buffer, nothing else can pick it up.
+	static bool IsFree(const FEntry& Entry) { return Entry.Buffer.GetSharedReferenceCount() == 1; }
+
+	TArray<FEntry> Entries;
+	int64          AllocatedBytes = 0;
+};
+
+// Shares the realtime budget (see r.SDCollisionVis.Settings.BudgetMs and RayBudget) between every view being traced,
+// by weight (their on-screen area, the focused viewport counting for more). View families are rendered one after
+// the other, so a view's share is taken against every view registered this frame or last. GameThread only.
+class FRealtimeRayScheduler
+{
+public:
+	// Registers ViewKey for this frame, returning its share of the budget, (0, 1].
+	float GetShare(uint32 ViewKey, float Weight);
+
+	// Forgets views which haven't been rendered since last frame.
+	void Prune();
+
+private:
+	struct FEntry
+	{
+		float  Weight = 0.0f;
+		uint64 LastFrame = 0;
+	};
+
+	TMap<uint32, FEntry> Views;
+};
+
+// Realtime renderer, rays are dispatched on the gamethread and run across frame boundaries.
+// The renderthread never waits on them, it presents whatever has completed so far, colouring
+// the hits as it overwrites whatever is there.
+// Once running, a frame doesn't allocate anything (see the SDCollisionVisRealtime memory tag), so settings are only
+// read back when a CVar changes, and everything a view needs from one frame to the next is kept in its view data.
+class FSDCollisionVisRealtimeViewExtension final : public FSceneViewExtensionBase
+{
+public:
+	FSDCollisionVisRealtimeViewExtension(const FAutoRegister& AutoRegister);
+	~FSDCollisionVisRealtimeViewExtension();
+
+	/** ISceneViewExtension implementation */
+	void BeginRenderViewFamily(FSceneViewFamily& InViewFamily) override;
+	void PostRenderViewFamily_RenderThread(FRDGBuilder& GraphBuilder, FSceneViewFamily& InViewFamily) override;
+
+	// Hands a view's data over to the RenderThread (or takes it back), which looks views up by key when presenting.
+	void RegisterViewData(uint32 ViewKey, const TSharedPtr<FSDCollisionVisRealtimeViewData>& ViewData);
+	void UnregisterViewData(uint32 ViewKey);
+	void UnregisterAllViewData();
+
+private:
+	void BeginRenderView(	FSceneViewFamily& ViewFamily,
+							int32 ViewIndex,
+							UWorld* World,
+							const FSDCollisionSettings& Settings,
+							bool bFocused);
+
+	// Settings as of the last time a CVar changed.
+	const FSDCollisionSettings& GetSettings();
+	void OnConsoleVariablesChanged();
+
+	// GameThread only
+	FSDCollisionSettings       Settings;
+	bool                       bSettingsDirty = true;
+	FConsoleVariableSinkHandle ConsoleVariableSinkHandle;
+
+	// RenderThread only, see RegisterViewData.
+	TMap<uint32, TSharedPtr<FSDCollisionVisRealtimeViewData>> ViewDataRenderThread;
+};
+
+
+// Headless offline render, for build machines, started with -SDCollisionVisRender on the command line (see the README).
+// Renders the first map to load, as fast as every core allows, then exits (with a non zero exit code on failure).
+void StartHeadlessOfflineRender();
+
+
 
 
 
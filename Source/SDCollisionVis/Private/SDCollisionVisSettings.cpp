@@ -12,6 +12,7 @@
 #include <ShaderParameterStruct.h>
 #include <Async/ParallelFor.h>
 #include <Containers/ResourceArray.h>
+#include <Misc/ScopeLock.h>
 #include <Engine/HitResult.h>
 #include <Components/PrimitiveComponent.h>
 #include <Chaos/ChaosEngineInterface.h>
@@ -21,6 +22,8 @@
 #include <PhysicsEngine/PhysicsObjectExternalInterface.h>
 #include <PhysicalMaterials/PhysicalMaterial.h>
 
+#include <atomic>
+
 #define LOCTEXT_NAMESPACE "SDCollisionVis"
 
 namespace SDCollisionVis
@@ -39,12 +42,51 @@ static TAutoConsoleVariable<float> CVarSettingsScale(
 	TEXT("How much to downscale the render buffer."),
 	ECVF_Default);
 
+static TAutoConsoleVariable<float> CVarSettingsBudgetMs(
+	TEXT("r.SDCollisionVis.Settings.BudgetMs"),
+	0.0f,
+	TEXT("Time (ms) each frame's realtime traces should take, the number of rays is sized from how fast previous traces went.\n")
+	TEXT("Shared between every view being traced, by area, with the focused viewport getting more.\n")
+	TEXT("Rays go to tiles which still have holes, haven't been fully sampled, or straddle an edge first.\n")
+	TEXT("0 = Fixed, 1px per tile per trace"),
+	ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarSettingsRayBudget(
+	TEXT("r.SDCollisionVis.Settings.RayBudget"),
+	0,
+	TEXT("Rays per frame for every realtime view together, shared out as with r.SDCollisionVis.Settings.BudgetMs (whichever is lower wins).\n")
+	TEXT("0 = No limit"),
+	ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarSettingsLayered(
+	TEXT("r.SDCollisionVis.Settings.Layered"),
+	0,
+	TEXT("Trace static and dynamic collision as separate layers, composited by depth (realtime, Scene Queries, MobilityType 0 only).\n")
+	TEXT("Static collision is only traced again when the view, settings or physics scene change, dynamic collision is traced every frame."),
+	ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarSettingsProgressive(
+	TEXT("r.SDCollisionVis.Settings.Progressive"),
+	0,
+	TEXT("Fill holes in the realtime image coarse to fine, only tracing finer pixels where the coarser ones around them disagree.\n")
+	TEXT("Pixels which aren't traced are upsampled from their neighbours when presenting."),
+	ECVF_Default);
+
 static TAutoConsoleVariable<int32> CVarSettingsSamplingPattern(
 	TEXT("r.SDCollisionVis.Settings.SamplingPattern"),
 	1,
 	TEXT("Sampling pattern to use:\n")
 	TEXT("0 = Linear\n")
-	TEXT("1 = R2"),
+	TEXT("1 = R2\n")
+	TEXT("2 = Sobol (every pixel of a tile once per TileSize^2 samples, spread evenly along the way)"),
+	ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarSettingsTraceEngine(
+	TEXT("r.SDCollisionVis.Settings.TraceEngine"),
+	0,
+	TEXT("How rays are traced:\n")
+	TEXT("0 = Physics scene queries\n")
+	TEXT("1 = Plugin owned BVH snapshot of the queried bodies (see r.SDCollisionVis.Snapshot.*)"),
 	ECVF_Default);
 
 static TAutoConsoleVariable<int32> CVarSettingsVisType(
@@ -267,6 +309,13 @@ FSDCollisionSettings::FSDCollisionSettings()
 	{
 	case 0: { SamplingPattern = ESamplingPattern::Linear; break; }
 	case 1: { SamplingPattern = ESamplingPattern::R2; break; }
+	case 2: { SamplingPattern = ESamplingPattern::Sobol; break; }
+	}
+
+	switch (CVarSettingsTraceEngine.GetValueOnGameThread())
+	{
+	case 0: { TraceEngine = ETraceEngine::SceneQuery; break; }
+	case 1: { TraceEngine = ETraceEngine::Snapshot; break; }
 	}
 
 	int32 ObjectQueryMask = 0;
@@ -293,7 +342,6 @@ FSDCollisionSettings::FSDCollisionSettings()
 	CollisionQueryParams.bTraceComplex = CVarCollisionQueryTraceComplex.GetValueOnGameThread() != 0;
 	CollisionQueryParams.bIgnoreBlocks = CVarCollisionQueryIgnoreBlocks.GetValueOnGameThread() != 0;
 	CollisionQueryParams.bIgnoreTouches = CVarCollisionQueryIgnoreTouches.GetValueOnGameThread() != 0;
-	CollisionQueryParams.bReturnPhysicalMaterial = VisType == EVisualisationType::Material;
 	switch (CVarCollisionQueryMobilityType.GetValueOnGameThread())
 	{
 	case 0: { CollisionQueryParams.MobilityType = EQueryMobilityType::Any; break; }
@@ -304,6 +352,10 @@ FSDCollisionSettings::FSDCollisionSettings()
 	MinDistance = (double)CVarSettingsMinDistance.GetValueOnGameThread();
 	TileSize = CVarSettingsTileSize.GetValueOnGameThread();
 	Scale = CVarSettingsScale.GetValueOnGameThread();
+	BudgetMs = CVarSettingsBudgetMs.GetValueOnGameThread();
+	RayBudget = CVarSettingsRayBudget.GetValueOnGameThread();
+	bLayered = CVarSettingsLayered.GetValueOnGameThread() != 0;
+	bProgressive = CVarSettingsProgressive.GetValueOnGameThread() != 0;
 	RaytraceTimeMinTime = CVarSettingsRaytraceTimeMinTime.GetValueOnGameThread();
 	RaytraceTimeMaxTime = CVarSettingsRaytraceTimeMaxTime.GetValueOnGameThread();
 	TriangleDensityMinArea2 = CVarSettingsTriangleDensityMinArea.GetValueOnGameThread() * 2.0;
@@ -314,16 +366,109 @@ FSDCollisionSettings::FSDCollisionSettings()
 
 void FSDCollisionSettings::UpdateSettings()
 {
-	CollisionQueryParams.bReturnFaceIndex = (VisType == EVisualisationType::Triangles) || (VisType == EVisualisationType::TriangleDensity);
+	CollisionQueryParams.bReturnFaceIndex = bGatherAllAttributes || (VisType == EVisualisationType::Triangles) || (VisType == EVisualisationType::TriangleDensity);
+	CollisionQueryParams.bReturnPhysicalMaterial = bGatherAllAttributes || (VisType == EVisualisationType::Material);
 	TileSize = FMath::Clamp<uint32>(TileSize, 2u, 128u);
 	Scale = FMath::Clamp<float>(Scale, 0.0f, 1.0f);
-	FrameId = SamplingPattern == ESamplingPattern::R2 ?
-								((uint32)(GFrameCounter % (TileSize * TileSize * TileSize * TileSize)))
-								: ((uint32)(GFrameCounter & 0xffffffffu))
-								;
+	BudgetMs = FMath::Max(BudgetMs, 0.0f);
+	RayBudget = FMath::Max(RayBudget, 0);
+	SetSampleIndex(GFrameCounter);
 	TriangleDensityMul = 1.0 / (TriangleDensityMaxArea2 - TriangleDensityMinArea2);
 }
 
+void FSDCollisionSettings::SetSampleIndex(uint64 SampleIndex)
+{
+	FrameId = MakeSampleFrameId(SamplingPattern, TileSize, SampleIndex);
+}
+
+uint32 FSDCollisionSettings::GetTraceHash() const
+{
+	uint32 Hash = GetTypeHash(CollisionObjectQueryParams.ObjectTypesToQuery);
+	Hash = HashCombine(Hash, GetTypeHash(CollisionQueryParams.TraceTag));
+	Hash = HashCombine(Hash, GetTypeHash((int32)CollisionQueryParams.MobilityType));
+	Hash = HashCombine(Hash, GetTypeHash((uint32)CollisionQueryParams.bTraceComplex));
+	Hash = HashCombine(Hash, GetTypeHash((uint32)CollisionQueryParams.bIgnoreBlocks));
+	Hash = HashCombine(Hash, GetTypeHash((uint32)CollisionQueryParams.bIgnoreTouches));
+	Hash = HashCombine(Hash, GetTypeHash((int32)TraceEngine));
+	Hash = HashCombine(Hash, GetTypeHash(MinDistance));
+	Hash = HashCombine(Hash, GetTypeHash((uint32)bGatherAllAttributes));
+
+	// Triangle areas are only resolved when they're being looked at
+	Hash = HashCombine(Hash, GetTypeHash((uint32)(VisType == EVisualisationType::TriangleDensity)));
+	return Hash;
+}
+
+FColourParams FSDCollisionSettings::GetColourParams(const FVector& RevViewForward) const
+{
+	FColourParams Params;
+	Params.RevViewForward = RevViewForward;
+	Params.RaytraceTimeMinTime = RaytraceTimeMinTime;
+	Params.RaytraceTimeMaxTime = RaytraceTimeMaxTime;
+	Params.TriangleDensityMinArea2 = TriangleDensityMinArea2;
+	Params.TriangleDensityMul = TriangleDensityMul;
+	return Params;
+}
+
+
+// Second dimension of the Sobol' sequence (the first being the bits of the index reversed).
+static uint32 SobolSecondDimension(uint32 Index)
+{
+	uint32 Result = 0u;
+	for (uint32 V = 1u << 31; Index != 0u; Index >>= 1, V ^= V >> 1)
+	{
+		if (Index & 1u)
+		{
+			Result ^= V;
+		}
+	}
+	return Result;
+}
+
+static TArray<FIntPoint> BuildSobolTileOrder(uint32 TileSize)
+{
+	// Walk the smallest power of two grid holding the tile, dropping anything which lands outside of it.
+	const uint32 GridSize = FMath::RoundUpToPowerOfTwo(TileSize);
+	const uint32 Shift = 32u - FMath::FloorLog2(GridSize);
+
+	TArray<FIntPoint> Order;
+	Order.Reserve(TileSize * TileSize);
+	for (uint32 Index = 0; Index < GridSize * GridSize; ++Index)
+	{
+		const uint32 X = ReverseBits(Index) >> Shift;
+		const uint32 Y = SobolSecondDimension(Index) >> Shift;
+		if (X < TileSize && Y < TileSize)
+		{
+			Order.Add(FIntPoint((int32)X, (int32)Y));
+		}
+	}
+	check(Order.Num() == (int32)(TileSize * TileSize));
+	return Order;
+}
+
+const TArray<FIntPoint>& GetSobolTileOrder(uint32 TileSize)
+{
+	// One per TileSize (see FSDCollisionSettings::UpdateSettings for the range), read from every worker so only
+	// locked while they're being built.
+	static constexpr uint32 MaxTileSize = 128u;
+	static TUniquePtr<TArray<FIntPoint>> Orders[MaxTileSize + 1];
+	static std::atomic<const TArray<FIntPoint>*> PublishedOrders[MaxTileSize + 1] = {};
+	static FCriticalSection OrdersCS;
+
+	check(TileSize >= 2u && TileSize <= MaxTileSize);
+	const TArray<FIntPoint>* Order = PublishedOrders[TileSize].load(std::memory_order_acquire);
+	if (!Order)
+	{
+		FScopeLock Lock(&OrdersCS);
+		if (!Orders[TileSize])
+		{
+			Orders[TileSize] = MakeUnique<TArray<FIntPoint>>(BuildSobolTileOrder(TileSize));
+			PublishedOrders[TileSize].store(Orders[TileSize].Get(), std::memory_order_release);
+		}
+		Order = Orders[TileSize].Get();
+	}
+	return *Order;
+}
+
 } // namespace SDCollisionVis
 
 #undef LOCTEXT_NAMESPACE 
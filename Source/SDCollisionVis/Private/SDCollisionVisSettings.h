@@ -35,7 +35,23 @@ enum class EVisualisationType
 enum class ESamplingPattern
 {
 	Linear,
-	R2
+	R2,
+	Sobol	//< Scrambled Sobol' permutation of each tile, see GetSobolTileOrder
+};
+
+
+enum class ETraceEngine
+{
+	SceneQuery,     //< Trace through the physics scene (via TraceRayBatch)
+	Snapshot        //< Trace against a plugin owned BVH snapshot of the scene (see SDCollisionVisBVH.h)
+};
+
+// Offline renders only, tracing the whole sphere around the camera in a single image.
+enum class EPanoramaProjection
+{
+	None,
+	Equirectangular,    //< Latitude/longitude, twice as wide as it is tall
+	Octahedral          //< Sphere folded out onto an octahedron with an equal-area mapping, so every pixel covers the same solid angle
 };
 
 
@@ -93,6 +109,39 @@ FORCEINLINE FColor Heatmap(float Intensity, float Dampening = 1.0)
 }
 
 
+// Z-order (Morton) curve, pulls X (or Y, given Code >> 1) back out of the interleaved bits.
+FORCEINLINE uint32 MortonCompact1By1(uint32 Code)
+{
+	Code &= 0x55555555u;
+	Code = (Code ^ (Code >> 1)) & 0x33333333u;
+	Code = (Code ^ (Code >> 2)) & 0x0f0f0f0fu;
+	Code = (Code ^ (Code >> 4)) & 0x00ff00ffu;
+	Code = (Code ^ (Code >> 8)) & 0x0000ffffu;
+	return Code;
+}
+
+FORCEINLINE FIntPoint MortonDecode2D(uint32 Code)
+{
+	return FIntPoint((int32)MortonCompact1By1(Code), (int32)MortonCompact1By1(Code >> 1));
+}
+
+// FrameId to pass to NextTileSamplePosition for the SampleIndex'th sample of a tile.
+FORCEINLINE uint32 MakeSampleFrameId(ESamplingPattern SamplingPattern, uint32 TileSize, uint64 SampleIndex)
+{
+	switch (SamplingPattern)
+	{
+	case ESamplingPattern::R2:      return (uint32)(SampleIndex % (TileSize * TileSize * TileSize * TileSize));
+	case ESamplingPattern::Sobol:   return (uint32)(SampleIndex % (TileSize * TileSize));
+	default:                        return (uint32)(SampleIndex & 0xffffffffu);
+	}
+}
+
+// Every pixel of a TileSize x TileSize tile, in the order the 2D Sobol' sequence visits them.
+// The first 4^k points of the sequence land in each cell of a 2^k x 2^k grid exactly once, so as well as covering the
+// whole tile once every TileSize^2 samples, each run of 4^k samples is spread evenly over it.
+// Built the first time each TileSize is asked for, and kept from then on.
+const TArray<FIntPoint>& GetSobolTileOrder(uint32 TileSize);
+
 template<ESamplingPattern SamplingPattern>
 FORCEINLINE FIntPoint NextTileSamplePosition(FIntPoint TileStartOffset, uint32 TileSize, uint32 FrameId)
 {
@@ -110,6 +159,26 @@ FORCEINLINE FIntPoint NextTileSamplePosition(FIntPoint TileStartOffset, uint32 T
 		int32 Y = (int32)(FMath::Frac(G2 * (double)(FrameId + H)) * (double)TileSize);
 		return TileStartOffset + FIntPoint(X, Y);
 	}
+	else if constexpr(SamplingPattern == ESamplingPattern::Sobol)
+	{
+		// Scrambled per tile, so neighbouring tiles aren't all sampling the same spot at once.
+		// XORing the coordinates of a power of two tile keeps the sequence's stratification, other sizes make do with
+		// wrapping them around. Either way each tile still visits every pixel once per TileSize^2 samples.
+		const TArray<FIntPoint>& Order = GetSobolTileOrder(TileSize);
+		uint32 H = SimpleHash32(FUintVector((uint32)TileStartOffset.X, (uint32)TileStartOffset.Y, 0u));
+		FIntPoint Local = Order[FrameId % (uint32)Order.Num()];
+		if (FMath::IsPowerOfTwo(TileSize))
+		{
+			Local.X ^= (int32)(H & (TileSize - 1u));
+			Local.Y ^= (int32)((H >> 16) & (TileSize - 1u));
+		}
+		else
+		{
+			Local.X = (Local.X + (int32)(H % TileSize)) % (int32)TileSize;
+			Local.Y = (Local.Y + (int32)((H >> 16) % TileSize)) % (int32)TileSize;
+		}
+		return TileStartOffset + Local;
+	}
 	else
 	{
 		// Unhandled sampling mode
@@ -126,50 +195,190 @@ struct FTimer
 		CyclesStart = FPlatformTime::Cycles64();
 	}
 
-	void End()
+	// NumRays: How many rays were traced between Start and End, the time is shared evenly between them.
+	void End(uint32 NumRays = 1u)
 	{
-		float Ms = (float)FPlatformTime::ToMilliseconds64(FPlatformTime::Cycles64() - CyclesStart);
-		ClippedTime = FMath::Clamp<float>((Ms - MinTime) / (MaxTime - MinTime), 0.0f, 1.0f);
+		TimeMs = (float)FPlatformTime::ToMilliseconds64(FPlatformTime::Cycles64() - CyclesStart) / (float)NumRays;
 	}
 
 	float Get() const
 	{
-		return ClippedTime;
+		return TimeMs;
 	}
 
 	uint64 CyclesStart{};
-	float MinTime{};
-	float MaxTime{};
-	float ClippedTime{};
+	float TimeMs{};
+};
+
+// Compact result of a single ray, written by the batched query stage (see SDCollisionVisTrace.h)
+// in place of a full FHitResult.
+struct FHitRecord
+{
+	// Sentinels for TriangleArea2 when no triangle could be resolved
+	static constexpr float AreaNotMesh = -1.0f;         //< Hit something which isn't a mesh
+	static constexpr float AreaUnhandledMesh = -2.0f;   //< Hit a mesh, but couldn't extract a triangle from it
+
+	float     Distance = -1.0f;                 //< Distance along the ray from its start, negative on a miss
+	FVector3f Normal = FVector3f::ZeroVector;
+	int32     ElementIndex = INDEX_NONE;
+	int32     FaceIndex = INDEX_NONE;
+	uint32    MaterialId = 0u;
+	float     TraceTime = 0.0f;                 //< Milliseconds (see FTimer), only written by the RayTime modes or when gathering all attributes
+	float     TriangleArea2 = AreaNotMesh;      //< Twice the area of the hit triangle, only written by TriangleDensity
+
+	bool IsHit() const
+	{
+		return Distance >= 0.0f;
+	}
+};
+
+
+// Octahedral encoding of a unit vector into 2x16 bit snorm.
+FORCEINLINE uint32 PackOctNormal(const FVector3f& N)
+{
+	const float L1 = FMath::Abs(N.X) + FMath::Abs(N.Y) + FMath::Abs(N.Z);
+	if (L1 <= 0.0f)
+	{
+		return 0u;
+	}
+
+	float X = N.X / L1;
+	float Y = N.Y / L1;
+	if (N.Z < 0.0f)
+	{
+		const float FoldX = (1.0f - FMath::Abs(Y)) * (X >= 0.0f ? 1.0f : -1.0f);
+		const float FoldY = (1.0f - FMath::Abs(X)) * (Y >= 0.0f ? 1.0f : -1.0f);
+		X = FoldX;
+		Y = FoldY;
+	}
+
+	const int16 IX = (int16)FMath::RoundToInt(FMath::Clamp(X, -1.0f, 1.0f) * 32767.0f);
+	const int16 IY = (int16)FMath::RoundToInt(FMath::Clamp(Y, -1.0f, 1.0f) * 32767.0f);
+	return (uint32)(uint16)IX | ((uint32)(uint16)IY << 16);
+}
+
+FORCEINLINE FVector3f UnpackOctNormal(uint32 Packed)
+{
+	const float X = (float)(int16)(Packed & 0xffffu) / 32767.0f;
+	const float Y = (float)(int16)(Packed >> 16) / 32767.0f;
+
+	FVector3f N(X, Y, 1.0f - FMath::Abs(X) - FMath::Abs(Y));
+	const float T = FMath::Max(-N.Z, 0.0f);
+	N.X += N.X >= 0.0f ? -T : T;
+	N.Y += N.Y >= 0.0f ? -T : T;
+	return N.GetSafeNormal();
+}
+
+
+// FHitRecord packed down (along with the direction of the ray) to be kept per pixel, see FRenderBuffer::HitData.
+// Uploaded as is for the GPU to colour, keep in sync with SDCollisionVisCommon.ush
+struct FPackedHitRecord
+{
+	// Distance of a pixel which is waiting to be traced, e.g nothing reprojected onto it (see FRenderBuffer::Reproject)
+	static constexpr float DistanceInvalid = -2.0f;
+	// Distance of a pixel which is about to be traced, see FPerspectiveRenderer::PrioritisePixel
+	static constexpr float DistanceClaimed = -3.0f;
+	// Distance of a pixel which won't be traced, being left to the upsample in DrawTracedTexture.usf (see FPerspectiveRenderer::FindProgressivePixel)
+	static constexpr float DistanceInferred = -4.0f;
+
+	float  Distance = -1.0f;
+	uint32 Normal = 0u;                             //< Oct encoded
+	uint32 Direction = 0u;                          //< Oct encoded ray direction
+	int32  ElementIndex = INDEX_NONE;
+	int32  FaceIndex = INDEX_NONE;
+	uint32 MaterialId = 0u;
+	float  TraceTime = 0.0f;
+	float  TriangleArea2 = FHitRecord::AreaNotMesh;
+
+	static FPackedHitRecord Pack(const FHitRecord& Hit, const FVector& RayDirection)
+	{
+		FPackedHitRecord Packed;
+		Packed.Distance = Hit.Distance;
+		Packed.Normal = PackOctNormal(Hit.Normal);
+		Packed.Direction = PackOctNormal((FVector3f)RayDirection);
+		Packed.ElementIndex = Hit.ElementIndex;
+		Packed.FaceIndex = Hit.FaceIndex;
+		Packed.MaterialId = Hit.MaterialId;
+		Packed.TraceTime = Hit.TraceTime;
+		Packed.TriangleArea2 = Hit.TriangleArea2;
+		return Packed;
+	}
+
+	FHitRecord Unpack() const
+	{
+		FHitRecord Hit;
+		Hit.Distance = Distance;
+		Hit.Normal = UnpackOctNormal(Normal);
+		Hit.ElementIndex = ElementIndex;
+		Hit.FaceIndex = FaceIndex;
+		Hit.MaterialId = MaterialId;
+		Hit.TraceTime = TraceTime;
+		Hit.TriangleArea2 = TriangleArea2;
+		return Hit;
+	}
+
+	FVector GetDirection() const
+	{
+		return (FVector)UnpackOctNormal(Direction);
+	}
+
+	bool IsValid() const
+	{
+		return Distance != DistanceInvalid;
+	}
+
+	// Holds what a ray actually hit (or that it missed), rather than one of the sentinels above.
+	bool IsTraced() const
+	{
+		return Distance > DistanceInvalid;
+	}
 };
+static_assert(sizeof(FPackedHitRecord) == 32, "FPackedHitRecord is kept per pixel, keep it compact");
 
+
+// Everything other than the hit itself which goes into colouring a pixel.
+// The realtime renderer colours on the GPU (see DrawTracedTexture.usf), so these apply without retracing.
+struct FColourParams
+{
+	FVector RevViewForward = FVector::ZeroVector;
+	float RaytraceTimeMinTime = 0.0f;
+	float RaytraceTimeMaxTime = 0.0f;
+	float TriangleDensityMinArea2 = 0.0f;
+	float TriangleDensityMul = 0.0f;
+};
+
+
+// Realtime colouring happens in DrawTracedTexture.usf, keep the two in sync.
 template<EVisualisationType VisType>
-FORCEINLINE FColor CalculateVisualisationColour(bool bHit,
-												const FVector Origin,
-												FHitResult& HitResult,
+FORCEINLINE FColor CalculateVisualisationColour(const FHitRecord& Hit,
 												const FVector& TraceNormal,
-												const FVector& RevViewForward,
-												const FTimer& Timer,
-												const float TriangleDensityMinArea2,
-												const float TriangleDensityMul)
+												const FColourParams& Params)
 {
-
-	if constexpr (VisType == EVisualisationType::RayTimeEvenMiss)
+	if constexpr ((VisType == EVisualisationType::RayTime) || (VisType == EVisualisationType::RayTimeEvenMiss))
 	{
-		return Heatmap(Timer.Get());
+		const float ClippedTime = FMath::Clamp<float>((Hit.TraceTime - Params.RaytraceTimeMinTime) / (Params.RaytraceTimeMaxTime - Params.RaytraceTimeMinTime), 0.0f, 1.0f);
+		if constexpr (VisType == EVisualisationType::RayTimeEvenMiss)
+		{
+			return Heatmap(ClippedTime);
+		}
+		else
+		{
+			return Hit.IsHit() ? Heatmap(ClippedTime) : FColor::Black;
+		}
 	}
 
-	if (!bHit)
+	if (!Hit.IsHit())
 	{
 		return FColor::Black;
 	}
 
-	float FacingRatio = FMath::Clamp(-(float)TraceNormal.Dot(HitResult.Normal), 0.0f, 1.0f);
+	const FVector HitNormal = (FVector)Hit.Normal;
+	float FacingRatio = FMath::Clamp(-(float)TraceNormal.Dot(HitNormal), 0.0f, 1.0f);
 
 	if constexpr (VisType == EVisualisationType::Default)
 	{
 		float Fr = FacingRatio;
-		float Fg = FMath::Clamp((float)RevViewForward.Dot(HitResult.Normal), 0.0f, 1.0f);
+		float Fg = FMath::Clamp((float)Params.RevViewForward.Dot(HitNormal), 0.0f, 1.0f);
 		float Fb = FMath::Min(FMath::Sqrt(Fr * Fr + Fg * Fg), 1.0f);
 		uint8 Cr = (uint8)(Fr * 255.0f + 0.5f);
 		uint8 Cg = (uint8)(Fg * 255.0f + 0.5f);
@@ -178,142 +387,36 @@ FORCEINLINE FColor CalculateVisualisationColour(bool bHit,
 	}
 	else if constexpr (VisType == EVisualisationType::Primitive)
 	{
-		uint32 PrimIndex = HitResult.ElementIndex;
+		uint32 PrimIndex = Hit.ElementIndex;
 		return RandomColour(FUintVector(PrimIndex, 0, 0), FacingRatio);
 		
 	}
 	else if constexpr (VisType == EVisualisationType::Triangles)
 	{
-		uint32 PrimIndex = HitResult.ElementIndex;
-		uint32 FaceIndex = HitResult.FaceIndex;
+		uint32 PrimIndex = Hit.ElementIndex;
+		uint32 FaceIndex = Hit.FaceIndex;
 		return RandomColour(FUintVector(FaceIndex, PrimIndex, 0));
 	}
 	else if constexpr (VisType == EVisualisationType::Material)
 	{
-		uint32 MaterialId = 0;
-		if (UPhysicalMaterial* Material = HitResult.PhysMaterial.Get())
-		{
-			MaterialId = Material->GetUniqueID();
-		}
-		return RandomColour(FUintVector(MaterialId, 0, 0), FacingRatio);
-	}
-	else if constexpr (VisType == EVisualisationType::RayTime)
-	{
-		return Heatmap(Timer.Get());
+		return RandomColour(FUintVector(Hit.MaterialId, 0, 0), FacingRatio);
 	}
 	else if constexpr (VisType == EVisualisationType::TriangleDensity)
-	{		
-		FColor Result { (uint8)(127.0 * FacingRatio), 0, 0 };
-		Result.G = Result.R;
-		Result.B = Result.R;
-
-		UPrimitiveComponent* Component = HitResult.GetComponent();
-
-		// TODO:
-		// Things like instanced static meshes don't write back the phys object, but
-		// it can be fetched from the component directly.
-		// Sadly, it looks like the RayCast we do later always fails, which probably means
-		// there is some level of transform we need to do to account for this properly.
-#if 0
-		if (!HitResult.PhysicsObject)
+	{
+		if (Hit.TriangleArea2 >= 0.0f)
 		{
-			if (IPhysicsComponent* PhysComp = Cast<IPhysicsComponent>(Component))
-			{
-				HitResult.PhysicsObject = PhysComp->GetPhysicsObjectById(0); // Get the root physics object
-			}
+			float Area2 = FMath::Clamp(1.0 - (Hit.TriangleArea2 - Params.TriangleDensityMinArea2) * Params.TriangleDensityMul, 0.0, 1.0);
+			return Heatmap(Area2, FacingRatio);
 		}
-#endif
-
-		if (HitResult.PhysicsObject)
+		else if (Hit.TriangleArea2 == FHitRecord::AreaUnhandledMesh)
 		{
-			if (FChaosScene* Scene = static_cast<FChaosScene*>(FPhysicsObjectExternalInterface::GetScene(HitResult.PhysicsObject)))
-			{
-				FLockedReadPhysicsObjectExternalInterface Interface = FPhysicsObjectExternalInterface::LockRead(Scene);
-				if (Chaos::FImplicitObjectRef Ref = Interface->GetGeometry(HitResult.PhysicsObject))
-				{
-					if (Ref->IsUnderlyingMesh() || Ref->IsUnderlyingUnion())
-					{
-						FTransform RootTransform = Interface->GetTransform(HitResult.PhysicsObject);
-
-						// Unhandled mesh type
-						Result = FColor(0, 0, FacingRatio * 255.0f + 0.5f, 255);
-
-						Ref->VisitLeafObjects(
-							[&](const Chaos::FImplicitObject* Implicit, const Chaos::FRigidTransform3& RelativeTransform, const int32 RootObjectIndex, const int32 ObjectIndex, const int32 LeafObjectIndex)
-							{
-								Chaos::FRigidTransform3 Transform = RelativeTransform;
-								const Chaos::FTriangleMeshImplicitObject* TriangleMesh = Implicit->template GetObject<Chaos::FTriangleMeshImplicitObject>();
-
-								// Fetch mesh from nested type
-								if (!TriangleMesh)
-								{
-									// Scaled mesh
-									if (const Chaos::TImplicitObjectScaled<Chaos::FTriangleMeshImplicitObject>* ScaledTriangleMesh = Implicit->template GetObject<const Chaos::TImplicitObjectScaled<Chaos::FTriangleMeshImplicitObject>>())
-									{
-										Transform = Chaos::FRigidTransform3::Identity;
-										Transform.SetScale3D(ScaledTriangleMesh->GetScale());
-										Transform = RelativeTransform * Transform;
-										TriangleMesh = ScaledTriangleMesh->GetUnscaledObject();
-									}
-
-									// Instanced mesh
-									else if (const Chaos::TImplicitObjectInstanced<Chaos::FTriangleMeshImplicitObject>* InstancedTriangleMesh = Implicit->template GetObject<const Chaos::TImplicitObjectInstanced<Chaos::FTriangleMeshImplicitObject>>())
-									{
-										TriangleMesh = InstancedTriangleMesh->GetInstancedObject();
-									}
-								}
-
-								if (TriangleMesh)
-								{
-									FVector RayStart = HitResult.ImpactPoint - TraceNormal;
-
-									Chaos::FRigidTransform3 NodeTransform = Transform * RootTransform;
-									Chaos::FReal Time;
-									Chaos::FVec3 Pos;
-									Chaos::FVec3 N;
-									int32 ContactFaceIndex = INDEX_NONE;
-									if (TriangleMesh->Raycast(	NodeTransform.InverseTransformPosition(RayStart),
-																NodeTransform.InverseTransformVector(TraceNormal),
-																10.0, 0.0, Time, Pos, N, ContactFaceIndex))
-									{
-										Chaos::FVec3 pA{};
-										Chaos::FVec3 pB{};
-										Chaos::FVec3 pC{};
-										
-										const Chaos::FTrimeshIndexBuffer& Elements = TriangleMesh->Elements();
-										if (Elements.RequiresLargeIndices())
-										{
-											auto I = Elements.GetLargeIndexBuffer()[ContactFaceIndex];
-											pA = TriangleMesh->Particles().GetX(I[0]);
-											pB = TriangleMesh->Particles().GetX(I[1]);
-											pC = TriangleMesh->Particles().GetX(I[2]);
-										}
-										else
-										{
-											auto I = Elements.GetSmallIndexBuffer()[ContactFaceIndex];
-											pA = TriangleMesh->Particles().GetX(I[0]);
-											pB = TriangleMesh->Particles().GetX(I[1]);
-											pC = TriangleMesh->Particles().GetX(I[2]);
-										}
-
-										pA = NodeTransform.TransformPosition(pA);
-										pB = NodeTransform.TransformPosition(pB);
-										pC = NodeTransform.TransformPosition(pC);
-
-										pA -= pC;
-										pB -= pC;
-										float Area2 = pA.Cross(pB).Length();
-										Area2 = FMath::Clamp(1.0 - (Area2 - TriangleDensityMinArea2) * TriangleDensityMul, 0.0, 1.0);
-										Result = Heatmap(Area2, FacingRatio);
-									}
-								}
-
-							});
-					}
-				}
-			}
+			// Unhandled mesh type
+			return FColor(0, 0, FacingRatio * 255.0f + 0.5f, 255);
 		}
 
+		FColor Result { (uint8)(127.0 * FacingRatio), 0, 0 };
+		Result.G = Result.R;
+		Result.B = Result.R;
 		return Result;
 	}
 	else
@@ -397,6 +500,7 @@ struct FKernelExecutor
 					{
 					case ESamplingPattern::Linear:  { Next(Settings.template SetSamplingPattern<ESamplingPattern::Linear>(), Others...); break; }
 					case ESamplingPattern::R2:      { Next(Settings.template SetSamplingPattern<ESamplingPattern::R2>(), Others...); break; }
+					case ESamplingPattern::Sobol:   { Next(Settings.template SetSamplingPattern<ESamplingPattern::Sobol>(), Others...); break; }
 					}
 				}
 			};
@@ -416,15 +520,28 @@ struct FSDCollisionSettings
 	FSDCollisionSettings();
 	// Update parameters which are dependant on other parameters, which may have changed.
 	void UpdateSettings();
+	// Derive FrameId from a running count of traces (GFrameCounter unless told otherwise).
+	void SetSampleIndex(uint64 SampleIndex);
+
+	FColourParams GetColourParams(const FVector& RevViewForward) const;
+
+	// Hash of everything which changes what a trace hits (or what it records about the hit).
+	uint32 GetTraceHash() const;
 
 	EVisualisationType VisType = EVisualisationType::Default;
 	ESamplingPattern SamplingPattern = ESamplingPattern::Linear;
+	ETraceEngine TraceEngine = ETraceEngine::SceneQuery;
+	bool bGatherAllAttributes = false;	//< Gather everything the cheaper VisTypes need whatever VisType is (TriangleDensity areas aside), so hits can be coloured as any of them
 
 	FCollisionObjectQueryParams CollisionObjectQueryParams;
 	FCollisionQueryParams CollisionQueryParams;
 
 	uint32 TileSize = 8u;
 	float Scale = 0.5f;
+	float BudgetMs = 0.0f;		//< Realtime only, 0 traces a fixed 1px per tile
+	int32 RayBudget = 0;		//< Realtime only, rays per frame shared between every view, 0 for no limit
+	bool bLayered = false;		//< Realtime only, trace static and dynamic collision separately (see FRenderBuffer::StaticHitData)
+	bool bProgressive = false;	//< Realtime only, fill holes coarse to fine (see FPerspectiveRenderer::FindProgressivePixel)
 	double MinDistance = 0.0;
 	uint32 FrameId = 0u;
 	float RaytraceTimeMinTime = 0.0f;
@@ -445,6 +562,10 @@ struct FSDOfflineCollisionSettings : FSDCollisionSettings
 	int32 Resolution = 512;
 	int32 MaxRaysPerFrame = 1024;
 	bool bCubeMap = false;
+	bool bTiled = false;		//< Stream the render out a tile at a time, rather than keeping the whole image in memory
+	int32 OutputTileSize = 512;
+	bool bCompressBC7 = false;	//< Cubemaps only, when not tiled
+	EPanoramaProjection Panorama = EPanoramaProjection::None;
 	UWorld* World = nullptr;
 };
 
@@ -0,0 +1,248 @@
+// Copyright Splash Damage, Ltd. All Rights Reserved.
+
+#include "SDCollisionVisTiledImageWriter.h"
+#include "SDCollisionVisModule.h"
+
+#include <HAL/FileManager.h>
+#include <Misc/Paths.h>
+#include <Misc/ScopeLock.h>
+
+
+namespace SDCollisionVis
+{
+
+// See the TIFF 6.0 and BigTIFF specs
+namespace TiffTag
+{
+	constexpr uint16 ImageWidth = 256;
+	constexpr uint16 ImageLength = 257;
+	constexpr uint16 BitsPerSample = 258;
+	constexpr uint16 Compression = 259;
+	constexpr uint16 PhotometricInterpretation = 262;
+	constexpr uint16 SamplesPerPixel = 277;
+	constexpr uint16 PlanarConfiguration = 284;
+	constexpr uint16 TileWidth = 322;
+	constexpr uint16 TileLength = 323;
+	constexpr uint16 TileOffsets = 324;
+	constexpr uint16 TileByteCounts = 325;
+	constexpr uint16 ExtraSamples = 338;
+}
+
+namespace TiffType
+{
+	constexpr uint16 Short = 3;
+	constexpr uint16 Long = 4;
+	constexpr uint16 Long8 = 16;
+}
+
+static int32 GetTiffTypeSize(uint16 Type)
+{
+	return Type == TiffType::Short ? 2 : (Type == TiffType::Long ? 4 : 8);
+}
+
+
+FTiledTiffWriter::~FTiledTiffWriter()
+{
+	if (File)
+	{
+		File->Close();
+	}
+}
+
+bool FTiledTiffWriter::Open(const FString& InFilename, FIntPoint InImageSize, int32 InTileSize, int32 InNumPages)
+{
+	check(!File);
+	check(InTileSize > 0 && InNumPages > 0);
+
+	Filename = InFilename;
+	ImageSize = InImageSize;
+	TileSize = InTileSize;
+	NumPages = InNumPages;
+	NumTiles = FIntPoint(FMath::DivideAndRoundUp(ImageSize.X, TileSize), FMath::DivideAndRoundUp(ImageSize.Y, TileSize));
+	TileOffsets.SetNumZeroed(NumPages * NumTiles.X * NumTiles.Y);
+
+	// Leave some room for the directories, which go on the end
+	const uint64 TileBytes = (uint64)TileSize * (uint64)TileSize * 4;
+	const uint64 ImageBytes = TileBytes * (uint64)TileOffsets.Num();
+	bBigTiff = ImageBytes >= (MAX_uint32 - (uint64)TileOffsets.Num() * 16 - (1 << 16));
+
+	IFileManager::Get().MakeDirectory(*FPaths::GetPath(Filename), true);
+	File.Reset(IFileManager::Get().CreateFileWriter(*Filename));
+	if (!File)
+	{
+		return false;
+	}
+
+	// Little endian, with the offset of the first directory filled in by Close.
+	uint8 ByteOrder[2] = { 'I', 'I' };
+	File->Serialize(ByteOrder, sizeof(ByteOrder));
+	if (bBigTiff)
+	{
+		uint16 Version = 43;
+		uint16 OffsetSize = 8;
+		uint16 Reserved = 0;
+		*File << Version << OffsetSize << Reserved;
+	}
+	else
+	{
+		uint16 Version = 42;
+		*File << Version;
+	}
+	WriteOffset(0);
+
+	return !File->IsError();
+}
+
+void FTiledTiffWriter::WriteTile(int32 Page, FIntPoint Tile, TArrayView<FColor> Pixels)
+{
+	check(Pixels.Num() == TileSize * TileSize);
+
+	// FColor is laid out BGRA
+	for (FColor& Pixel : Pixels)
+	{
+		Swap(Pixel.R, Pixel.B);
+	}
+
+	FScopeLock ScopeLock(&Lock);
+	if (!File)
+	{
+		return;
+	}
+	TileOffsets[GetTileIndex(Page, Tile)] = (uint64)File->Tell();
+	File->Serialize(Pixels.GetData(), Pixels.Num() * sizeof(FColor));
+}
+
+bool FTiledTiffWriter::Close()
+{
+	FScopeLock ScopeLock(&Lock);
+	if (!File)
+	{
+		return false;
+	}
+
+	bool bComplete = true;
+	for (uint64 TileOffset : TileOffsets)
+	{
+		bComplete &= TileOffset != 0;
+	}
+	if (!bComplete)
+	{
+		UE_LOG(LogSDCollisionVis, Error, TEXT("%s is missing tiles"), *Filename);
+	}
+
+	const uint16 OffsetType = bBigTiff ? TiffType::Long8 : TiffType::Long;
+	const uint64 TileBytes = (uint64)TileSize * (uint64)TileSize * 4;
+	const int32 TilesPerPage = NumTiles.X * NumTiles.Y;
+
+	const uint64 FirstDirectory = (uint64)File->Tell();
+	uint64 DirectoryOffset = FirstDirectory;
+	for (int32 Page = 0; Page < NumPages; ++Page)
+	{
+		TArray<uint64> PageTileOffsets(&TileOffsets[Page * TilesPerPage], TilesPerPage);
+		TArray<uint64> PageTileByteCounts;
+		PageTileByteCounts.Init(TileBytes, TilesPerPage);
+
+		// Must be sorted by tag
+		const TArray<FEntry> Entries =
+		{
+			{ TiffTag::ImageWidth,                TiffType::Long,  { (uint64)ImageSize.X } },
+			{ TiffTag::ImageLength,               TiffType::Long,  { (uint64)ImageSize.Y } },
+			{ TiffTag::BitsPerSample,             TiffType::Short, { 8, 8, 8, 8 } },
+			{ TiffTag::Compression,               TiffType::Short, { 1 } },	//< None
+			{ TiffTag::PhotometricInterpretation, TiffType::Short, { 2 } },	//< RGB
+			{ TiffTag::SamplesPerPixel,           TiffType::Short, { 4 } },
+			{ TiffTag::PlanarConfiguration,       TiffType::Short, { 1 } },	//< Interleaved
+			{ TiffTag::TileWidth,                 TiffType::Long,  { (uint64)TileSize } },
+			{ TiffTag::TileLength,                TiffType::Long,  { (uint64)TileSize } },
+			{ TiffTag::TileOffsets,               OffsetType,      MoveTemp(PageTileOffsets) },
+			{ TiffTag::TileByteCounts,            OffsetType,      MoveTemp(PageTileByteCounts) },
+			{ TiffTag::ExtraSamples,              TiffType::Short, { 2 } },	//< Unassociated alpha
+		};
+
+		const uint64 NextOffset = (Page + 1 < NumPages) ? DirectoryOffset + GetDirectorySize(Entries) : 0;
+		WriteDirectory(Entries, DirectoryOffset, NextOffset);
+		DirectoryOffset = NextOffset;
+	}
+
+	// Point the header at the first directory
+	File->Seek(bBigTiff ? 8 : 4);
+	WriteOffset(FirstDirectory);
+
+	const bool bWritten = File->Close() && bComplete;
+	File.Reset();
+	return bWritten;
+}
+
+uint64 FTiledTiffWriter::GetDirectorySize(const TArray<FEntry>& Entries) const
+{
+	const uint64 InlineSize = bBigTiff ? 8 : 4;
+	uint64 Size = bBigTiff ? (8 + Entries.Num() * 20 + 8) : (2 + Entries.Num() * 12 + 4);
+	for (const FEntry& Entry : Entries)
+	{
+		const uint64 ValuesSize = (uint64)Entry.Values.Num() * GetTiffTypeSize(Entry.Type);
+		if (ValuesSize > InlineSize)
+		{
+			Size += Align(ValuesSize, 2);
+		}
+	}
+	return Size;
+}
+
+void FTiledTiffWriter::WriteDirectory(const TArray<FEntry>& Entries, uint64 Offset, uint64 NextOffset)
+{
+	const uint64 InlineSize = bBigTiff ? 8 : 4;
+
+	TArray<uint8> Directory;
+	TArray<uint8> Values;	//< Anything which doesn't fit inline, after the directory
+	auto Put = [](TArray<uint8>& Out, uint64 Value, int32 Size)
+	{
+		// Little endian
+		for (int32 Byte = 0; Byte < Size; ++Byte)
+		{
+			Out.Add((uint8)(Value >> (Byte * 8)));
+		}
+	};
+
+	const uint64 ValuesOffset = Offset + (bBigTiff ? (8 + Entries.Num() * 20 + 8) : (2 + Entries.Num() * 12 + 4));
+	Put(Directory, Entries.Num(), bBigTiff ? 8 : 2);
+	for (const FEntry& Entry : Entries)
+	{
+		const int32 TypeSize = GetTiffTypeSize(Entry.Type);
+		Put(Directory, Entry.Tag, 2);
+		Put(Directory, Entry.Type, 2);
+		Put(Directory, Entry.Values.Num(), bBigTiff ? 8 : 4);
+
+		TArray<uint8>& Out = ((uint64)Entry.Values.Num() * TypeSize > InlineSize) ? Values : Directory;
+		if (&Out == &Values)
+		{
+			Put(Directory, ValuesOffset + Values.Num(), (int32)InlineSize);
+		}
+
+		const int32 Start = Out.Num();
+		for (uint64 Value : Entry.Values)
+		{
+			Put(Out, Value, TypeSize);
+		}
+		const int32 Padding = (&Out == &Values) ? (Out.Num() - Start) % 2 : (int32)InlineSize - (Out.Num() - Start);
+		Put(Out, 0, Padding);
+	}
+	Put(Directory, NextOffset, bBigTiff ? 8 : 4);
+
+	File->Serialize(Directory.GetData(), Directory.Num());
+	File->Serialize(Values.GetData(), Values.Num());
+}
+
+void FTiledTiffWriter::WriteOffset(uint64 Value)
+{
+	if (bBigTiff)
+	{
+		*File << Value;
+	}
+	else
+	{
+		uint32 Value32 = (uint32)Value;
+		*File << Value32;
+	}
+}
+
+} // namespace SDCollisionVis
@@ -0,0 +1,59 @@
+// Copyright Splash Damage, Ltd. All Rights Reserved.
+
+#pragma once
+
+
+#include <CoreMinimal.h>
+#include <HAL/CriticalSection.h>
+#include <Templates/UniquePtr.h>
+
+
+namespace SDCollisionVis
+{
+
+// Streams an image out to a tiled TIFF a tile at a time, so nothing the size of the whole image is ever kept in memory.
+// Each page (e.g a cubemap face) is ImageSize, cut into TileSize x TileSize tiles, stored as uncompressed 8 bit RGBA.
+// Tiles are appended in whatever order they're written, with the directories saying where each one ended up written
+// out by Close. Images which won't fit in 4GB are written as BigTIFF.
+class FTiledTiffWriter
+{
+public:
+	~FTiledTiffWriter();
+
+	bool Open(const FString& InFilename, FIntPoint InImageSize, int32 InTileSize, int32 InNumPages);
+
+	// Thread safe. Pixels are TileSize x TileSize, with anything hanging off the edge of the image ignored,
+	// and get swizzled to RGBA in place.
+	void WriteTile(int32 Page, FIntPoint Tile, TArrayView<FColor> Pixels);
+
+	// Writes out the directories, returning false if anything failed to write along the way.
+	bool Close();
+
+	FIntPoint GetNumTiles() const { return NumTiles; }
+	const FString& GetFilename() const { return Filename; }
+
+private:
+	struct FEntry
+	{
+		uint16         Tag;
+		uint16         Type;
+		TArray<uint64> Values;
+	};
+
+	int32 GetTileIndex(int32 Page, FIntPoint Tile) const { return (Page * NumTiles.Y + Tile.Y) * NumTiles.X + Tile.X; }
+	uint64 GetDirectorySize(const TArray<FEntry>& Entries) const;
+	void WriteDirectory(const TArray<FEntry>& Entries, uint64 Offset, uint64 NextOffset);
+	void WriteOffset(uint64 Value);
+
+	FCriticalSection     Lock;	//< Held while writing to File
+	TUniquePtr<FArchive> File;
+	FString              Filename;
+	FIntPoint            ImageSize = FIntPoint::ZeroValue;
+	FIntPoint            NumTiles = FIntPoint::ZeroValue;
+	int32                TileSize = 0;
+	int32                NumPages = 0;
+	bool                 bBigTiff = false;
+	TArray<uint64>       TileOffsets;	//< Per page, per tile, 0 until written
+};
+
+} // namespace SDCollisionVis
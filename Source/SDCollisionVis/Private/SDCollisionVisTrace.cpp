@@ -0,0 +1,110 @@
+// Copyright Splash Damage, Ltd. All Rights Reserved.
+
+#include "SDCollisionVisTrace.h"
+#include "SDCollisionVisTriangleAreaCache.h"
+
+#include <Components/PrimitiveComponent.h>
+#include <Chaos/ChaosEngineInterface.h>
+#include <Chaos/Transform.h>
+#include <Chaos/TriangleMeshImplicitObject.h>
+#include <Physics/Experimental/PhysScene_Chaos.h>
+#include <PhysicsEngine/PhysicsObjectExternalInterface.h>
+
+
+namespace SDCollisionVis
+{
+
+float ResolveTriangleArea2_AssumesLocked(const FHitResult& HitResult)
+{
+	// Components which don't write back the physics object (e.g. instanced static meshes) aren't handled,
+	// picking the right leaf object would need the transform of the instance which was hit as well.
+	if (!HitResult.PhysicsObject)
+	{
+		return FHitRecord::AreaNotMesh;
+	}
+
+	// Caller holds the scene read lock for the whole batch, so no need to take it per hit.
+	FReadPhysicsObjectInterface_External Interface = FPhysicsObjectExternalInterface::GetRead_AssumesLocked();
+	Chaos::FImplicitObjectRef Ref = Interface.GetGeometry(HitResult.PhysicsObject);
+	if (!Ref || !(Ref->IsUnderlyingMesh() || Ref->IsUnderlyingUnion()))
+	{
+		return FHitRecord::AreaNotMesh;
+	}
+
+	if (HitResult.FaceIndex == INDEX_NONE)
+	{
+		return FHitRecord::AreaUnhandledMesh;
+	}
+
+	struct FCandidate
+	{
+		const Chaos::FTriangleMeshImplicitObject* Mesh;
+		Chaos::FRigidTransform3 Transform;
+		FVector3f Scale;
+	};
+	TArray<FCandidate, TInlineAllocator<4>> Candidates;
+
+	Ref->VisitLeafObjects(
+		[&](const Chaos::FImplicitObject* Implicit, const Chaos::FRigidTransform3& RelativeTransform, const int32 RootObjectIndex, const int32 ObjectIndex, const int32 LeafObjectIndex)
+		{
+			FCandidate Candidate { Implicit->template GetObject<Chaos::FTriangleMeshImplicitObject>(), RelativeTransform, FVector3f::OneVector };
+
+			// Fetch mesh from nested type
+			if (!Candidate.Mesh)
+			{
+				// Scaled mesh
+				if (const Chaos::TImplicitObjectScaled<Chaos::FTriangleMeshImplicitObject>* ScaledTriangleMesh = Implicit->template GetObject<const Chaos::TImplicitObjectScaled<Chaos::FTriangleMeshImplicitObject>>())
+				{
+					Candidate.Scale = (FVector3f)ScaledTriangleMesh->GetScale();
+					Candidate.Mesh = ScaledTriangleMesh->GetUnscaledObject();
+				}
+
+				// Instanced mesh
+				else if (const Chaos::TImplicitObjectInstanced<Chaos::FTriangleMeshImplicitObject>* InstancedTriangleMesh = Implicit->template GetObject<const Chaos::TImplicitObjectInstanced<Chaos::FTriangleMeshImplicitObject>>())
+				{
+					Candidate.Mesh = InstancedTriangleMesh->GetInstancedObject();
+				}
+			}
+
+			if (Candidate.Mesh)
+			{
+				Candidates.Add(Candidate);
+			}
+		});
+
+	if (Candidates.IsEmpty())
+	{
+		// Unhandled mesh type
+		return FHitRecord::AreaUnhandledMesh;
+	}
+
+	FTriangleAreaCache& Cache = FTriangleAreaCache::Get();
+
+	const FCandidate* Best = &Candidates[0];
+	TSharedPtr<const FTriangleMeshAreas> BestAreas = Cache.FindOrAdd(Best->Mesh);
+
+	// FaceIndex doesn't tell us which mesh of a union was hit, so pick the one with the face lying closest to the impact point.
+	if (Candidates.Num() > 1)
+	{
+		const FTransform RootTransform = Interface.GetTransform(HitResult.PhysicsObject);
+		float BestDistance = TNumericLimits<float>::Max();
+
+		for (const FCandidate& Candidate : Candidates)
+		{
+			TSharedPtr<const FTriangleMeshAreas> Areas = Cache.FindOrAdd(Candidate.Mesh);
+			const FVector LocalPoint = (Candidate.Transform * RootTransform).InverseTransformPosition(HitResult.ImpactPoint);
+			const float Distance = Areas->GetPlaneDistance(HitResult.FaceIndex, (FVector3f)LocalPoint / Candidate.Scale);
+			if (Distance < BestDistance)
+			{
+				BestDistance = Distance;
+				Best = &Candidate;
+				BestAreas = Areas;
+			}
+		}
+	}
+
+	const float Area2 = BestAreas->GetArea2(HitResult.FaceIndex, Best->Scale);
+	return Area2 >= 0.0f ? Area2 : FHitRecord::AreaUnhandledMesh;
+}
+
+} // namespace SDCollisionVis
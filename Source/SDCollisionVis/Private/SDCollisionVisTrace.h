@@ -0,0 +1,131 @@
+// Copyright Splash Damage, Ltd. All Rights Reserved.
+
+#pragma once
+
+
+#include <CoreMinimal.h>
+#include <Engine/World.h>
+#include <Engine/HitResult.h>
+#include <Physics/PhysicsInterfaceCore.h>
+#include <PhysicalMaterials/PhysicalMaterial.h>
+
+#include "SDCollisionVisSettings.h"
+
+
+namespace SDCollisionVis
+{
+
+struct FTraceRay
+{
+	FVector Start;
+	FVector Direction;
+};
+
+
+// Upper bound on how many rays get pushed through the scene query per batch.
+// Callers keep their ray/hit storage inline up to this size, so batches never hit the heap.
+constexpr int32 GMaxTraceBatchSize = 256;
+
+template<typename T>
+using TTraceBatchArray = TArray<T, TInlineAllocator<GMaxTraceBatchSize>>;
+
+
+// Resolves (twice) the area of the triangle hit by HitResult, via FTriangleAreaCache.
+// Must be called with the physics scene read lock held (e.g from within TraceRayBatch).
+float ResolveTriangleArea2_AssumesLocked(const FHitResult& HitResult);
+
+
+// Batched query stage.
+// Rather than going through UWorld::LineTraceSingleByObjectType per ray, this takes the scene read lock once for
+// the whole batch and reuses the query setup (and FHitResult scratch space) between rays, writing out a compact
+// FHitRecord for each one.
+template<EVisualisationType VisType>
+void TraceRayBatch(	UWorld* World,
+					const FSDCollisionSettings& Settings,
+					TArrayView<const FTraceRay> Rays,
+					TArrayView<FHitRecord> OutHits)
+{
+	check(Rays.Num() == OutHits.Num());
+
+	FPhysScene* PhysScene = World ? World->GetPhysicsScene() : nullptr;
+	if (!PhysScene)
+	{
+		for (FHitRecord& Hit : OutHits)
+		{
+			Hit = FHitRecord();
+		}
+		return;
+	}
+
+	const bool bUseTimer = (VisType == EVisualisationType::RayTime)
+							|| (VisType == EVisualisationType::RayTimeEvenMiss)
+							|| Settings.bGatherAllAttributes
+							;
+	const bool bGatherMaterial = (VisType == EVisualisationType::Material) || Settings.bGatherAllAttributes;
+
+	const FCollisionQueryParams& QueryParams = Settings.CollisionQueryParams;
+	const FCollisionObjectQueryParams& ObjectQueryParams = Settings.CollisionObjectQueryParams;
+	const FCollisionResponseParams& ResponseParams = FCollisionResponseParams::DefaultResponseParam;
+
+	// The scene lock is recursive for readers, so the per-ray queries below just bump the
+	// read count on this thread rather than contending on the lock again.
+	FPhysicsCommand::ExecuteRead(PhysScene, [&]()
+	{
+		FHitResult HitResult;
+
+		for (int32 RayIndex = 0; RayIndex < Rays.Num(); ++RayIndex)
+		{
+			const FTraceRay& Ray = Rays[RayIndex];
+			FHitRecord& Hit = OutHits[RayIndex];
+			Hit = FHitRecord();
+
+			FTimer Timer;
+			if (bUseTimer)
+			{
+				Timer.Start();
+			}
+
+			// Same channel UWorld uses for its object type queries.
+			bool bHit = FPhysicsInterface::RaycastSingle(	World,
+															HitResult,
+															Ray.Start,
+															Ray.Start + Ray.Direction * HALF_WORLD_MAX,
+															ECC_OverlapAll_Deprecated,
+															QueryParams,
+															ResponseParams,
+															ObjectQueryParams);
+
+			if (bUseTimer)
+			{
+				Timer.End();
+				Hit.TraceTime = Timer.Get();
+			}
+
+			if (!bHit)
+			{
+				continue;
+			}
+
+			Hit.Distance = (float)HitResult.Distance;
+			Hit.Normal = (FVector3f)HitResult.Normal;
+			Hit.ElementIndex = HitResult.ElementIndex;
+			Hit.FaceIndex = HitResult.FaceIndex;
+
+			if (bGatherMaterial)
+			{
+				if (UPhysicalMaterial* Material = HitResult.PhysMaterial.Get())
+				{
+					Hit.MaterialId = Material->GetUniqueID();
+				}
+			}
+
+			// Too expensive to resolve unless it's actually being looked at.
+			if constexpr (VisType == EVisualisationType::TriangleDensity)
+			{
+				Hit.TriangleArea2 = ResolveTriangleArea2_AssumesLocked(HitResult);
+			}
+		}
+	});
+}
+
+} // namespace SDCollisionVis
@@ -0,0 +1,123 @@
+// Copyright Splash Damage, Ltd. All Rights Reserved.
+
+#include "SDCollisionVisTriangleAreaCache.h"
+
+
+namespace SDCollisionVis
+{
+
+static TSharedPtr<const FTriangleMeshAreas> BuildTriangleMeshAreas(const Chaos::FTriangleMeshImplicitObject* Mesh)
+{
+	TSharedPtr<FTriangleMeshAreas> Areas = MakeShared<FTriangleMeshAreas>();
+	Areas->Mesh = Mesh;
+
+	const Chaos::FTrimeshIndexBuffer& Elements = Mesh->Elements();
+	const int32 NumTriangles = Elements.GetNumTriangles();
+
+	// Hit results report the external face index where the mesh keeps a remap
+	const bool bRemap = NumTriangles > 0 && Mesh->GetExternalFaceIndexFromInternal(0) != INDEX_NONE;
+	int32 NumFaces = NumTriangles;
+	if (bRemap)
+	{
+		for (int32 Triangle = 0; Triangle < NumTriangles; ++Triangle)
+		{
+			NumFaces = FMath::Max(NumFaces, Mesh->GetExternalFaceIndexFromInternal(Triangle) + 1);
+		}
+	}
+
+	Areas->FaceCross.SetNumZeroed(NumFaces);
+	Areas->FaceVertex.SetNumZeroed(NumFaces);
+
+	for (int32 Triangle = 0; Triangle < NumTriangles; ++Triangle)
+	{
+		FVector3f pA, pB, pC;
+		if (Elements.RequiresLargeIndices())
+		{
+			auto I = Elements.GetLargeIndexBuffer()[Triangle];
+			pA = Mesh->Particles().GetX(I[0]);
+			pB = Mesh->Particles().GetX(I[1]);
+			pC = Mesh->Particles().GetX(I[2]);
+		}
+		else
+		{
+			auto I = Elements.GetSmallIndexBuffer()[Triangle];
+			pA = Mesh->Particles().GetX(I[0]);
+			pB = Mesh->Particles().GetX(I[1]);
+			pC = Mesh->Particles().GetX(I[2]);
+		}
+
+		const int32 FaceIndex = bRemap ? Mesh->GetExternalFaceIndexFromInternal(Triangle) : Triangle;
+		if (Areas->FaceCross.IsValidIndex(FaceIndex))
+		{
+			Areas->FaceCross[FaceIndex] = FVector3f::CrossProduct(pB - pA, pC - pA);
+			Areas->FaceVertex[FaceIndex] = pA;
+		}
+	}
+
+	return Areas;
+}
+
+FTriangleAreaCache& FTriangleAreaCache::Get()
+{
+	static FTriangleAreaCache Cache;
+	return Cache;
+}
+
+TSharedPtr<const FTriangleMeshAreas> FTriangleAreaCache::FindOrAdd(const Chaos::FTriangleMeshImplicitObject* Mesh)
+{
+	{
+		FReadScopeLock ReadLock(Lock);
+		if (const TSharedPtr<const FTriangleMeshAreas>* Found = Meshes.Find(Mesh))
+		{
+			return *Found;
+		}
+	}
+
+	// Build outside of the lock, if another worker beat us to it, we just use theirs.
+	TSharedPtr<const FTriangleMeshAreas> Areas = BuildTriangleMeshAreas(Mesh);
+
+	FWriteScopeLock WriteLock(Lock);
+	if (const TSharedPtr<const FTriangleMeshAreas>* Found = Meshes.Find(Mesh))
+	{
+		return *Found;
+	}
+	Meshes.Add(Mesh, Areas);
+	return Areas;
+}
+
+void FTriangleAreaCache::PruneReleased()
+{
+	// Read first, since the common case is nothing to do
+	bool bAnyReleased = false;
+	{
+		FReadScopeLock ReadLock(Lock);
+		for (const auto& Pair : Meshes)
+		{
+			if (Pair.Value->Mesh.GetRefCount() == 1)
+			{
+				bAnyReleased = true;
+				break;
+			}
+		}
+	}
+
+	if (bAnyReleased)
+	{
+		FWriteScopeLock WriteLock(Lock);
+		for (auto It = Meshes.CreateIterator(); It; ++It)
+		{
+			if (It->Value->Mesh.GetRefCount() == 1)
+			{
+				It.RemoveCurrent();
+			}
+		}
+	}
+}
+
+void FTriangleAreaCache::Empty()
+{
+	FWriteScopeLock WriteLock(Lock);
+	Meshes.Empty();
+}
+
+} // namespace SDCollisionVis
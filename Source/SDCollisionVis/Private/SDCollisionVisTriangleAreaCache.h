@@ -0,0 +1,69 @@
+// Copyright Splash Damage, Ltd. All Rights Reserved.
+
+#pragma once
+
+
+#include <CoreMinimal.h>
+#include <Chaos/TriangleMeshImplicitObject.h>
+#include <Misc/ScopeRWLock.h>
+#include <Templates/RefCounting.h>
+
+
+namespace SDCollisionVis
+{
+
+// Per face data for a single triangle mesh, lazily built the first time one of its faces is hit.
+struct FTriangleMeshAreas
+{
+	// Keeps the mesh (and therefore the key) alive, entries get dropped once this is the last reference (see PruneReleased).
+	TRefCountPtr<const Chaos::FTriangleMeshImplicitObject> Mesh;
+
+	// Both are indexed by the face index reported in hit results (i.e the external face index, if the mesh has a remap)
+	TArray<FVector3f> FaceCross;    //< Unscaled (B - A) x (C - A)
+	TArray<FVector3f> FaceVertex;   //< Unscaled A
+
+	// Twice the area of the face, once Scale has been applied to the mesh. Negative if FaceIndex isn't valid.
+	float GetArea2(int32 FaceIndex, const FVector3f& Scale) const
+	{
+		if (!FaceCross.IsValidIndex(FaceIndex))
+		{
+			return -1.0f;
+		}
+
+		// Scaling the edges by S scales their cross product by the cofactor of S, which for a diagonal S is:
+		const FVector3f& Cross = FaceCross[FaceIndex];
+		return FVector3f(	Cross.X * Scale.Y * Scale.Z,
+							Cross.Y * Scale.X * Scale.Z,
+							Cross.Z * Scale.X * Scale.Y).Length();
+	}
+
+	// Distance of an (unscaled) mesh space point from the plane of the face.
+	float GetPlaneDistance(int32 FaceIndex, const FVector3f& LocalPoint) const
+	{
+		if (!FaceCross.IsValidIndex(FaceIndex))
+		{
+			return TNumericLimits<float>::Max();
+		}
+		return FMath::Abs(FVector3f::DotProduct(FaceCross[FaceIndex].GetSafeNormal(), LocalPoint - FaceVertex[FaceIndex]));
+	}
+};
+
+
+// Cache of FTriangleMeshAreas keyed by the mesh, shared by all the trace workers.
+class FTriangleAreaCache
+{
+public:
+	static FTriangleAreaCache& Get();
+
+	TSharedPtr<const FTriangleMeshAreas> FindOrAdd(const Chaos::FTriangleMeshImplicitObject* Mesh);
+
+	// Removes any meshes which are only being kept alive by the cache.
+	void PruneReleased();
+	void Empty();
+
+private:
+	FRWLock Lock;
+	TMap<const Chaos::FTriangleMeshImplicitObject*, TSharedPtr<const FTriangleMeshAreas>> Meshes;
+};
+
+} // namespace SDCollisionVis
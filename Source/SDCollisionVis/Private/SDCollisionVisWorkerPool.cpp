@@ -0,0 +1,429 @@
+// Copyright Splash Damage, Ltd. All Rights Reserved.
+
+#include "SDCollisionVisWorkerPool.h"
+#include "SDCollisionVisModule.h"
+
+#include <Async/ParallelFor.h>
+#include <HAL/ConsoleManager.h>
+#include <HAL/PlatformAffinity.h>
+#include <HAL/PlatformProcess.h>
+#include <HAL/PlatformTime.h>
+#include <Misc/ScopeLock.h>
+
+
+namespace SDCollisionVis
+{
+
+static TAutoConsoleVariable<int32> CVarWorkersEnable(
+	TEXT("r.SDCollisionVis.Workers.Enable"),
+	1,
+	TEXT("Trace on SDCollisionVis' own threads, rather than the shared task graph."),
+	ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarWorkersNumThreads(
+	TEXT("r.SDCollisionVis.Workers.NumThreads"),
+	0,
+	TEXT("Number of worker threads (the thread waiting on the trace helps out as well).\n")
+	TEXT("0 = A quarter of the logical cores"),
+	ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarWorkersPriority(
+	TEXT("r.SDCollisionVis.Workers.Priority"),
+	1,
+	TEXT("Priority of the worker threads:\n")
+	TEXT("0 = Lowest\n")
+	TEXT("1 = Below Normal\n")
+	TEXT("2 = Normal"),
+	ECVF_Default);
+
+DECLARE_DWORD_COUNTER_STAT(TEXT("Worker Threads"), STAT_SDCollisionVis_WorkerThreads, STATGROUP_SDCollisionVis);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Worker Steals"), STAT_SDCollisionVis_WorkerSteals, STATGROUP_SDCollisionVis);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("Worker Idle (ms)"), STAT_SDCollisionVis_WorkerIdleMs, STATGROUP_SDCollisionVis);
+
+
+static FORCEINLINE uint64 PackRange(uint32 Next, uint32 End)
+{
+	return ((uint64)Next << 32) | (uint64)End;
+}
+
+static FORCEINLINE void UnpackRange(uint64 Packed, uint32& OutNext, uint32& OutEnd)
+{
+	OutNext = (uint32)(Packed >> 32);
+	OutEnd = (uint32)(Packed & 0xffffffffu);
+}
+
+
+FTraceWorkerPool& FTraceWorkerPool::Get()
+{
+	static FTraceWorkerPool Pool;
+	return Pool;
+}
+
+FTraceWorkerPool::~FTraceWorkerPool()
+{
+	StopDispatcher();
+	StopThreads();
+}
+
+void FTraceWorkerPool::GetDesiredThreads(int32& OutNumThreads, EThreadPriority& OutPriority)
+{
+	// Leave at least one core to everyone else, whatever we're told.
+	const int32 NumCores = FPlatformMisc::NumberOfCoresIncludingHyperthreads();
+	const int32 NumThreadsCVar = CVarWorkersNumThreads.GetValueOnAnyThread();
+	OutNumThreads = FMath::Clamp(NumThreadsCVar > 0 ? NumThreadsCVar : NumCores / 4, 1, FMath::Max(NumCores - 1, 1));
+
+	OutPriority = TPri_BelowNormal;
+	switch (CVarWorkersPriority.GetValueOnAnyThread())
+	{
+	case 0: { OutPriority = TPri_Lowest; break; }
+	case 1: { OutPriority = TPri_BelowNormal; break; }
+	case 2: { OutPriority = TPri_Normal; break; }
+	}
+}
+
+int32 FTraceWorkerPool::GetNumParticipants() const
+{
+	if (CVarWorkersEnable.GetValueOnAnyThread() == 0)
+	{
+		return FTaskGraphInterface::Get().GetNumWorkerThreads() + 1;
+	}
+
+	int32 NumThreads;
+	EThreadPriority Priority;
+	GetDesiredThreads(NumThreads, Priority);
+	return NumThreads + 1;
+}
+
+void FTraceWorkerPool::ParallelFor(int32 Num, TFunctionRef<void(int32)> Body)
+{
+	if (Num <= 0)
+	{
+		return;
+	}
+
+	if (CVarWorkersEnable.GetValueOnAnyThread() == 0)
+	{
+		::ParallelFor(Num, Body);
+		return;
+	}
+
+	int32 NumThreads;
+	EThreadPriority Priority;
+	GetDesiredThreads(NumThreads, Priority);
+
+	FScopeLock Lock(&JobLock);
+	EnsureThreads(NumThreads, Priority);
+
+	// Contiguous shares, so neighbouring rows stay on the same thread unless they get stolen.
+	const int32 NumParticipants = Job.Ranges.Num();
+	for (int32 Participant = 0; Participant < NumParticipants; ++Participant)
+	{
+		const uint32 Begin = (uint32)(((int64)Num * Participant) / NumParticipants);
+		const uint32 End = (uint32)(((int64)Num * (Participant + 1)) / NumParticipants);
+		Job.Ranges[Participant].Packed = PackRange(Begin, End);
+	}
+	Job.Body = &Body;
+	Job.MemoryTags = FInheritedMemoryTags::Capture();
+	Job.NumSteals = 0;
+	Job.NumWorkersRunning = Workers.Num();
+
+	for (const TUniquePtr<FWorker>& Worker : Workers)
+	{
+		Worker->WakeEvent->Trigger();
+	}
+
+	RunParticipant(NumParticipants - 1);
+	DoneEvent->Wait();
+
+	// Time anyone spent with nothing left to do (or steal) while the job was still running.
+	const double EndTime = FPlatformTime::Seconds();
+	double IdleMs = 0.0;
+	for (double FinishTime : Job.FinishTime)
+	{
+		IdleMs += (EndTime - FinishTime) * 1000.0;
+	}
+	Job.Body = nullptr;
+
+	SET_DWORD_STAT(STAT_SDCollisionVis_WorkerThreads, Workers.Num());
+	INC_DWORD_STAT_BY(STAT_SDCollisionVis_WorkerSteals, Job.NumSteals.load());
+	INC_FLOAT_STAT_BY(STAT_SDCollisionVis_WorkerIdleMs, (float)IdleMs);
+}
+
+FGraphEventRef FTraceWorkerPool::ParallelForAsync(int32 Num, TFunction<void(int32)> Body)
+{
+	FGraphEventRef Event = FGraphEvent::CreateGraphEvent();
+
+	FScopeLock Lock(&AsyncLock);
+	if (!Dispatcher)
+	{
+		int32 NumThreads;
+		EThreadPriority Priority;
+		GetDesiredThreads(NumThreads, Priority);
+
+		Dispatcher = MakeUnique<FDispatcher>(*this);
+		Dispatcher->WakeEvent = FPlatformProcess::GetSynchEventFromPool(false);
+		Dispatcher->Thread.Reset(FRunnableThread::Create(	Dispatcher.Get(),
+															TEXT("SDCollisionVisDispatcher"),
+															0,
+															Priority,
+															FPlatformAffinity::GetPoolThreadMask()));
+	}
+
+	AsyncJobs.Add(FAsyncJob{ Num, MoveTemp(Body), Event, FInheritedMemoryTags::Capture() });
+	Dispatcher->WakeEvent->Trigger();
+	return Event;
+}
+
+void FTraceWorkerPool::Shutdown()
+{
+	StopDispatcher();
+
+	FScopeLock Lock(&JobLock);
+	StopThreads();
+}
+
+void FTraceWorkerPool::StopDispatcher()
+{
+	// Not held while joining, the dispatcher needs it to drain the queue.
+	TUniquePtr<FDispatcher> OldDispatcher;
+	{
+		FScopeLock Lock(&AsyncLock);
+		if (!Dispatcher)
+		{
+			return;
+		}
+		Dispatcher->Stop();
+		OldDispatcher = MoveTemp(Dispatcher);
+	}
+
+	if (OldDispatcher->Thread)
+	{
+		OldDispatcher->Thread->WaitForCompletion();
+		OldDispatcher->Thread.Reset();
+	}
+	FPlatformProcess::ReturnSynchEventToPool(OldDispatcher->WakeEvent);
+}
+
+void FTraceWorkerPool::EnsureThreads(int32 NumThreads, EThreadPriority Priority)
+{
+	if (Workers.Num() == NumThreads && WorkersPriority == Priority)
+	{
+		return;
+	}
+
+	StopThreads();
+
+	DoneEvent = FPlatformProcess::GetSynchEventFromPool(false);
+	Job.Ranges.SetNum(NumThreads + 1);
+	Job.FinishTime.SetNum(NumThreads + 1);
+	WorkersPriority = Priority;
+
+	for (int32 Index = 0; Index < NumThreads; ++Index)
+	{
+		TUniquePtr<FWorker>& Worker = Workers.Add_GetRef(MakeUnique<FWorker>(*this, Index));
+		Worker->WakeEvent = FPlatformProcess::GetSynchEventFromPool(false);
+		Worker->Thread.Reset(FRunnableThread::Create(	Worker.Get(),
+														*FString::Printf(TEXT("SDCollisionVisWorker %d"), Index),
+														0,
+														Priority,
+														FPlatformAffinity::GetPoolThreadMask()));
+	}
+}
+
+void FTraceWorkerPool::StopThreads()
+{
+	for (const TUniquePtr<FWorker>& Worker : Workers)
+	{
+		Worker->Stop();
+	}
+	for (const TUniquePtr<FWorker>& Worker : Workers)
+	{
+		if (Worker->Thread)
+		{
+			Worker->Thread->WaitForCompletion();
+			Worker->Thread.Reset();
+		}
+		FPlatformProcess::ReturnSynchEventToPool(Worker->WakeEvent);
+	}
+	Workers.Empty();
+
+	if (DoneEvent)
+	{
+		FPlatformProcess::ReturnSynchEventToPool(DoneEvent);
+		DoneEvent = nullptr;
+	}
+	Job.Ranges.Empty();
+	Job.FinishTime.Empty();
+}
+
+void FTraceWorkerPool::RunParticipant(int32 Participant)
+{
+	LLM_SCOPE(Job.MemoryTags.LLMTag);
+	UE_MEMSCOPE(Job.MemoryTags.TraceTag);
+
+	const int32 NumParticipants = Job.Ranges.Num();
+
+	int32 Index;
+	while (true)
+	{
+		while (PopLocal(Participant, Index))
+		{
+			(*Job.Body)(Index);
+		}
+
+		// Out of our own work, go looking for someone else's, starting with our neighbour so thieves spread out.
+		bool bStole = false;
+		for (int32 Offset = 1; Offset < NumParticipants && !bStole; ++Offset)
+		{
+			bStole = Steal((Participant + Offset) % NumParticipants, Participant);
+		}
+		if (!bStole)
+		{
+			break;
+		}
+		++Job.NumSteals;
+	}
+
+	Job.FinishTime[Participant] = FPlatformTime::Seconds();
+}
+
+FTraceWorkerPool::FInheritedMemoryTags FTraceWorkerPool::FInheritedMemoryTags::Capture()
+{
+	FInheritedMemoryTags Tags;
+#if ENABLE_LOW_LEVEL_MEM_TRACKER
+	if (FLowLevelMemTracker::IsEnabled())
+	{
+		Tags.LLMTag = FLowLevelMemTracker::Get().GetActiveTagData(ELLMTracker::Default);
+	}
+#endif // ENABLE_LOW_LEVEL_MEM_TRACKER
+#if UE_MEMORY_TAGS_TRACE_ENABLED
+	Tags.TraceTag = MemoryTrace_GetActiveTag();
+#endif // UE_MEMORY_TAGS_TRACE_ENABLED
+	return Tags;
+}
+
+bool FTraceWorkerPool::PopLocal(int32 Participant, int32& OutIndex)
+{
+	std::atomic<uint64>& Range = Job.Ranges[Participant].Packed;
+	uint64 Current = Range.load();
+	while (true)
+	{
+		uint32 Next, End;
+		UnpackRange(Current, Next, End);
+		if (Next >= End)
+		{
+			return false;
+		}
+		if (Range.compare_exchange_weak(Current, PackRange(Next + 1, End)))
+		{
+			OutIndex = (int32)Next;
+			return true;
+		}
+	}
+}
+
+bool FTraceWorkerPool::Steal(int32 Victim, int32 Thief)
+{
+	std::atomic<uint64>& Range = Job.Ranges[Victim].Packed;
+	uint64 Current = Range.load();
+	while (true)
+	{
+		uint32 Next, End;
+		UnpackRange(Current, Next, End);
+		if (Next >= End)
+		{
+			return false;
+		}
+
+		// Take the back half (rounding up, so the last one can be taken too)
+		const uint32 Mid = End - (End - Next + 1) / 2;
+		if (Range.compare_exchange_weak(Current, PackRange(Next, Mid)))
+		{
+			// Our own range is empty, and nobody steals from an empty range, so it's ours to set.
+			Job.Ranges[Thief].Packed = PackRange(Mid, End);
+			return true;
+		}
+	}
+}
+
+
+uint32 FTraceWorkerPool::FWorker::Run()
+{
+	while (true)
+	{
+		WakeEvent->Wait();
+		if (bStop)
+		{
+			break;
+		}
+
+		Pool.RunParticipant(Index);
+		if (Pool.Job.NumWorkersRunning.fetch_sub(1) == 1)
+		{
+			Pool.DoneEvent->Trigger();
+		}
+	}
+	return 0;
+}
+
+void FTraceWorkerPool::FWorker::Stop()
+{
+	bStop = true;
+	if (WakeEvent)
+	{
+		WakeEvent->Trigger();
+	}
+}
+
+
+uint32 FTraceWorkerPool::FDispatcher::Run()
+{
+	while (true)
+	{
+		FAsyncJob AsyncJob;
+		bool bDrained = false;
+		{
+			// bStop is set under the same lock, so nothing can be queued between seeing it empty and stopping.
+			FScopeLock Lock(&Pool.AsyncLock);
+			if (!Pool.AsyncJobs.IsEmpty())
+			{
+				AsyncJob = MoveTemp(Pool.AsyncJobs[0]);
+				Pool.AsyncJobs.RemoveAt(0, 1, EAllowShrinking::No);
+			}
+			else
+			{
+				bDrained = bStop;
+			}
+		}
+
+		if (bDrained)
+		{
+			break;
+		}
+		if (!AsyncJob.Event)
+		{
+			WakeEvent->Wait();
+			continue;
+		}
+
+		{
+			// Scoped here so ParallelFor hands them on to the workers.
+			LLM_SCOPE(AsyncJob.MemoryTags.LLMTag);
+			UE_MEMSCOPE(AsyncJob.MemoryTags.TraceTag);
+			Pool.ParallelFor(AsyncJob.Num, [&AsyncJob](int32 Index) { AsyncJob.Body(Index); });
+		}
+		AsyncJob.Event->DispatchSubsequents();
+	}
+	return 0;
+}
+
+void FTraceWorkerPool::FDispatcher::Stop()
+{
+	bStop = true;
+	if (WakeEvent)
+	{
+		WakeEvent->Trigger();
+	}
+}
+
+} // namespace SDCollisionVis
@@ -0,0 +1,142 @@
+// Copyright Splash Damage, Ltd. All Rights Reserved.
+
+#pragma once
+
+
+#include <CoreMinimal.h>
+#include <Async/TaskGraphInterfaces.h>
+#include <HAL/Runnable.h>
+#include <HAL/RunnableThread.h>
+#include <HAL/Event.h>
+#include <HAL/LowLevelMemTracker.h>
+#include <ProfilingDebugging/TagTrace.h>
+#include <Templates/UniquePtr.h>
+
+#include <atomic>
+
+
+namespace SDCollisionVis
+{
+
+// Threads dedicated to tracing, so the overlay doesn't compete with the rest of the frame on the task graph.
+// Kept to a few low priority threads (see r.SDCollisionVis.Workers.*), each job gets split evenly between them
+// (and the calling thread), with anyone running out of work stealing half of what's left from someone else.
+class FTraceWorkerPool
+{
+public:
+	static FTraceWorkerPool& Get();
+
+	~FTraceWorkerPool();
+
+	// Runs Body(Index) for every Index in [0, Num) across the pool, returning once they've all finished.
+	// Falls back to the task graph's ParallelFor if the pool is disabled.
+	// Whatever the workers allocate is tagged with the caller's memory scope (LLM and Memory Insights), as on the task graph.
+	// Jobs don't overlap, callers queue up behind whichever is running, so Body mustn't call back into the pool.
+	void ParallelFor(int32 Num, TFunctionRef<void(int32)> Body);
+
+	// As ParallelFor, but returns straight away with an event which completes once every Body(Index) has finished.
+	// Jobs are run in the order they were queued, by a thread of the pool's own standing in for the caller,
+	// so they take turns with ParallelFor callers rather than adding more threads.
+	FGraphEventRef ParallelForAsync(int32 Num, TFunction<void(int32)> Body);
+
+	// Number of threads a job is currently shared between (including the caller's).
+	int32 GetNumParticipants() const;
+
+	// Stops and joins all the threads, they'll be started again by the next job.
+	// Any async jobs still queued are run first, so nothing is left waiting on them.
+	void Shutdown();
+
+private:
+	// What's left of a participant's share of the job, (Next << 32 | End).
+	// Owners take from the front, thieves take half from the back.
+	struct alignas(PLATFORM_CACHE_LINE_SIZE) FRange
+	{
+		std::atomic<uint64> Packed = 0;
+	};
+
+	// The memory tags active on whoever handed over the work, for the threads running it to take on.
+	struct FInheritedMemoryTags
+	{
+#if ENABLE_LOW_LEVEL_MEM_TRACKER
+		const UE::LLMPrivate::FTagData* LLMTag = nullptr;
+#endif // ENABLE_LOW_LEVEL_MEM_TRACKER
+#if UE_MEMORY_TAGS_TRACE_ENABLED
+		int32                           TraceTag = 0;
+#endif // UE_MEMORY_TAGS_TRACE_ENABLED
+
+		static FInheritedMemoryTags Capture();
+	};
+
+	struct FJob
+	{
+		TFunctionRef<void(int32)>* Body = nullptr;
+		FInheritedMemoryTags       MemoryTags;
+		TArray<FRange>             Ranges;				//< One per participant, the calling thread being the last
+		TArray<double>             FinishTime;			//< When each participant ran out of work, for the idle stat
+		std::atomic<int32>         NumWorkersRunning = 0;
+		std::atomic<int32>         NumSteals = 0;
+	};
+
+	class FWorker final : public FRunnable
+	{
+	public:
+		FWorker(FTraceWorkerPool& InPool, int32 InIndex) : Pool(InPool), Index(InIndex) {}
+
+		/** FRunnable implementation */
+		uint32 Run() override;
+		void Stop() override;
+
+		FTraceWorkerPool&           Pool;
+		int32                       Index;
+		FEvent*                     WakeEvent = nullptr;
+		std::atomic<bool>           bStop = false;
+		TUniquePtr<FRunnableThread> Thread;
+	};
+
+	struct FAsyncJob
+	{
+		int32                  Num = 0;
+		TFunction<void(int32)> Body;
+		FGraphEventRef         Event;
+		FInheritedMemoryTags   MemoryTags;
+	};
+
+	// Runs the jobs queued by ParallelForAsync, one after another, as the calling thread of a ParallelFor.
+	class FDispatcher final : public FRunnable
+	{
+	public:
+		explicit FDispatcher(FTraceWorkerPool& InPool) : Pool(InPool) {}
+
+		/** FRunnable implementation */
+		uint32 Run() override;
+		void Stop() override;
+
+		FTraceWorkerPool&           Pool;
+		FEvent*                     WakeEvent = nullptr;
+		std::atomic<bool>           bStop = false;
+		TUniquePtr<FRunnableThread> Thread;
+	};
+
+	// What the CVars currently ask for.
+	static void GetDesiredThreads(int32& OutNumThreads, EThreadPriority& OutPriority);
+
+	// Starts (or restarts) the threads if the CVars have changed since they were made. JobLock must be held.
+	void EnsureThreads(int32 NumThreads, EThreadPriority Priority);
+	void StopThreads();
+	void StopDispatcher();
+	void RunParticipant(int32 Participant);
+	bool PopLocal(int32 Participant, int32& OutIndex);
+	bool Steal(int32 Victim, int32 Thief);
+
+	FCriticalSection            JobLock;		//< Held for the duration of each job
+	TArray<TUniquePtr<FWorker>> Workers;
+	EThreadPriority             WorkersPriority = TPri_Normal;
+	FEvent*                     DoneEvent = nullptr;	//< Triggered by the last worker to finish a job
+	FJob                        Job;
+
+	FCriticalSection            AsyncLock;		//< Guards AsyncJobs and Dispatcher
+	TArray<FAsyncJob>           AsyncJobs;		//< Oldest first
+	TUniquePtr<FDispatcher>     Dispatcher;
+};
+
+} // namespace SDCollisionVis